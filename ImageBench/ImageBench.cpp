@@ -0,0 +1,184 @@
+#include "../ImageDiff/ImageRMSE.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Times the load, convert, metric and save stages of ImageRMSE on synthetic images.
+     */
+    class Benchmark
+    {
+    public:
+        struct Config
+        {
+            std::vector<int> sizes;
+            std::vector<unsigned> threads;
+            int repeat = 3;
+        };
+
+        static void run(const Config & config)
+        {
+            std::cout << std::left << std::setw(22) << "stage" << std::setw(12) << "size" << std::setw(9) << "threads"
+                      << std::right << std::setw(12) << "ms" << std::setw(12) << "MPixel/s" << std::setw(10) << "GB/s" << std::endl;
+
+            for (int size : config.sizes)
+            {
+                std::string input = "imagebench_" + std::to_string(size) + ".exr";
+                std::string output = "imagebench_" + std::to_string(size) + "_out.exr";
+                if (!writeSyntheticImage(input, size, size))
+                {
+                    std::cerr << "Failed to write synthetic image " << input << std::endl;
+                    continue;
+                }
+
+                for (unsigned threads : config.threads)
+                {
+                    ImageRMSE::setThreadCount(threads);
+
+                    const size_t pixels = static_cast<size_t>(size) * size;
+                    const size_t lum = pixels * sizeof(LuminanceType);
+                    const size_t rgba = pixels * 4 * sizeof(float);
+
+                    // Candidate and reference differ by a small pattern so the metrics do real work.
+                    int width = 0, height = 0;
+                    LuminanceBuffer image1, image2;
+                    double ms = best(config.repeat, [&] { image1 = ImageRMSE::loadImageToLuminance(input, &width, &height); });
+                    report("loadImageToLuminance", size, threads, ms, pixels, rgba + lum);
+                    image2 = image1;
+                    for (size_t i = 0; i < image2.size(); i += 7)
+                        image2[i] += 0.01f;
+
+                    volatile double sink = 0.0;
+                    ms = best(config.repeat, [&] { sink = ImageRMSE::rmse(image1, image2); });
+                    report("rmse", size, threads, ms, pixels, 2 * lum);
+
+                    ms = best(config.repeat, [&] { sink = ImageRMSE::maxDiff(image1, image2).second; });
+                    report("maxDiff", size, threads, ms, pixels, 2 * lum);
+
+                    LuminanceBuffer diff;
+                    ms = best(config.repeat, [&] { diff = diffVector(image1, image2); });
+                    report("diffVector", size, threads, ms, pixels, 3 * lum);
+
+                    ms = best(config.repeat, [&] { sink = ImageRMSE::fusedMetrics(image1, image2, width, height).sumSquaredError; });
+                    report("fusedMetrics", size, threads, ms, pixels, 2 * lum);
+
+                    ms = best(config.repeat, [&] { sink = ImageMetrics::relMSE(image1.data(), image2.data(), width, height, *ImageRMSE::pool()); });
+                    report("relMSE", size, threads, ms, pixels, 2 * lum);
+
+                    ms = best(config.repeat, [&] { sink = ImageMetrics::ssim(image1.data(), image2.data(), width, height, 1.0, *ImageRMSE::pool()); });
+                    report("ssim", size, threads, ms, pixels, 2 * lum);
+
+                    ms = best(config.repeat, [&] { ImageRMSE::saveLuminanceImage(diff, width, height, output); });
+                    report("saveLuminanceImage", size, threads, ms, pixels, lum + rgba);
+                    (void)sink;
+                }
+
+                std::remove(input.c_str());
+                std::remove(output.c_str());
+            }
+        }
+
+    private:
+        /**
+         * @return Best wall time of repeat runs, in milliseconds.
+         */
+        template<typename F>
+        static double best(int repeat, F stage)
+        {
+            double bestMs = 0.0;
+            for (int i = 0; i < std::max(repeat, 1); ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                stage();
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                if (i == 0 || ms < bestMs)
+                    bestMs = ms;
+            }
+            return bestMs;
+        }
+
+        /**
+         * @param bytes Bytes read plus written by the stage, for the GB/s column.
+         */
+        static void report(const char *stage, int size, unsigned threads, double ms, size_t pixels, size_t bytes)
+        {
+            double seconds = std::max(ms, 1e-6) / 1000.0;
+            std::ostringstream resolution;
+            resolution << size << "x" << size;
+            std::cout << std::left << std::setw(22) << stage << std::setw(12) << resolution.str() << std::setw(9) << threads
+                      << std::right << std::fixed << std::setprecision(3) << std::setw(12) << ms
+                      << std::setprecision(1) << std::setw(12) << pixels / seconds / 1e6
+                      << std::setprecision(2) << std::setw(10) << bytes / seconds / 1e9 << std::endl;
+        }
+
+        static bool writeSyntheticImage(const std::string & filename, int width, int height)
+        {
+            FIBITMAP *bitmap = FreeImage_AllocateT(FIT_RGBAF, width, height);
+            if (!bitmap)
+                return false;
+            for (int y = 0; y < height; ++y)
+            {
+                float *bits = reinterpret_cast<float *>(FreeImage_GetScanLine(bitmap, y));
+                for (int x = 0; x < width; ++x, bits += 4)
+                {
+                    bits[0] = static_cast<float>(x % 256) / 255.f;
+                    bits[1] = static_cast<float>(y % 256) / 255.f;
+                    bits[2] = static_cast<float>((x + y) % 256) / 255.f;
+                    bits[3] = 1.f;
+                }
+            }
+            bool ok = FreeImage_Save(FIF_EXR, bitmap, filename.c_str(), EXR_FLOAT) != 0;
+            FreeImage_Unload(bitmap);
+            return ok;
+        }
+    };
+}
+
+using namespace ImageUtil;
+
+template<typename T>
+static std::vector<T> parseList(const std::string & text)
+{
+    std::vector<T> values;
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (std::atoi(item.c_str()) > 0)
+            values.push_back(static_cast<T>(std::atoi(item.c_str())));
+    return values;
+}
+
+int main(int argc, char* argv[])
+{
+    Benchmark::Config config;
+    config.sizes = { 1024, 2048, 4096 };
+    config.threads = { 1, std::max(std::thread::hardware_concurrency(), 1u) };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc)
+            config.sizes = parseList<int>(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            config.threads = parseList<unsigned>(argv[++i]);
+        else if (arg == "--repeat" && i + 1 < argc)
+            config.repeat = std::atoi(argv[++i]);
+        else
+        {
+            std::cerr << "Benchmark Usage: " << argv[0] << " <--sizes 1024,2048,4096> <--threads 1,8> <--repeat 3>" << std::endl;
+            return 1;
+        }
+    }
+
+    Benchmark::run(config);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "freeImage/FreeImagePlus.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Background encoder/writer for output images, so comparisons don't wait for
+     *        EXR compression and several files are encoded in parallel. Queued bitmaps
+     *        are owned by the writer and unloaded once saved.
+     */
+    class AsyncImageWriter
+    {
+    public:
+        /**
+         * @param threads Number of writer threads.
+         * @param pendingLimit Writes queued or running before save() blocks, which bounds
+         *                   the memory held by bitmaps waiting to be encoded.
+         */
+        explicit AsyncImageWriter(unsigned threads = 2, size_t pendingLimit = 4)
+            : maxPending(std::max<size_t>(pendingLimit, 1)), workers(threads + 1)
+        {
+        }
+
+        ~AsyncImageWriter()
+        {
+            wait();
+        }
+
+        AsyncImageWriter(const AsyncImageWriter &) = delete;
+        AsyncImageWriter & operator=(const AsyncImageWriter &) = delete;
+
+        /**
+         * @brief Queue bitmap to be saved to filename with FreeImage save flags.
+         * @param release Takes the bitmap once saved, e.g. back to a pool. FreeImage_Unload() if empty.
+         * @return Whether the save succeeded, once it has finished.
+         */
+        std::future<bool> save(FIBITMAP *bitmap, const std::string & filename, FREE_IMAGE_FORMAT format, int flags,
+                               std::function<void(FIBITMAP *)> release = std::function<void(FIBITMAP *)>())
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotFree.wait(lock, [this] { return pending < maxPending; });
+                ++pending;
+            }
+
+            return workers.submit([this, bitmap, filename, format, flags, release]
+            {
+                bool saved;
+                {
+                    Profiler::Stage stage("save", filename);
+                    stage.set("pixels", static_cast<long long>(FreeImage_GetWidth(bitmap)) * FreeImage_GetHeight(bitmap));
+                    saved = FreeImage_Save(format, bitmap, filename.c_str(), flags) != 0;
+                }
+                if (release)
+                    release(bitmap);
+                else
+                    FreeImage_Unload(bitmap);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --pending;
+                slotFree.notify_all();
+                return saved;
+            });
+        }
+
+        /**
+         * @brief Block until every queued write has finished.
+         */
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFree.wait(lock, [this] { return pending == 0; });
+        }
+
+    private:
+        const size_t maxPending;
+        size_t pending = 0;
+        std::mutex mutex;
+        std::condition_variable slotFree;
+        /* Last, so the worker threads are joined before the state they use goes away. */
+        ThreadPool workers;
+    };
+}
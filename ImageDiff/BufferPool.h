@@ -0,0 +1,166 @@
+#pragma once
+
+#include "freeImage/FreeImagePlus.h"
+
+#include <list>
+#include <mutex>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Recycles released buffers of equal size between comparisons, so batch runs
+     *        don't allocate and fault in fresh pages for every image. Buffers beyond the
+     *        byte limit are dropped, least recently released first. Thread-safe.
+     */
+    template<typename T>
+    class BufferPool
+    {
+    public:
+        explicit BufferPool(size_t maxBytes = size_t(1) << 30)
+            : limit(maxBytes)
+        {
+        }
+
+        /**
+         * @return Buffer of count elements, contents unspecified when recycled.
+         */
+        std::vector<T> acquire(size_t count)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto it = buffers.begin(); it != buffers.end(); ++it)
+                {
+                    if (it->size() == count)
+                    {
+                        std::vector<T> buffer = std::move(*it);
+                        buffers.erase(it);
+                        bytes -= count * sizeof(T);
+                        return buffer;
+                    }
+                }
+            }
+            return std::vector<T>(count);
+        }
+
+        void release(std::vector<T> && buffer)
+        {
+            size_t size = buffer.size() * sizeof(T);
+            if (size == 0 || size > limit)
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_front(std::move(buffer));
+            bytes += size;
+            trim();
+        }
+
+        void setLimit(size_t maxBytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = maxBytes;
+            trim();
+        }
+
+    private:
+        void trim()
+        {
+            while (bytes > limit)
+            {
+                bytes -= buffers.back().size() * sizeof(T);
+                buffers.pop_back();
+            }
+        }
+
+        std::list<std::vector<T>> buffers;
+        size_t bytes = 0;
+        size_t limit;
+        std::mutex mutex;
+    };
+
+    /**
+     * @brief BufferPool counterpart for bitmaps from FreeImage_AllocateT, recycled by
+     *        type and size. Pooled bitmaps are unloaded when dropped or on destruction.
+     */
+    class BitmapPool
+    {
+    public:
+        explicit BitmapPool(size_t maxBytes = size_t(1) << 30)
+            : limit(maxBytes)
+        {
+        }
+
+        ~BitmapPool()
+        {
+            for (FIBITMAP *bitmap : bitmaps)
+                FreeImage_Unload(bitmap);
+        }
+
+        BitmapPool(const BitmapPool &) = delete;
+        BitmapPool & operator=(const BitmapPool &) = delete;
+
+        /**
+         * @return nullptr if FreeImage can't allocate the bitmap, contents unspecified when recycled.
+         */
+        FIBITMAP * acquire(FREE_IMAGE_TYPE type, int width, int height)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto it = bitmaps.begin(); it != bitmaps.end(); ++it)
+                {
+                    FIBITMAP *bitmap = *it;
+                    if (FreeImage_GetImageType(bitmap) == type && static_cast<int>(FreeImage_GetWidth(bitmap)) == width &&
+                        static_cast<int>(FreeImage_GetHeight(bitmap)) == height)
+                    {
+                        bitmaps.erase(it);
+                        bytes -= sizeOf(bitmap);
+                        return bitmap;
+                    }
+                }
+            }
+            return FreeImage_AllocateT(type, width, height);
+        }
+
+        void release(FIBITMAP *bitmap)
+        {
+            if (!bitmap)
+                return;
+            if (sizeOf(bitmap) > limit)
+            {
+                FreeImage_Unload(bitmap);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            bitmaps.push_front(bitmap);
+            bytes += sizeOf(bitmap);
+            trim();
+        }
+
+        void setLimit(size_t maxBytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = maxBytes;
+            trim();
+        }
+
+    private:
+        static size_t sizeOf(FIBITMAP *bitmap)
+        {
+            return static_cast<size_t>(FreeImage_GetPitch(bitmap)) * FreeImage_GetHeight(bitmap);
+        }
+
+        void trim()
+        {
+            while (bytes > limit)
+            {
+                bytes -= sizeOf(bitmaps.back());
+                FreeImage_Unload(bitmaps.back());
+                bitmaps.pop_back();
+            }
+        }
+
+        std::list<FIBITMAP *> bitmaps;
+        size_t bytes = 0;
+        size_t limit;
+        std::mutex mutex;
+    };
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+// winsock2.h has to come before the windows.h that ImageRMSE.h pulls in.
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "ImageRMSE.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Limits and output directory of a ComparisonServer.
+     */
+    struct ServerOptions
+    {
+        /* Directory that relative "diff" and "tiles" paths of requests are written
+           to, empty to reject requests with outputs. */
+        std::string outputDirectory;
+        /* Connections served at once, further ones are answered with an error and closed. */
+        size_t maxConnections = 64;
+        /* Longest request line, a connection sending a longer one is closed. */
+        size_t maxLineBytes = 1 << 20;
+    };
+
+    /**
+     * @brief Long-running comparison service, which saves the process start and the
+     *        reference decode of every comparison. Requests are manifest lines (JSON or
+     *        CSV) and are answered with the result lines of runManifest() in completion
+     *        order, "index" counting the requests of a connection from 0. Comparisons run
+     *        on the ImageRMSE thread pool and decoded references stay cached between
+     *        requests within ImageRMSE::setReferenceCacheLimit(). The line
+     *        {"command": "stats"} reports the cache use.
+     *        Any local process (and a browser page posting to 127.0.0.1) can reach the
+     *        socket, so the "diff" and "tiles" outputs are only written below
+     *        ServerOptions::outputDirectory, and connections speaking HTTP are dropped.
+     *        Connections and request lines are limited, see ServerOptions.
+     */
+    class ComparisonServer
+    {
+    public:
+        /**
+         * @brief Serve requests read from in until it ends.
+         */
+        static void servePipe(std::istream & in, std::ostream & out, const ServerOptions & options = ServerOptions())
+        {
+            Session session([&out](const std::string & line)
+            {
+                out << line << std::endl;
+                return bool(out);
+            }, options);
+            std::string line;
+            while (std::getline(in, line))
+                session.handle(line);
+            session.finish();
+        }
+
+        /**
+         * @brief Serve connections to 127.0.0.1:port, each on its own thread, which is joined
+         *        once the connection closed. Only returns if listening fails.
+         */
+        static bool serveSocket(int port, const ServerOptions & options = ServerOptions())
+        {
+#ifdef _WIN32
+            WSADATA data;
+            if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+            {
+                std::cerr << "Failed to initialize Winsock" << std::endl;
+                return false;
+            }
+#endif
+            Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (listener == InvalidSocket)
+            {
+                std::cerr << "Failed to create socket" << std::endl;
+                return false;
+            }
+            int reuse = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<unsigned short>(port));
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+            {
+                std::cerr << "Failed to listen on port " << port << std::endl;
+                closeSocket(listener);
+                return false;
+            }
+            std::cerr << "Listening on 127.0.0.1:" << port << std::endl;
+
+            std::vector<Connection> connections;
+            for (;;)
+            {
+                Socket connection = accept(listener, nullptr, nullptr);
+                if (connection == InvalidSocket)
+                    continue;
+                joinClosed(&connections);
+                if (connections.size() >= options.maxConnections)
+                {
+                    sendLine(connection, "{\"status\":\"error\",\"error\":\"too many connections\"}");
+                    closeSocket(connection);
+                    continue;
+                }
+                auto closed = std::make_shared<std::atomic<bool>>(false);
+                connections.push_back(Connection{ std::thread([connection, options, closed]
+                {
+                    serveConnection(connection, options);
+                    *closed = true;
+                }), closed });
+            }
+        }
+
+    private:
+#ifdef _WIN32
+        typedef SOCKET Socket;
+        static const Socket InvalidSocket = INVALID_SOCKET;
+
+        static void closeSocket(Socket connection)
+        {
+            closesocket(connection);
+        }
+#else
+        typedef int Socket;
+        static const Socket InvalidSocket = -1;
+
+        static void closeSocket(Socket connection)
+        {
+            close(connection);
+        }
+#endif
+
+        /**
+         * @brief Thread serving a connection, closed is set when it is about to return.
+         */
+        struct Connection
+        {
+            std::thread thread;
+            std::shared_ptr<std::atomic<bool>> closed;
+        };
+
+        static void joinClosed(std::vector<Connection> *connections)
+        {
+            for (auto connection = connections->begin(); connection != connections->end();)
+            {
+                if (*connection->closed)
+                {
+                    connection->thread.join();
+                    connection = connections->erase(connection);
+                }
+                else
+                    ++connection;
+            }
+        }
+
+        /**
+         * @brief Requests of one client. Each connection keeps at most two comparisons per
+         *        pool thread in flight, so one busy client can't queue up unbounded work.
+         */
+        class Session
+        {
+        public:
+            Session(std::function<bool(const std::string &)> writeLine, const ServerOptions & options)
+                : write(writeLine), outputDirectory(options.outputDirectory), maxInFlight(2 * ImageRMSE::threadCount())
+            {
+            }
+
+            void handle(const std::string & text)
+            {
+                std::string line = Manifest::trim(text);
+                if (line.empty() || line[0] == '#')
+                    return;
+
+                std::map<std::string, std::string> values;
+                if (line[0] == '{' && Json::parseObject(line, &values) && values.count("command"))
+                {
+                    reply(command(values["command"]));
+                    return;
+                }
+
+                ManifestEntry entry;
+                bool header = false;
+                std::string error;
+                if (!Manifest::parseEntry(line, &entry, &header, &error))
+                {
+                    reject(error);
+                    return;
+                }
+                if (header)
+                    return;
+                if (!confineOutputs(&entry, &error))
+                {
+                    reject(error);
+                    return;
+                }
+
+                size_t index = next++;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    slotFree.wait(lock, [&] { return inFlight < maxInFlight; });
+                    ++inFlight;
+                }
+                ImageRMSE::compareAsync(entry, [this, index, entry](const ComparisonResult & result)
+                {
+                    std::string line = ImageRMSE::formatResult(index, entry, result);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    write(line);
+                    --inFlight;
+                    slotFree.notify_all();
+                });
+            }
+
+            /**
+             * @brief Answer the next request with error instead of running it.
+             */
+            void reject(const std::string & error)
+            {
+                reply("{\"index\":" + std::to_string(next++) + ",\"status\":\"error\",\"error\":" + Json::quote(error) + "}");
+            }
+
+            /**
+             * @brief Wait for the comparisons in flight.
+             */
+            void finish()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotFree.wait(lock, [&] { return inFlight == 0; });
+            }
+
+        private:
+            /**
+             * @brief Move the "diff" and "tiles" outputs of entry below outputDirectory.
+             * @return False if outputs are disabled or a path is absolute or contains "..".
+             */
+            bool confineOutputs(ManifestEntry *entry, std::string *error) const
+            {
+                for (const char *key : { "diff", "tiles" })
+                {
+                    auto output = entry->options.find(key);
+                    if (output == entry->options.end())
+                        continue;
+                    std::string & path = output->second;
+                    if (outputDirectory.empty())
+                    {
+                        *error = std::string(key) + " outputs are disabled, start the server with --serve-output-dir";
+                        return false;
+                    }
+                    if (!isRelativeBelow(path))
+                    {
+                        *error = std::string(key) + " must be a relative path without \"..\": " + path;
+                        return false;
+                    }
+                    path = outputDirectory + "/" + path;
+                }
+                return true;
+            }
+
+            static bool isRelativeBelow(const std::string & path)
+            {
+                if (path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos)
+                    return false;
+                size_t begin = 0;
+                for (;;)
+                {
+                    size_t end = path.find_first_of("/\\", begin);
+                    if (path.compare(begin, end == std::string::npos ? std::string::npos : end - begin, "..") == 0)
+                        return false;
+                    if (end == std::string::npos)
+                        return true;
+                    begin = end + 1;
+                }
+            }
+
+            void reply(const std::string & line)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                write(line);
+            }
+
+            std::string command(const std::string & name) const
+            {
+                if (name != "stats")
+                    return "{\"status\":\"error\",\"error\":" + Json::quote("unknown command " + name) + "}";
+                size_t entries, bytes;
+                ImageRMSE::referenceCacheUsage(&entries, &bytes);
+                return "{\"status\":\"ok\",\"references\":" + std::to_string(entries) +
+                       ",\"referenceBytes\":" + std::to_string(bytes) +
+                       ",\"threads\":" + std::to_string(ImageRMSE::threadCount()) + "}";
+            }
+
+            std::function<bool(const std::string &)> write;
+            const std::string outputDirectory;
+            const size_t maxInFlight;
+            size_t next = 0;
+            std::mutex mutex;
+            std::condition_variable slotFree;
+            size_t inFlight = 0;
+        };
+
+        /**
+         * @brief Whether line is an HTTP request line such as "POST / HTTP/1.1".
+         */
+        static bool looksLikeHttp(const std::string & line)
+        {
+            size_t space = line.find(' ');
+            if (space == std::string::npos || space == 0)
+                return false;
+            for (size_t i = 0; i < space; ++i)
+                if (line[i] < 'A' || line[i] > 'Z')
+                    return false;
+            return line.find(" HTTP/", space) != std::string::npos;
+        }
+
+        static bool sendLine(Socket connection, const std::string & line)
+        {
+            std::string data = line + "\n";
+            for (size_t sent = 0; sent < data.size();)
+            {
+#ifdef MSG_NOSIGNAL
+                int flags = MSG_NOSIGNAL;
+#else
+                int flags = 0;
+#endif
+                auto count = send(connection, data.data() + sent, static_cast<int>(data.size() - sent), flags);
+                if (count <= 0)
+                    return false;
+                sent += static_cast<size_t>(count);
+            }
+            return true;
+        }
+
+        static void serveConnection(Socket connection, const ServerOptions & options)
+        {
+            {
+                Session session([connection](const std::string & line) { return sendLine(connection, line); }, options);
+
+                std::string pending;
+                bool firstLine = true;
+                char buffer[4096];
+                for (;;)
+                {
+                    auto count = recv(connection, buffer, static_cast<int>(sizeof(buffer)), 0);
+                    if (count <= 0)
+                        break;
+                    pending.append(buffer, static_cast<size_t>(count));
+                    size_t end = pending.find('\n');
+                    if (firstLine && end != std::string::npos)
+                    {
+                        firstLine = false;
+                        if (looksLikeHttp(pending.substr(0, end)))
+                        {
+                            pending.clear();
+                            break;
+                        }
+                    }
+                    for (; end != std::string::npos; end = pending.find('\n'))
+                    {
+                        session.handle(pending.substr(0, end));
+                        pending.erase(0, end + 1);
+                    }
+                    if (pending.size() > options.maxLineBytes)
+                    {
+                        session.reject("request line longer than " + std::to_string(options.maxLineBytes) + " bytes");
+                        pending.clear();
+                        break;
+                    }
+                }
+                if (!pending.empty() && !(firstLine && looksLikeHttp(pending)))
+                    session.handle(pending);
+                session.finish();
+            }
+            closeSocket(connection);
+        }
+    };
+}
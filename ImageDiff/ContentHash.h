@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Streaming XXH64 content hash, fed chunk by chunk while a file is read so
+     *        hashing costs no extra pass over the data. Output matches the reference
+     *        XXH64 for the same seed on any platform.
+     */
+    class ContentHash
+    {
+    public:
+        explicit ContentHash(uint64_t hashSeed = 0)
+            : seed(hashSeed)
+        {
+            acc[0] = hashSeed + Prime1 + Prime2;
+            acc[1] = hashSeed + Prime2;
+            acc[2] = hashSeed;
+            acc[3] = hashSeed - Prime1;
+        }
+
+        void update(const void *data, size_t size)
+        {
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            total += size;
+
+            // Complete a stripe left over from the previous update first.
+            if (buffered > 0)
+            {
+                size_t take = std::min(size, sizeof(buffer) - buffered);
+                std::memcpy(buffer + buffered, bytes, take);
+                buffered += take;
+                bytes += take;
+                size -= take;
+                if (buffered < sizeof(buffer))
+                    return;
+                stripe(buffer);
+                buffered = 0;
+            }
+
+            for (; size >= sizeof(buffer); bytes += sizeof(buffer), size -= sizeof(buffer))
+                stripe(bytes);
+
+            std::memcpy(buffer, bytes, size);
+            buffered = size;
+        }
+
+        uint64_t digest() const
+        {
+            uint64_t hash;
+            if (total >= sizeof(buffer))
+            {
+                hash = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+                for (int i = 0; i < 4; ++i)
+                    hash = (hash ^ round(0, acc[i])) * Prime1 + Prime4;
+            }
+            else
+                hash = seed + Prime5;
+            hash += total;
+
+            const unsigned char *p = buffer;
+            const unsigned char *end = buffer + buffered;
+            for (; p + 8 <= end; p += 8)
+                hash = rotl(hash ^ round(0, read64(p)), 27) * Prime1 + Prime4;
+            if (p + 4 <= end)
+            {
+                hash = rotl(hash ^ (static_cast<uint64_t>(read32(p)) * Prime1), 23) * Prime2 + Prime3;
+                p += 4;
+            }
+            for (; p < end; ++p)
+                hash = rotl(hash ^ (*p * Prime5), 11) * Prime1;
+
+            hash ^= hash >> 33;
+            hash *= Prime2;
+            hash ^= hash >> 29;
+            hash *= Prime3;
+            hash ^= hash >> 32;
+            return hash;
+        }
+
+        /**
+         * @return 16 lowercase hex digits.
+         */
+        static std::string hex(uint64_t value)
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string text(16, '0');
+            for (int i = 15; i >= 0; --i, value >>= 4)
+                text[i] = digits[value & 0xf];
+            return text;
+        }
+
+    private:
+        static const uint64_t Prime1 = 11400714785074694791ULL;
+        static const uint64_t Prime2 = 14029467366897019727ULL;
+        static const uint64_t Prime3 = 1609587929392839161ULL;
+        static const uint64_t Prime4 = 9650029242287828579ULL;
+        static const uint64_t Prime5 = 2870177450012600261ULL;
+
+        static uint64_t rotl(uint64_t value, int bits)
+        {
+            return (value << bits) | (value >> (64 - bits));
+        }
+
+        static uint64_t round(uint64_t acc, uint64_t input)
+        {
+            return rotl(acc + input * Prime2, 31) * Prime1;
+        }
+
+        /* XXH64 reads little-endian words, which every supported target (x86, ARM64) is. */
+        static uint64_t read64(const unsigned char *p)
+        {
+            uint64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        static uint32_t read32(const unsigned char *p)
+        {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        void stripe(const unsigned char *p)
+        {
+            for (int i = 0; i < 4; ++i)
+                acc[i] = round(acc[i], read64(p + 8 * i));
+        }
+
+        uint64_t seed;
+        uint64_t acc[4];
+        uint64_t total = 0;
+        unsigned char buffer[32];
+        size_t buffered = 0;
+    };
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Streaming histogram of absolute errors in log-spaced bins: 32 bins per power
+     *        of two from 2^-32 to 2^32, taken straight from the float exponent and the top
+     *        mantissa bits, so adding a pixel is a few integer operations. Percentiles are
+     *        within 1/64 (1.6%) relative of the exact ones. Counts are integers, so
+     *        histograms of rows, tiles or threads merge to the same result in any order.
+     *        Smaller errors count as 0, larger ones and NaN as infinite.
+     */
+    class ErrorHistogram
+    {
+    public:
+        /**
+         * @param threshold Errors above it are counted exactly, see countAbove().
+         */
+        explicit ErrorHistogram(double threshold = std::numeric_limits<double>::infinity())
+            : bins(binCount, 0), limit(threshold)
+        {
+        }
+
+        void add(float absDiff)
+        {
+            ++bins[bin(absDiff)];
+            above += absDiff > limit;
+        }
+
+        /**
+         * @brief Add the absolute errors of count pixels, widened like the RMSE kernels.
+         */
+        template<typename T>
+        void add(const T *data1, const T *data2, int count)
+        {
+            for (int x = 0; x < count; ++x)
+                add(static_cast<float>(std::abs(static_cast<double>(data1[x]) - data2[x])));
+        }
+
+        /**
+         * @brief Add the counts of other, which must have the same threshold.
+         */
+        void merge(const ErrorHistogram & other)
+        {
+            for (int i = 0; i < binCount; ++i)
+                bins[i] += other.bins[i];
+            above += other.above;
+        }
+
+        /**
+         * @brief Add count errors of 0, e.g. of identical images that weren't compared.
+         */
+        void addZeros(uint64_t count)
+        {
+            bins[0] += count;
+        }
+
+        /**
+         * @brief Take back count errors of 0, e.g. of pixels masked out of the comparison.
+         */
+        void removeZeros(uint64_t count)
+        {
+            bins[0] -= count;
+        }
+
+        uint64_t count() const
+        {
+            uint64_t total = 0;
+            for (uint64_t n : bins)
+                total += n;
+            return total;
+        }
+
+        double threshold() const
+        {
+            return limit;
+        }
+
+        /**
+         * @brief Pixels whose error is above threshold().
+         */
+        uint64_t countAbove() const
+        {
+            return above;
+        }
+
+        /**
+         * @brief Approximate p-th percentile (0 to 100) as the center of the bin holding it,
+         *        NaN for an empty histogram.
+         */
+        double percentile(double p) const
+        {
+            uint64_t total = count();
+            if (!total)
+                return std::numeric_limits<double>::quiet_NaN();
+            double rank = std::ceil(p / 100.0 * static_cast<double>(total));
+            uint64_t target = rank < 1.0 ? 1 : static_cast<uint64_t>(rank);
+            uint64_t seen = 0;
+            for (int i = 0; i < binCount; ++i)
+            {
+                seen += bins[i];
+                if (seen >= target)
+                    return center(i);
+            }
+            return center(binCount - 1);
+        }
+
+    private:
+        static const int subBinBits = 5;
+        static const int minExponent = -32;
+        static const int maxExponent = 32;
+        /* Bin 0 holds zeros, the last bin overflows and NaN. */
+        static const int binCount = ((maxExponent - minExponent) << subBinBits) + 2;
+
+        static int bin(float absDiff)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &absDiff, sizeof(bits));
+            // Positive floats order like their bits: exponent, then mantissa.
+            const uint32_t low = static_cast<uint32_t>(127 + minExponent) << 23;
+            const uint32_t high = static_cast<uint32_t>(127 + maxExponent) << 23;
+            bits &= 0x7fffffffu;
+            if (bits < low)
+                return 0;
+            if (bits >= high)
+                return binCount - 1;
+            return static_cast<int>((bits - low) >> (23 - subBinBits)) + 1;
+        }
+
+        static double center(int index)
+        {
+            if (index == 0)
+                return 0.0;
+            if (index == binCount - 1)
+                return std::numeric_limits<double>::infinity();
+            int exponent = minExponent + ((index - 1) >> subBinBits);
+            int subBin = (index - 1) & ((1 << subBinBits) - 1);
+            return std::ldexp(1.0 + (subBin + 0.5) / (1 << subBinBits), exponent);
+        }
+
+        std::vector<uint64_t> bins;
+        double limit;
+        uint64_t above = 0;
+    };
+}
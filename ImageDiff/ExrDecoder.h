@@ -0,0 +1,187 @@
+#pragma once
+
+/* The direct OpenEXR path is optional: define IMAGEUTIL_WITH_OPENEXR and add the
+   OpenEXR (and Imath/IlmBase) include directories and libraries to the project. */
+#ifdef IMAGEUTIL_WITH_OPENEXR
+
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfIO.h>
+#include <ImfInputFile.h>
+#include <ImfThreading.h>
+#include <ImathBox.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief EXR decoder on top of OpenEXR, used for luminance loads instead of FreeImage.
+     *        Rows are decoded in bands, the chunks of a band decompressed in parallel by the
+     *        OpenEXR thread pool, into float R, G, B (or Y) samples that the caller converts
+     *        right away. FreeImage decodes on a single thread into a bitmap of the whole image.
+     */
+    class ExrDecoder
+    {
+    public:
+        /**
+         * @param encoded Contents of the file, which must outlive the decoder.
+         */
+        ExrDecoder(const std::string & filename, const std::vector<unsigned char> & encoded)
+            : stream(filename, encoded)
+        {
+        }
+
+        /**
+         * @param[out] supported False if the channels aren't plain R, G, B or Y, e.g. for
+         *             luminance/chroma images, which are left to FreeImage.
+         * @return False if the file can't be parsed or isn't supported.
+         */
+        bool open(bool *supported, std::string *error)
+        {
+            *supported = true;
+            try
+            {
+                file.reset(new Imf::InputFile(stream));
+                const Imf::ChannelList & channels = file->header().channels();
+                bool rgb = channels.findChannel("R") && channels.findChannel("G") && channels.findChannel("B");
+                bool grey = channels.findChannel("Y") && !channels.findChannel("RY") && !channels.findChannel("BY") &&
+                            !channels.findChannel("R") && !channels.findChannel("G") && !channels.findChannel("B");
+                if (!rgb && !grey)
+                {
+                    *supported = false;
+                    return false;
+                }
+                channelCount = rgb ? 3 : 1;
+                window = file->header().dataWindow();
+                return true;
+            }
+            catch (const std::exception & e)
+            {
+                *error = e.what();
+                return false;
+            }
+        }
+
+        int width() const
+        {
+            return window.max.x - window.min.x + 1;
+        }
+
+        int height() const
+        {
+            return window.max.y - window.min.y + 1;
+        }
+
+        /**
+         * @brief Samples per decoded pixel: 3 (R, G, B) or 1 (Y).
+         */
+        int channels() const
+        {
+            return channelCount;
+        }
+
+        /**
+         * @brief Decode rows [begin, end), counted from the top, into band: width() pixels of
+         *        channels() floats per row.
+         * @return False if the rows can't be decoded.
+         */
+        bool readRows(int begin, int end, float *band, std::string *error)
+        {
+            const size_t xStride = sizeof(float) * channelCount;
+            const size_t yStride = xStride * width();
+            // OpenEXR addresses pixels by data window coordinates from the slice base.
+            char *base = reinterpret_cast<char *>(band) - static_cast<ptrdiff_t>(window.min.x) * static_cast<ptrdiff_t>(xStride)
+                                                       - static_cast<ptrdiff_t>(window.min.y + begin) * static_cast<ptrdiff_t>(yStride);
+            try
+            {
+                Imf::FrameBuffer frameBuffer;
+                const char *names[] = { "R", "G", "B" };
+                for (int c = 0; c < channelCount; ++c)
+                    frameBuffer.insert(channelCount == 1 ? "Y" : names[c],
+                                       Imf::Slice(Imf::FLOAT, base + sizeof(float) * c, xStride, yStride, 1, 1, 0.0));
+                file->setFrameBuffer(frameBuffer);
+                file->readPixels(window.min.y + begin, window.min.y + end - 1);
+                return true;
+            }
+            catch (const std::exception & e)
+            {
+                *error = e.what();
+                return false;
+            }
+        }
+
+        /**
+         * @brief Size of the OpenEXR thread pool shared by all decoders, 0 to decode on the
+         *        calling thread.
+         */
+        static void setThreadCount(unsigned threads)
+        {
+            if (Imf::globalThreadCount() != static_cast<int>(threads))
+                Imf::setGlobalThreadCount(static_cast<int>(threads));
+        }
+
+    private:
+        /**
+         * @brief Read-only stream over a file already in memory (see ImageRMSE::readFile()).
+         */
+        class MemoryStream : public Imf::IStream
+        {
+        public:
+            MemoryStream(const std::string & filename, const std::vector<unsigned char> & encoded)
+                : Imf::IStream(filename.c_str()), contents(encoded)
+            {
+            }
+
+            bool isMemoryMapped() const override
+            {
+                return true;
+            }
+
+            char * readMemoryMapped(int n) override
+            {
+                if (n < 0 || position + static_cast<uint64_t>(n) > contents.size())
+                    throw std::runtime_error("unexpected end of file");
+                char *data = const_cast<char *>(reinterpret_cast<const char *>(contents.data())) + position;
+                position += static_cast<uint64_t>(n);
+                return data;
+            }
+
+            bool read(char c[], int n) override
+            {
+                std::memcpy(c, readMemoryMapped(n), static_cast<size_t>(n));
+                return position < contents.size();
+            }
+
+            uint64_t tellg() override
+            {
+                return position;
+            }
+
+            void seekg(uint64_t pos) override
+            {
+                position = pos;
+            }
+
+        private:
+            const std::vector<unsigned char> & contents;
+            uint64_t position = 0;
+        };
+
+        MemoryStream stream;
+        std::unique_ptr<Imf::InputFile> file;
+        Imath::Box2i window;
+        int channelCount = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <string>
+
+namespace ImageUtil
+{
+    /**
+     * @brief File names of numbered frames. A pattern holds the frame number as a run of
+     *        '#' (one digit each, "shot.####.exr") or as printf %d/%0Nd ("shot.%04d.exr").
+     */
+    class FrameSequence
+    {
+    public:
+        /**
+         * @brief Path of frame in pattern, zero padded to the width of the placeholder.
+         *        A pattern without a placeholder names the same file for every frame.
+         */
+        static std::string path(const std::string & pattern, int frame)
+        {
+            size_t begin, end;
+            int width;
+            if (!placeholder(pattern, &begin, &end, &width))
+                return pattern;
+            std::string number = std::to_string(frame);
+            if (static_cast<int>(number.size()) < width)
+                number.insert(0, width - number.size(), '0');
+            return pattern.substr(0, begin) + number + pattern.substr(end);
+        }
+
+        static bool hasPlaceholder(const std::string & pattern)
+        {
+            size_t begin, end;
+            int width;
+            return placeholder(pattern, &begin, &end, &width);
+        }
+
+        /**
+         * @brief Parse "first-last" or a single frame, frames are >= 0.
+         * @return False if malformed or last < first.
+         */
+        static bool parseRange(const std::string & text, int *first, int *last)
+        {
+            size_t dash = text.find('-');
+            std::string from = text.substr(0, dash);
+            std::string to = dash == std::string::npos ? from : text.substr(dash + 1);
+            if (!isNumber(from) || !isNumber(to))
+                return false;
+            *first = std::atoi(from.c_str());
+            *last = std::atoi(to.c_str());
+            return *last >= *first;
+        }
+
+    private:
+        /**
+         * @brief Locate the first placeholder as [begin, end) and its digit count.
+         */
+        static bool placeholder(const std::string & pattern, size_t *begin, size_t *end, int *width)
+        {
+            for (size_t i = 0; i < pattern.size(); ++i)
+            {
+                if (pattern[i] == '#')
+                {
+                    size_t j = pattern.find_first_not_of('#', i);
+                    *begin = i;
+                    *end = j == std::string::npos ? pattern.size() : j;
+                    *width = static_cast<int>(*end - i);
+                    return true;
+                }
+                if (pattern[i] == '%')
+                {
+                    size_t j = i + 1;
+                    while (j < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[j])))
+                        ++j;
+                    if (j < pattern.size() && pattern[j] == 'd')
+                    {
+                        *begin = i;
+                        *end = j + 1;
+                        *width = j > i + 1 ? std::atoi(pattern.substr(i + 1, j - i - 1).c_str()) : 0;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        static bool isNumber(const std::string & text)
+        {
+            if (text.empty() || text.size() > 9)
+                return false;
+            for (char c : text)
+                if (!std::isdigit(static_cast<unsigned char>(c)))
+                    return false;
+            return true;
+        }
+    };
+}
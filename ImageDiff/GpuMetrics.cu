@@ -0,0 +1,256 @@
+#include "GpuMetrics.h"
+
+#ifdef IMAGEUTIL_WITH_CUDA
+
+#include <cuda_runtime.h>
+
+namespace ImageUtil
+{
+    namespace
+    {
+        const int blockThreads = 256;
+
+        /**
+         * @brief Device buffers, grown as needed and kept for the next comparison.
+         */
+        struct DeviceBuffers
+        {
+            float *reference = nullptr;
+            float *candidate = nullptr;
+            float *diff = nullptr;
+            double *rowSquared = nullptr;
+            double *rowMax = nullptr;
+            int *rowIndex = nullptr;
+            double *tileSquared = nullptr;
+            double *tileAbs = nullptr;
+            double *tileMax = nullptr;
+            size_t referenceCapacity = 0, candidateCapacity = 0, diffCapacity = 0;
+            size_t rowCapacity[3] = { 0, 0, 0 };
+            size_t tileCapacity[3] = { 0, 0, 0 };
+            int width = 0;
+            int height = 0;
+        };
+
+        DeviceBuffers & buffers()
+        {
+            static DeviceBuffers device;
+            return device;
+        }
+
+        bool check(cudaError_t status, const char *what, std::string *error)
+        {
+            if (status == cudaSuccess)
+                return true;
+            *error = std::string(what) + ": " + cudaGetErrorString(status);
+            return false;
+        }
+
+        template<typename T>
+        bool reserve(T **buffer, size_t *capacity, size_t count, std::string *error)
+        {
+            if (*capacity >= count)
+                return true;
+            cudaFree(*buffer);
+            *buffer = nullptr;
+            *capacity = 0;
+            if (!check(cudaMalloc(reinterpret_cast<void **>(buffer), count * sizeof(T)), "cudaMalloc", error))
+                return false;
+            *capacity = count;
+            return true;
+        }
+
+        /* Larger value, or the lower index of equal ones: the first maximum, as on the CPU. */
+        __device__ void keepMax(double value, int index, double *maxDiff, int *maxIndex)
+        {
+            if (value > *maxDiff || (value == *maxDiff && index < *maxIndex))
+            {
+                *maxDiff = value;
+                *maxIndex = index;
+            }
+        }
+
+        /**
+         * @brief One block per row: squared error, first maximum and optional diff row.
+         *        Products are rounded separately (no FMA) like the CPU kernels.
+         */
+        __global__ void rowKernel(const float *candidate, const float *reference, int width, float *diff,
+                                  double *rowSquared, double *rowMax, int *rowIndex)
+        {
+            __shared__ double squared[blockThreads];
+            __shared__ double maxima[blockThreads];
+            __shared__ int indices[blockThreads];
+
+            const size_t offset = static_cast<size_t>(blockIdx.x) * width;
+            double sum = 0.0, maxDiff = -1.0;
+            int maxIndex = width;
+            for (int x = threadIdx.x; x < width; x += blockThreads)
+            {
+                double d = static_cast<double>(candidate[offset + x]) - reference[offset + x];
+                double absDiff = fabs(d);
+                sum = __dadd_rn(sum, __dmul_rn(d, d));
+                keepMax(absDiff, x, &maxDiff, &maxIndex);
+                if (diff)
+                    diff[offset + x] = static_cast<float>(absDiff);
+            }
+            squared[threadIdx.x] = sum;
+            maxima[threadIdx.x] = maxDiff;
+            indices[threadIdx.x] = maxIndex;
+            __syncthreads();
+
+            for (int stride = blockThreads / 2; stride > 0; stride >>= 1)
+            {
+                if (threadIdx.x < stride)
+                {
+                    squared[threadIdx.x] += squared[threadIdx.x + stride];
+                    keepMax(maxima[threadIdx.x + stride], indices[threadIdx.x + stride], &maxima[threadIdx.x], &indices[threadIdx.x]);
+                }
+                __syncthreads();
+            }
+            if (threadIdx.x == 0)
+            {
+                rowSquared[blockIdx.x] = squared[0];
+                rowMax[blockIdx.x] = maxima[0];
+                rowIndex[blockIdx.x] = indices[0];
+            }
+        }
+
+        /**
+         * @brief One block per tile: squared error, absolute error and maximum.
+         */
+        __global__ void tileKernel(const float *candidate, const float *reference, int width, int height, int tileSize,
+                                   double *tileSquared, double *tileAbs, double *tileMax)
+        {
+            __shared__ double squared[blockThreads];
+            __shared__ double absolute[blockThreads];
+            __shared__ double maxima[blockThreads];
+
+            const int left = blockIdx.x * tileSize, top = blockIdx.y * tileSize;
+            const int tileWidth = min(tileSize, width - left), tileHeight = min(tileSize, height - top);
+            double sum = 0.0, sumAbs = 0.0, maxDiff = 0.0;
+            for (int i = threadIdx.x; i < tileWidth * tileHeight; i += blockThreads)
+            {
+                size_t pixel = static_cast<size_t>(top + i / tileWidth) * width + left + i % tileWidth;
+                double d = static_cast<double>(candidate[pixel]) - reference[pixel];
+                sum = __dadd_rn(sum, __dmul_rn(d, d));
+                sumAbs += fabs(d);
+                maxDiff = fmax(maxDiff, fabs(d));
+            }
+            squared[threadIdx.x] = sum;
+            absolute[threadIdx.x] = sumAbs;
+            maxima[threadIdx.x] = maxDiff;
+            __syncthreads();
+
+            for (int stride = blockThreads / 2; stride > 0; stride >>= 1)
+            {
+                if (threadIdx.x < stride)
+                {
+                    squared[threadIdx.x] += squared[threadIdx.x + stride];
+                    absolute[threadIdx.x] += absolute[threadIdx.x + stride];
+                    maxima[threadIdx.x] = fmax(maxima[threadIdx.x], maxima[threadIdx.x + stride]);
+                }
+                __syncthreads();
+            }
+            if (threadIdx.x == 0)
+            {
+                size_t tile = static_cast<size_t>(blockIdx.y) * gridDim.x + blockIdx.x;
+                tileSquared[tile] = squared[0];
+                tileAbs[tile] = absolute[0];
+                tileMax[tile] = maxima[0];
+            }
+        }
+    }
+
+    bool GpuMetrics::available()
+    {
+        static const bool found = []
+        {
+            int count = 0;
+            return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+        }();
+        return found;
+    }
+
+    bool GpuMetrics::uploadReference(const float *reference, int width, int height, std::string *error)
+    {
+        DeviceBuffers & device = buffers();
+        const size_t pixels = static_cast<size_t>(width) * height;
+        device.width = 0;
+        device.height = 0;
+        if (!reserve(&device.reference, &device.referenceCapacity, pixels, error) ||
+            !check(cudaMemcpy(device.reference, reference, pixels * sizeof(float), cudaMemcpyHostToDevice), "reference upload", error))
+            return false;
+        device.width = width;
+        device.height = height;
+        return true;
+    }
+
+    bool GpuMetrics::compute(const float *candidate, Rows *rows, Tiles *tiles, std::vector<float> *diff, std::string *error)
+    {
+        DeviceBuffers & device = buffers();
+        const int width = device.width, height = device.height;
+        if (!width || !height)
+        {
+            *error = "no reference on the device";
+            return false;
+        }
+        const size_t pixels = static_cast<size_t>(width) * height;
+        const size_t rowCount = static_cast<size_t>(height);
+        if (!reserve(&device.candidate, &device.candidateCapacity, pixels, error) ||
+            !reserve(&device.rowSquared, &device.rowCapacity[0], rowCount, error) ||
+            !reserve(&device.rowMax, &device.rowCapacity[1], rowCount, error) ||
+            !reserve(&device.rowIndex, &device.rowCapacity[2], rowCount, error) ||
+            (diff && !reserve(&device.diff, &device.diffCapacity, pixels, error)))
+            return false;
+
+        const bool tileStats = tiles && tiles->tileSize > 0;
+        size_t tileCount = 0;
+        if (tileStats)
+        {
+            tiles->columns = (width + tiles->tileSize - 1) / tiles->tileSize;
+            tiles->rows = (height + tiles->tileSize - 1) / tiles->tileSize;
+            tileCount = static_cast<size_t>(tiles->columns) * tiles->rows;
+            if (!reserve(&device.tileSquared, &device.tileCapacity[0], tileCount, error) ||
+                !reserve(&device.tileAbs, &device.tileCapacity[1], tileCount, error) ||
+                !reserve(&device.tileMax, &device.tileCapacity[2], tileCount, error))
+                return false;
+        }
+
+        if (!check(cudaMemcpy(device.candidate, candidate, pixels * sizeof(float), cudaMemcpyHostToDevice), "candidate upload", error))
+            return false;
+        rowKernel<<<height, blockThreads>>>(device.candidate, device.reference, width, diff ? device.diff : nullptr,
+                                            device.rowSquared, device.rowMax, device.rowIndex);
+        if (tileStats)
+            tileKernel<<<dim3(tiles->columns, tiles->rows), blockThreads>>>(device.candidate, device.reference, width, height, tiles->tileSize,
+                                                                           device.tileSquared, device.tileAbs, device.tileMax);
+        if (!check(cudaGetLastError(), "metric kernels", error))
+            return false;
+
+        // Blocking copies on the default stream, which also wait for the kernels.
+        rows->sumSquaredError.resize(rowCount);
+        rows->maxDiff.resize(rowCount);
+        rows->maxIndex.resize(rowCount);
+        if (!check(cudaMemcpy(rows->sumSquaredError.data(), device.rowSquared, rowCount * sizeof(double), cudaMemcpyDeviceToHost), "row download", error) ||
+            !check(cudaMemcpy(rows->maxDiff.data(), device.rowMax, rowCount * sizeof(double), cudaMemcpyDeviceToHost), "row download", error) ||
+            !check(cudaMemcpy(rows->maxIndex.data(), device.rowIndex, rowCount * sizeof(int), cudaMemcpyDeviceToHost), "row download", error))
+            return false;
+        if (tileStats)
+        {
+            tiles->sumSquaredError.resize(tileCount);
+            tiles->sumAbsDiff.resize(tileCount);
+            tiles->maxDiff.resize(tileCount);
+            if (!check(cudaMemcpy(tiles->sumSquaredError.data(), device.tileSquared, tileCount * sizeof(double), cudaMemcpyDeviceToHost), "tile download", error) ||
+                !check(cudaMemcpy(tiles->sumAbsDiff.data(), device.tileAbs, tileCount * sizeof(double), cudaMemcpyDeviceToHost), "tile download", error) ||
+                !check(cudaMemcpy(tiles->maxDiff.data(), device.tileMax, tileCount * sizeof(double), cudaMemcpyDeviceToHost), "tile download", error))
+                return false;
+        }
+        if (diff)
+        {
+            diff->resize(pixels);
+            if (!check(cudaMemcpy(diff->data(), device.diff, pixels * sizeof(float), cudaMemcpyDeviceToHost), "diff download", error))
+                return false;
+        }
+        return true;
+    }
+}
+
+#endif
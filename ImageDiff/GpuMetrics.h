@@ -0,0 +1,69 @@
+#pragma once
+
+/* The CUDA metric backend is optional. Build with the CUDA toolkit's Visual Studio
+   integration installed and its version passed as CudaVersion, e.g.
+   msbuild ImageDiff.sln /p:CudaVersion=10.2: the projects then import the CUDA build
+   customization, compile GpuMetrics.cu with nvcc, define IMAGEUTIL_WITH_CUDA and link
+   cudart. Without CudaVersion the .cu items are ignored and the CPU pass is used. */
+#ifdef IMAGEUTIL_WITH_CUDA
+
+#include <string>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Metric pass on a CUDA device. The reference luminance is uploaded once and
+     *        stays on the device between comparisons, each candidate is uploaded once and
+     *        only per-row partials, tile statistics and (if asked for) the diff image come
+     *        back. Rows are reduced on the host in row order like the CPU pass, so results
+     *        agree with it up to the summation order within a row.
+     *        Calls must be serialized by the caller.
+     */
+    class GpuMetrics
+    {
+    public:
+        /**
+         * @brief Per-row partials of a metric pass, rows from the top.
+         */
+        struct Rows
+        {
+            std::vector<double> sumSquaredError;
+            std::vector<double> maxDiff;
+            /* Column of the first pixel with maxDiff. */
+            std::vector<int> maxIndex;
+        };
+
+        /**
+         * @brief Per-tile statistics, tiles in row-major order from the top.
+         */
+        struct Tiles
+        {
+            int tileSize = 0;
+            int columns = 0;
+            int rows = 0;
+            std::vector<double> sumSquaredError;
+            std::vector<double> sumAbsDiff;
+            std::vector<double> maxDiff;
+        };
+
+        /**
+         * @brief Whether a CUDA device can be used, checked once.
+         */
+        static bool available();
+
+        /**
+         * @brief Upload width x height reference luminance, replacing the previous one.
+         */
+        static bool uploadReference(const float *reference, int width, int height, std::string *error);
+
+        /**
+         * @brief Compare candidate luminance of the reference's size against it.
+         * @param tiles If tiles->tileSize > 0, receives the tile statistics.
+         * @param diff If set, receives the absolute difference, width * height floats.
+         */
+        static bool compute(const float *candidate, Rows *rows, Tiles *tiles, std::vector<float> *diff, std::string *error);
+    };
+}
+
+#endif
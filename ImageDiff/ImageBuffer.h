@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Rectangle in pixels, y counted from the top of the image.
+     *        An empty region stands for the whole image.
+     */
+    struct Region
+    {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+
+        bool empty() const
+        {
+            return width <= 0 || height <= 0;
+        }
+    };
+
+    /**
+     * @brief Sample layout of an in-memory image. Float and half samples are linear,
+     *        16-bit and 8-bit colour samples are sRGB encoded and alpha is linear.
+     */
+    enum class PixelFormat
+    {
+        RGBA32F,
+        RGB32F,
+        Gray32F,
+        RGBA16F,
+        RGB16F,
+        Gray16F,
+        RGBA16,
+        RGB16,
+        Gray16,
+        RGBA8,
+        RGB8,
+        BGRA8,
+        BGR8,
+        Gray8
+    };
+
+    /**
+     * @brief Caller-owned pixels, e.g. a mapped framebuffer, compared without any file I/O.
+     */
+    struct ImageBuffer
+    {
+        const void *pixels = nullptr;
+        int width = 0;
+        int height = 0;
+        /* Bytes from one row to the next, 0 for tightly packed rows. */
+        size_t stride = 0;
+        PixelFormat format = PixelFormat::RGBA32F;
+        /* Rows stored from the bottom up, like OpenGL framebuffers. */
+        bool bottomUp = false;
+
+        ImageBuffer() = default;
+
+        ImageBuffer(const void *data, int imageWidth, int imageHeight, PixelFormat pixelFormat, size_t rowStride = 0)
+            : pixels(data), width(imageWidth), height(imageHeight), stride(rowStride), format(pixelFormat)
+        {
+        }
+
+        static int channels(PixelFormat format)
+        {
+            switch (format)
+            {
+            case PixelFormat::Gray32F:
+            case PixelFormat::Gray16F:
+            case PixelFormat::Gray16:
+            case PixelFormat::Gray8:
+                return 1;
+            case PixelFormat::RGB32F:
+            case PixelFormat::RGB16F:
+            case PixelFormat::RGB16:
+            case PixelFormat::RGB8:
+            case PixelFormat::BGR8:
+                return 3;
+            default:
+                return 4;
+            }
+        }
+
+        static size_t sampleBytes(PixelFormat format)
+        {
+            switch (format)
+            {
+            case PixelFormat::RGBA32F:
+            case PixelFormat::RGB32F:
+            case PixelFormat::Gray32F:
+                return 4;
+            case PixelFormat::RGBA8:
+            case PixelFormat::RGB8:
+            case PixelFormat::BGRA8:
+            case PixelFormat::BGR8:
+            case PixelFormat::Gray8:
+                return 1;
+            default:
+                return 2;
+            }
+        }
+
+        size_t rowBytes() const
+        {
+            return stride ? stride : static_cast<size_t>(width) * channels(format) * sampleBytes(format);
+        }
+
+        /**
+         * @brief Start of row y, counted from the top of the image.
+         */
+        const unsigned char * row(int y) const
+        {
+            int stored = bottomUp ? height - y - 1 : y;
+            return static_cast<const unsigned char *>(pixels) + rowBytes() * static_cast<size_t>(stored);
+        }
+
+        bool valid() const
+        {
+            return pixels && width > 0 && height > 0 &&
+                   rowBytes() >= static_cast<size_t>(width) * channels(format) * sampleBytes(format);
+        }
+    };
+}
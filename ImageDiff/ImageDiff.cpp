@@ -1,283 +1,365 @@
-﻿
-#include "freeImage/FreeImagePlus.h"
+﻿#include "ComparisonServer.h"
+#include "ImageRMSE.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <locale>
+#include <map>
 #include <string>
-#include <cassert>
 #include <vector>
-#include <algorithm>
 
 using namespace std;
 
-namespace ImageUtil
+using namespace ImageUtil;
+
+/**
+ * @brief Write the collected profile (if requested) and pass the exit status through.
+ */
+static int finish(int status, const std::string & profile)
 {
-    double luminance(float r, float g, float b)
+    if (profile.empty())
+        return status;
+    if (profile == "-")
     {
-        return 0.212671f * r + 0.715160f * g + 0.072169f * b;
+        Profiler::write(std::cerr);
+        return status;
     }
-
-    template<typename T>
-    std::vector<T> diffVector(const std::vector<T>& v1, const std::vector<T>& v2)
+    std::ofstream file(profile);
+    if (!file)
     {
-        assert(v1.size() == v2.size());
-        
-        std::vector<T> res;
-        res.reserve(v1.size());
-        for (int i = 0; i < v1.size(); ++i)
-        {
-            res.push_back(std::abs(v1[i] - v2[i]));
-        }
-        return res;
+        std::cerr << "Failed to open profile file: " << profile << std::endl;
+        return 1;
     }
+    Profiler::write(file);
+    return status;
+}
 
-    /**
-     * @brief Utility class for loading image and compute RMSE.
-     */
-    class ImageRMSE
+/**
+ * @brief False if the file is non-empty and its last line was cut short, e.g. by a crash.
+ */
+static bool endsWithNewline(const std::string & filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file || file.tellg() <= 0)
+        return true;
+    file.seekg(-1, std::ios::end);
+    return file.get() == '\n';
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> images;
+    bool diffImage = false;
+    bool streaming = false;
+    std::string manifest, output, convertInput, convertOutput, profile, serve;
+    int referenceCacheMB = -1;
+    int shard = 0, shardCount = 1;
+    bool resume = false;
+    std::vector<std::string> mergeInputs;
+    std::string sequence, referenceSequence;
+    int firstFrame = 0, lastFrame = -1;
+    bool rawRGB = false;
+    bool rawHalf = false;
+    bool threshold = false;
+    ThresholdOptions thresholdOptions;
+    RunOptions runOptions;
+    ServerOptions serverOptions;
+    for (int i = 1; i < argc; ++i)
     {
-    public:
-        /**
-         * @brief Compute RMSE and output directly.
-         */
-        static void computeRMSE(const std::string & data1, const std::string & data2, const std::string & ref, bool diffImage = false)
+        std::string arg = argv[i];
+        // "true" as trailing argument is kept for compatibility with the old usage.
+        if (arg == "--diff" || (arg == "true" && i == argc - 1))
+            diffImage = true;
+        else if (arg == "--convert-raw" && i + 2 < argc)
         {
-            int width, height;
-            auto image1 = loadImageToLuminance(data1, &width, &height);
-            auto image2 = loadImageToLuminance(data2, &width, &height);
-            auto imageRef = loadImageToLuminance(ref, &width, &height);
-            assert(!image1.empty() || !image2.empty() || !imageRef.empty());
-
-            double rmse1 = rmse(image1, imageRef);
-            double rmse2 = rmse(image2, imageRef);
-
-            std::cout.precision(std::numeric_limits<double>::max_digits10);
-            std::cout << "Image1 RMSE: " << rmse1 << std::endl << "Image2 RMSE: " << rmse2 << std::endl;
-
-            if (diffImage)
+            convertInput = argv[++i];
+            convertOutput = argv[++i];
+        }
+        else if (arg == "--rgb")
+            rawRGB = true;
+        else if (arg == "--half")
+            rawHalf = true;
+        else if (arg == "--manifest" && i + 1 < argc)
+            manifest = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc)
+            serve = argv[++i];
+        else if (arg == "--serve-output-dir" && i + 1 < argc)
+            serverOptions.outputDirectory = argv[++i];
+        else if (arg == "--reference-cache-mb" && i + 1 < argc)
+            referenceCacheMB = std::max(std::atoi(argv[++i]), 0);
+        else if (arg == "--shard" && i + 1 < argc)
+        {
+            if (std::sscanf(argv[++i], "%d/%d", &shard, &shardCount) != 2 || shardCount < 1 || shard < 0 || shard >= shardCount)
             {
-                auto max1 = maxDiff(image1, imageRef);
-                auto max2 = maxDiff(image2, imageRef);
-                std::cout << "Image1 maxDiff at: " << max1.first << " value: " << max1.second << std::endl
-                          << "Image2 maxDiff at: " << max2.first << " value: " << max2.second << std::endl;
-
-                /* Diff image. */
-                auto diff1 = diffVector(image1, imageRef);
-                auto diff2 = diffVector(image2, imageRef);
-                saveLuminanceImage(diff1, width, height, "diff1.exr");
-                saveLuminanceImage(diff2, width, height, "diff2.exr");
+                std::cerr << "Invalid shard: " << argv[i] << " (index/count, e.g. 0/4)" << std::endl;
+                return 1;
             }
         }
-
-        /**
-         * @brief For 32-bpc HDR/OpenEXR file only.
-         */
-        static double computeRMSE(const std::string & filename1, const std::string & filename2)
+        else if (arg == "--resume")
+            resume = true;
+        else if (arg == "--merge")
         {
-            int width, height;
-            auto image1 = loadImageToLuminance(filename1, &width, &height);
-            auto image2 = loadImageToLuminance(filename2, &width, &height);
-            assert(!image1.empty() || !image2.empty());
-        
-            return rmse(image1, image2);
+            while (i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0)
+                mergeInputs.push_back(argv[++i]);
         }
-
-    private:
-        static std::pair<int,double> maxDiff(const std::vector<double> &data1, const std::vector<double> &data2)
+        else if (arg == "--sequence" && i + 2 < argc)
         {
-            /* index, value */
-            std::pair<int, double> res = std::make_pair(0, std::abs(data1[0] - data2[0]));
-            
-            for (int i = 0; i < data1.size(); ++i)
+            sequence = argv[++i];
+            referenceSequence = argv[++i];
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            if (!FrameSequence::parseRange(argv[++i], &firstFrame, &lastFrame))
             {
-                if (std::abs(data1[i] - data2[i]) > res.second)
-                {
-                    res.second = std::abs(data1[i] - data2[i]);
-                    res.first = i;
-                }
-                    
+                std::cerr << "Invalid frames: " << argv[i] << " (first-last, e.g. 1-240)" << std::endl;
+                return 1;
             }
-            return res;
         }
-
-        static double rmse(const std::vector<double> &data1, const std::vector<double> &data2)
+        else if (arg == "--output" && i + 1 < argc)
+            output = argv[++i];
+        else if (arg == "--profile" && i + 1 < argc)
+            profile = argv[++i];
+        else if (arg == "--threshold" && i + 1 < argc)
         {
-            double rmse = 0.0;
-            for (int i = 0; i < data1.size(); ++i)
+            threshold = true;
+            thresholdOptions.maxRMSE = std::atof(argv[++i]);
+        }
+        else if (arg == "--value-range" && i + 1 < argc)
+            thresholdOptions.valueRange = std::atof(argv[++i]);
+        else if (arg == "--roi" && i + 1 < argc)
+        {
+            if (!ImageRMSE::parseRegion(argv[++i], &runOptions.roi))
             {
-                rmse += (data1[i] - data2[i])*(data1[i] - data2[i]);
+                std::cerr << "Invalid region: " << argv[i] << " (x,y,width,height)" << std::endl;
+                return 1;
             }
-            rmse = sqrt(1.0 / data1.size() * rmse);
-
-            return rmse;
         }
-
-        /**
-         * @brief Load 32bpc HDR/OpenEXR image and convert RGB channels to luminance.
-         * @param[out] width 
-         * @param[out] height
-         * @return Empty vector if fails.
-         */
-        static std::vector<double> loadImageToLuminance(const std::string & filename, int *width, int *height)
+        else if (arg == "--tile-stats" && i + 1 < argc)
         {
-            /* Load image using FreeImage. */
-
-            // Extension check.
-            auto getFreeImageFormat = [&filename]()->FREE_IMAGE_FORMAT
+            runOptions.tileSize = std::atoi(argv[++i]);
+            if (runOptions.tileSize <= 0)
             {
-                // Get the filename extension                                                
-                std::string::size_type extension_index = filename.find_last_of(".");
-                std::string ext = extension_index != std::string::npos ?
-                    filename.substr(extension_index + 1) :
-                    std::string();
-                std::locale loc;
-                for (std::string::size_type i = 0; i < ext.length(); ++i)
-                    ext[i] = std::tolower(ext[i], loc);
-                if (ext == "hdr")
-                    return FIF_HDR;
-                if (ext == "exr")
-                    return FIF_EXR;
-                return FIF_UNKNOWN;
-            };
-
-            auto imageFormat = getFreeImageFormat();
-            if (imageFormat == FIF_UNKNOWN)
+                std::cerr << "Invalid tile size: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--exr-compression" && i + 1 < argc)
+        {
+            if (!ImageRMSE::parseExrCompression(argv[++i], &runOptions.diffSaveFlags))
             {
-                std::cerr << "The format is neither HDR nor EXR, not supported for RMSE computation..." << std::endl;
-                return std::vector<double>();
+                std::cerr << "Unknown EXR compression: " << argv[i] << " (piz, zip, none, pxr24, b44)" << std::endl;
+                return 1;
             }
-
-            FIBITMAP* bitmap = FreeImage_Load(imageFormat, filename.c_str());
-            assert(bitmap != nullptr);
-
-            // How many bits-per-pixel is the source image?
-            int bitsPerPixel = FreeImage_GetBPP(bitmap);
-            int imageWidth = FreeImage_GetWidth(bitmap);
-            int imageHeight = FreeImage_GetHeight(bitmap);
-            *width = imageWidth;
-            *height = imageHeight;
-
-            FREE_IMAGE_TYPE imageType = FreeImage_GetImageType(bitmap);
-            int bytespp = FreeImage_GetLine(bitmap) / imageWidth / sizeof(float);
-
-            std::cout << "Image: " << filename << " is size: " << imageWidth << "x" << imageHeight << "with " << bitsPerPixel << "bits per pixel" << "." << std::endl;
-            std::cout << "Image Type: " << imageType << std::endl;
-            std::cout << "Image component(which is used to step to the next pixel):" << bytespp << std::endl;
-
-            // Caveat: BITMAP scanline is upside down 
-            //         -- doesn't matter for RMSE computation however.
-
-            std::vector<double> luminanceBuffer;
-            luminanceBuffer.reserve(imageWidth*imageHeight);
-
-            switch (imageType)
+        }
+        else if (arg == "--diff-format" && i + 1 < argc)
+        {
+            if (!ImageRMSE::parseDiffFormat(argv[++i], &runOptions.diffFormat))
             {
-            case FIT_RGBAF:
-                for (auto y = 0; y < imageHeight; ++y)
-                {
-                    // Note the scanline fetched by FreeImage is upside down--the first scanline corresponds to the buttom of the image!
-                    FLOAT *bits = reinterpret_cast<FLOAT *>(FreeImage_GetScanLine(bitmap, imageHeight - y - 1));
-
-                    for (auto x = 0; x < imageWidth; ++x)
-                    {
-                        unsigned int buf_index = (imageWidth * y + x) * 4;
-
-                        assert(!isinf(static_cast<float>(bits[0])) && !isnan(static_cast<float>(bits[0])));
-                        assert(!isinf(static_cast<float>(bits[1])) && !isnan(static_cast<float>(bits[1])));
-                        assert(!isinf(static_cast<float>(bits[2])) && !isnan(static_cast<float>(bits[2])));
-
-                        // note that for RGBAF/RGBF format, the pixel order is:RGB(A)
-                        luminanceBuffer.push_back(luminance(static_cast<float>(bits[0]), static_cast<float>(bits[1]), static_cast<float>(bits[2])));
-                        // jump to next pixel
-                        bits += bytespp;
-                    }
-                }
-                break;
-
-            case FIT_RGBF:
-                for (auto y = 0; y < imageHeight; ++y)
-                {
-                    FLOAT *bits = reinterpret_cast<FLOAT *>(FreeImage_GetScanLine(bitmap, imageHeight - y - 1));
-
-                    for (auto x = 0; x < imageWidth; ++x)
-                    {
-                        unsigned int buf_index = (imageWidth * y + x) * 4;
+                std::cerr << "Unknown diff format: " << argv[i] << " (rgba, float, half)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--metrics" && i + 1 < argc)
+        {
+            if (!ImageMetrics::parseSelection(argv[++i], &runOptions.metrics))
+            {
+                std::cerr << "Unknown metrics: " << argv[i] << " (rmse, psnr, relmse, ssim)" << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "--mip" || arg == "--approximate") && i + 1 < argc)
+        {
+            int level = std::atoi(argv[++i]);
+            if (level <= 0)
+            {
+                std::cerr << "Invalid mip level: " << argv[i] << std::endl;
+                return 1;
+            }
+            (arg == "--mip" ? runOptions.mipLevels : runOptions.approximateLevel) = level;
+        }
+        else if (arg == "--percentiles")
+            runOptions.percentiles = true;
+        else if (arg == "--error-threshold" && i + 1 < argc)
+        {
+            runOptions.errorThreshold = std::atof(argv[++i]);
+            if (runOptions.errorThreshold < 0.0)
+            {
+                std::cerr << "Invalid error threshold: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--peak" && i + 1 < argc)
+            runOptions.metrics.peak = std::atof(argv[++i]);
+        else if (arg == "--channels" && i + 1 < argc)
+        {
+            std::string channels = argv[++i];
+            if (channels != "rgb" && channels != "rgba")
+            {
+                std::cerr << "Unknown channels: " << channels << " (rgb, rgba)" << std::endl;
+                return 1;
+            }
+            runOptions.channels = static_cast<int>(channels.size());
+        }
+        else if (arg == "--nan-policy" && i + 1 < argc)
+        {
+            NanPolicy policy;
+            if (!ImageRMSE::parseNanPolicy(argv[++i], &policy))
+            {
+                std::cerr << "Unknown NaN/Inf policy: " << argv[i] << " (count, clamp, mask, fail)" << std::endl;
+                return 1;
+            }
+            ImageRMSE::setNanPolicy(policy);
+        }
+        else if (arg == "--result-cache" && i + 1 < argc)
+            runOptions.resultCache = argv[++i];
+        else if (arg == "--stream")
+            streaming = true;
+        else if (arg == "--threads" && i + 1 < argc)
+            ImageRMSE::setThreadCount(static_cast<unsigned>(std::max(std::atoi(argv[++i]), 1)));
+        else if (arg == "--gpu")
+            ImageRMSE::setGpuEnabled(true);
+        else if (arg == "--pool-mb" && i + 1 < argc)
+            ImageRMSE::setPoolLimit(static_cast<size_t>(std::max(std::atoi(argv[++i]), 0)) << 20);
+        else if (arg == "--simd" && i + 1 < argc)
+        {
+            SimdKernels::Target target;
+            if (!SimdKernels::parseTarget(argv[++i], &target))
+            {
+                std::cerr << "Unknown SIMD target: " << argv[i] << " (scalar, sse2, avx2, avx512, neon)" << std::endl;
+                return 1;
+            }
+            SimdKernels::setTarget(target);
+        }
+        else
+            images.push_back(arg);
+    }
 
-                        assert(!isinf(static_cast<float>(bits[0])) && !isnan(static_cast<float>(bits[0])));
-                        assert(!isinf(static_cast<float>(bits[1])) && !isnan(static_cast<float>(bits[1])));
-                        assert(!isinf(static_cast<float>(bits[2])) && !isnan(static_cast<float>(bits[2])));
+    Profiler::setEnabled(!profile.empty());
 
-                        luminanceBuffer.push_back(luminance(static_cast<float>(bits[0]), static_cast<float>(bits[1]), static_cast<float>(bits[2])));
-                        // jump to next pixel
-                        bits += bytespp;
-                    }
-                }
-                break;
-            default:
-                std::cerr << "Type of the image is not RGBF/RGBAF, not supported yet..." << std::endl;
-                break;
-            }
+    if (!convertInput.empty())
+        return finish(ImageRMSE::convertToRaw(convertInput, convertOutput, rawRGB, rawHalf) ? 0 : 1, profile);
 
-            assert(luminanceBuffer.size() == imageWidth * imageHeight);
-            // Unload the 32-bit colour bitmap
-            FreeImage_Unload(bitmap);
+    // A server keeps references for its whole lifetime, so it gets a budget by default.
+    if (referenceCacheMB < 0 && !serve.empty())
+        referenceCacheMB = 4096;
+    if (referenceCacheMB >= 0)
+        ImageRMSE::setReferenceCacheLimit(static_cast<size_t>(referenceCacheMB) << 20);
 
-            return luminanceBuffer;
+    if (!serve.empty())
+    {
+        if (serve == "-")
+        {
+            ComparisonServer::servePipe(std::cin, std::cout, serverOptions);
+            return finish(0, profile);
         }
+        int port = std::atoi(serve.c_str());
+        if (port <= 0 || port > 65535)
+        {
+            std::cerr << "Invalid port: " << serve << std::endl;
+            return 1;
+        }
+        return finish(ComparisonServer::serveSocket(port, serverOptions) ? 0 : 1, profile);
+    }
 
-        /**
-         * @brief Save luminance (R=G=B) buffer to OpenEXR image.
-         */
-        static void saveLuminanceImage(const std::vector<double> &buffer, int width, int height, const std::string & filename)
+    if (!manifest.empty())
+    {
+        std::vector<ManifestEntry> entries;
+        std::string error;
+        if (!Manifest::load(manifest, &entries, &error))
         {
-            FIBITMAP* bitmap = FreeImage_AllocateT(FIT_RGBAF, width, height);
+            std::cerr << error << std::endl;
+            return 1;
+        }
 
-            int bitsPerPixel = FreeImage_GetBPP(bitmap);
-            FREE_IMAGE_TYPE imageType = FreeImage_GetImageType(bitmap);
-            int bytespp = FreeImage_GetLine(bitmap) / width / sizeof(float);
+        if (resume && output.empty())
+        {
+            std::cerr << "--resume needs --output" << std::endl;
+            return 1;
+        }
 
-            for (auto y = 0; y < height; ++y)
+        std::vector<size_t> indices = Manifest::shard(entries, shard, shardCount);
+        // Results already written by an interrupted run are kept, failed comparisons are retried.
+        std::map<size_t, ManifestResult> done;
+        if (resume && Manifest::loadResults(output, entries, &done))
+        {
+            indices.erase(std::remove_if(indices.begin(), indices.end(), [&](size_t i)
             {
-                //Note the scanline fetched by FreeImage is upside down--the first scanline corresponds to the buttom of the image!
-                FLOAT *bits = reinterpret_cast<FLOAT *>(FreeImage_GetScanLine(bitmap, height - y - 1));
-
-                for (auto x = 0; x < width; ++x)
-                {
-                    unsigned int buf_index = (width * y + x) * 1;
+                auto it = done.find(i);
+                return it != done.end() && it->second.ok;
+            }), indices.end());
+        }
 
-                    //32bit image texture is linear.
-                    bits[0] = buffer[buf_index];
-                    bits[1] = buffer[buf_index];
-                    bits[2] = buffer[buf_index];
-                    bits[3] = 1.f;
-                    // jump to next pixel
-                    bits += bytespp;
-                }
+        std::ofstream file;
+        if (!output.empty())
+        {
+            bool partialLine = resume && !endsWithNewline(output);
+            file.open(output, resume ? std::ios::app : std::ios::trunc);
+            if (!file)
+            {
+                std::cerr << "Failed to open output file: " << output << std::endl;
+                return 1;
             }
-
-            FreeImage_Save(FIF_EXR, bitmap, filename.c_str());
-            // Unload the 32-bit colour bitmap
-            FreeImage_Unload(bitmap);
+            if (partialLine)
+                file << std::endl;
         }
-    };
-}
+        std::ostream & out = output.empty() ? std::cout : file;
 
-using namespace ImageUtil;
+        if (!mergeInputs.empty())
+            return finish(Manifest::merge(entries, mergeInputs, out) == 0 ? 0 : 1, profile);
 
+        size_t failures = ImageRMSE::runManifest(entries, indices, out);
+        return finish(failures == 0 ? 0 : 1, profile);
+    }
+
+    if (!sequence.empty())
+    {
+        if (lastFrame < firstFrame)
+        {
+            std::cerr << "--sequence needs --frames first-last" << std::endl;
+            return 1;
+        }
+        runOptions.diffImage = diffImage;
+        ImageRMSE::computeSequence(sequence, referenceSequence, firstFrame, lastFrame, runOptions);
+        return finish(0, profile);
+    }
 
-int main(int argc, char* argv[])
-{
     // Check the number of parameters
-    if (argc < 4) {
+    if (images.size() < 2) {
         // Tell the user how to run the program
-        std::cerr << "RMSE Sample Usage: " << argv[0] << " image1.exr image2.exr refImage.exr <true>" << std::endl;
+        std::cerr << "RMSE Sample Usage: " << argv[0] << " image1.exr [image2.exr ...] refImage.exr <--diff> <--stream> <--threads N> <--simd scalar|sse2|avx2|avx512|neon> <--profile profile.json|->" << std::endl
+                  << "                   <--roi x,y,width,height> <--tile-stats 32> <--diff-format rgba|float|half> <--exr-compression piz|zip|none|pxr24|b44> <--threshold maxRMSE <--value-range max>>" << std::endl
+                  << "                   <--metrics rmse,psnr,relmse,ssim <--peak 1>> <--channels rgb|rgba> <--result-cache dir> <--nan-policy count|clamp|mask|fail> <--gpu>" << std::endl
+                  << "                   <--mip levels> <--approximate level> <--percentiles> <--error-threshold 0.1>" << std::endl
+                  << "Batch Usage:       " << argv[0] << " --manifest comparisons.(csv|jsonl) <--output results.jsonl> <--threads N> <--pool-mb 1024> <--reference-cache-mb 0> <--nan-policy count|clamp|mask|fail> <--profile profile.json|->" << std::endl
+                  << "                   <--shard index/count <--resume>> <--merge shard0.jsonl shard1.jsonl ...>" << std::endl
+                  << "Server Usage:      " << argv[0] << " --serve port|- <--serve-output-dir dir> <--threads N> <--reference-cache-mb 4096> <--pool-mb 1024> <--nan-policy count|clamp|mask|fail>" << std::endl
+                  << "Sequence Usage:    " << argv[0] << " --sequence shot.####.exr ref.####.exr --frames 1-240 <--diff> <--threads N> <--roi x,y,width,height> <--metrics rmse,psnr,relmse,ssim>" << std::endl
+                  << "Raw Cache Usage:   " << argv[0] << " --convert-raw refImage.exr refImage.iuraw <--rgb> <--half>" << std::endl;
         /* "Usage messages" are a conventional way of telling the user
          * how to run a program if they enter the command incorrectly.
          */
         return 1;
     }
 
-    ImageRMSE::computeRMSE(argv[1], argv[2], argv[3], argc==5);
+    std::string ref = images.back();
+    images.pop_back();
+    if (threshold)
+    {
+        // Exit status 2 tells "compared, but over the tolerance" apart from usage errors.
+        thresholdOptions.roi = runOptions.roi;
+        bool passed = true;
+        for (const auto & result : ImageRMSE::computeRMSEThreshold(images, ref, thresholdOptions))
+            passed = passed && result.passed;
+        return finish(passed ? 0 : 2, profile);
+    }
+
+    runOptions.diffImage = diffImage;
+    if (streaming)
+        ImageRMSE::computeRMSEStreaming(images, ref, runOptions);
+    else
+        ImageRMSE::computeRMSE(images, ref, runOptions);
     
-    return 0;
+    return finish(0, profile);
 }
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Quality metrics computed next to RMSE. Metrics that aren't selected cost nothing.
+     */
+    struct MetricSelection
+    {
+        bool psnr = false;
+        bool relMSE = false;
+        bool ssim = false;
+        /* Peak signal of PSNR and dynamic range of SSIM, 0 for the maximum of the reference
+           (or of the candidate if the reference is black, or 1 if both are). */
+        double peak = 0.0;
+
+        bool any() const
+        {
+            return psnr || relMSE || ssim;
+        }
+    };
+
+    /**
+     * @brief Quality metrics of one image pair, NaN unless computed.
+     */
+    struct QualityMetrics
+    {
+        MetricSelection computed;
+        double psnr = std::numeric_limits<double>::quiet_NaN();
+        double relMSE = std::numeric_limits<double>::quiet_NaN();
+        double ssim = std::numeric_limits<double>::quiet_NaN();
+    };
+
+    /**
+     * @brief PSNR, relative MSE and SSIM of luminance buffers (rows from the top, width
+     *        floats each). Row partials are reduced in row order, so results are
+     *        identical for any thread count.
+     */
+    class ImageMetrics
+    {
+    public:
+        /**
+         * @brief Parse a comma separated list of psnr, relmse and ssim. rmse is accepted
+         *        as well, it is always computed.
+         * @return False for an unknown name.
+         */
+        static bool parseSelection(const std::string & text, MetricSelection *selection)
+        {
+            MetricSelection parsed = *selection;
+            std::istringstream stream(text);
+            std::string name;
+            while (std::getline(stream, name, ','))
+            {
+                if (name == "psnr")
+                    parsed.psnr = true;
+                else if (name == "relmse")
+                    parsed.relMSE = true;
+                else if (name == "ssim")
+                    parsed.ssim = true;
+                else if (name != "rmse")
+                    return false;
+            }
+            *selection = parsed;
+            return true;
+        }
+
+        /**
+         * @brief Compute the selected metrics of candidate data1 against reference data2.
+         * @param mse Mean squared error of the pair (from the RMSE pass), PSNR is derived from it.
+         */
+        static QualityMetrics compute(const float *data1, const float *data2, int width, int height, double mse,
+                                      const MetricSelection & selection, ThreadPool & pool)
+        {
+            QualityMetrics metrics;
+            metrics.computed = selection;
+            if (mse == 0.0)
+            {
+                // Equal images, masked pixels aside: no pass over the pixels needed.
+                metrics.psnr = selection.psnr ? psnr(mse, 1.0) : metrics.psnr;
+                metrics.relMSE = selection.relMSE ? 0.0 : metrics.relMSE;
+                metrics.ssim = selection.ssim ? 1.0 : metrics.ssim;
+                return metrics;
+            }
+            double range = selection.peak;
+            if (range <= 0.0 && (selection.psnr || selection.ssim))
+            {
+                // A black reference would give a zero range: NaN PSNR and SSIM constants of 0.
+                range = maxValue(data2, width, height, pool);
+                if (!(range > 0.0))
+                    range = maxValue(data1, width, height, pool);
+                if (!(range > 0.0))
+                    range = 1.0;
+            }
+
+            if (selection.psnr)
+                metrics.psnr = psnr(mse, range);
+            if (selection.relMSE)
+                metrics.relMSE = relMSE(data1, data2, width, height, pool);
+            if (selection.ssim)
+                metrics.ssim = ssim(data1, data2, width, height, range, pool);
+            return metrics;
+        }
+
+        /**
+         * @return Peak signal-to-noise ratio in dB, +inf for identical images.
+         */
+        static double psnr(double mse, double peak)
+        {
+            if (mse == 0.0)
+                return std::numeric_limits<double>::infinity();
+            return 10.0 * std::log10(peak * peak / mse);
+        }
+
+        /**
+         * @brief Mean of (a - b)^2 / (b^2 + 0.01), the relative MSE used for denoisers,
+         *        which keeps errors in dark regions from being drowned out by highlights.
+         */
+        static double relMSE(const float *data1, const float *data2, int width, int height, ThreadPool & pool)
+        {
+            std::vector<double> rows(height);
+            pool.parallelFor(height, rowGrain(width), [&](int begin, int end)
+            {
+                for (auto y = begin; y < end; ++y)
+                {
+                    const float *a = data1 + static_cast<size_t>(width) * y;
+                    const float *b = data2 + static_cast<size_t>(width) * y;
+                    double sum = 0.0;
+                    for (auto x = 0; x < width; ++x)
+                    {
+                        double diff = static_cast<double>(a[x]) - b[x];
+                        sum += diff * diff / (static_cast<double>(b[x]) * b[x] + relMSEEpsilon);
+                    }
+                    rows[y] = sum;
+                }
+            });
+            return sumRows(rows) / (static_cast<double>(width) * height);
+        }
+
+        /**
+         * @brief Mean SSIM over 11x11 Gaussian windows (sigma 1.5), with K1 = 0.01, K2 = 0.03
+         *        and edge pixels repeated beyond the borders.
+         * @param range Dynamic range L of the luminance.
+         */
+        static double ssim(const float *data1, const float *data2, int width, int height, double range, ThreadPool & pool)
+        {
+            const float c1 = static_cast<float>(0.01 * range * 0.01 * range);
+            const float c2 = static_cast<float>(0.03 * range * 0.03 * range);
+            const std::vector<float> weights = gaussianWeights();
+            const size_t padded = static_cast<size_t>(width) + 2 * radius;
+
+            std::vector<double> rows(height);
+            pool.parallelFor(height, std::max(1, rowGrain(width) / taps), [&](int begin, int end)
+            {
+                // Window moments of mean 1, mean 2, mean 1^2, mean 2^2 and mean 1*2: after the
+                // vertical pass padded by the edge values, then after the horizontal pass.
+                std::vector<float> vertical(moments * padded), windows(moments * static_cast<size_t>(width));
+                std::vector<float> ssimRow(width);
+
+                for (auto y = begin; y < end; ++y)
+                {
+                    // Both passes run straight along the rows so the inner loops vectorize.
+                    std::fill(vertical.begin(), vertical.end(), 0.f);
+                    float *v1 = vertical.data() + radius;
+                    float *v2 = v1 + padded;
+                    float *v11 = v2 + padded;
+                    float *v22 = v11 + padded;
+                    float *v12 = v22 + padded;
+                    for (int k = 0; k < taps; ++k)
+                    {
+                        int row = std::min(std::max(y + k - radius, 0), height - 1);
+                        const float *a = data1 + static_cast<size_t>(width) * row;
+                        const float *b = data2 + static_cast<size_t>(width) * row;
+                        const float w = weights[k];
+                        for (auto x = 0; x < width; ++x)
+                        {
+                            v1[x] += w * a[x];
+                            v2[x] += w * b[x];
+                            v11[x] += w * a[x] * a[x];
+                            v22[x] += w * b[x] * b[x];
+                            v12[x] += w * a[x] * b[x];
+                        }
+                    }
+
+                    std::fill(windows.begin(), windows.end(), 0.f);
+                    for (int m = 0; m < moments; ++m)
+                    {
+                        float *src = vertical.data() + m * padded;
+                        std::fill(src, src + radius, src[radius]);
+                        std::fill(src + radius + width, src + padded, src[radius + width - 1]);
+                        float *dst = windows.data() + static_cast<size_t>(m) * width;
+                        for (int k = 0; k < taps; ++k)
+                        {
+                            const float w = weights[k];
+                            for (auto x = 0; x < width; ++x)
+                                dst[x] += w * src[x + k];
+                        }
+                    }
+
+                    // Float is enough: variances too small for it sit far below c2.
+                    const float *mu1 = windows.data();
+                    const float *mu2 = mu1 + width;
+                    const float *e11 = mu2 + width;
+                    const float *e22 = e11 + width;
+                    const float *e12 = e22 + width;
+                    for (auto x = 0; x < width; ++x)
+                    {
+                        float var1 = e11[x] - mu1[x] * mu1[x];
+                        float var2 = e22[x] - mu2[x] * mu2[x];
+                        float cov = e12[x] - mu1[x] * mu2[x];
+                        ssimRow[x] = ((2.f * mu1[x] * mu2[x] + c1) * (2.f * cov + c2)) /
+                                     ((mu1[x] * mu1[x] + mu2[x] * mu2[x] + c1) * (var1 + var2 + c2));
+                    }
+
+                    double sum = 0.0;
+                    for (auto x = 0; x < width; ++x)
+                        sum += ssimRow[x];
+                    rows[y] = sum;
+                }
+            });
+            return sumRows(rows) / (static_cast<double>(width) * height);
+        }
+
+    private:
+        static const int radius = 5;
+        static const int taps = 2 * radius + 1;
+        static const int moments = 5;
+        static constexpr double relMSEEpsilon = 0.01;
+
+        static std::vector<float> gaussianWeights()
+        {
+            const double sigma = 1.5;
+            std::vector<double> weights(taps);
+            double total = 0.0;
+            for (int k = 0; k < taps; ++k)
+            {
+                weights[k] = std::exp(-(k - radius) * (k - radius) / (2.0 * sigma * sigma));
+                total += weights[k];
+            }
+            std::vector<float> normalized(taps);
+            for (int k = 0; k < taps; ++k)
+                normalized[k] = static_cast<float>(weights[k] / total);
+            return normalized;
+        }
+
+        static double maxValue(const float *data, int width, int height, ThreadPool & pool)
+        {
+            std::vector<double> rows(height);
+            pool.parallelFor(height, rowGrain(width), [&](int begin, int end)
+            {
+                for (auto y = begin; y < end; ++y)
+                {
+                    const float *row = data + static_cast<size_t>(width) * y;
+                    rows[y] = *std::max_element(row, row + width);
+                }
+            });
+            return rows.empty() ? 0.0 : *std::max_element(rows.begin(), rows.end());
+        }
+
+        static double sumRows(const std::vector<double> & rows)
+        {
+            double sum = 0.0;
+            for (double row : rows)
+                sum += row;
+            return sum;
+        }
+
+        /**
+         * @brief Rows per parallelFor chunk, roughly 64K pixels.
+         */
+        static int rowGrain(int width)
+        {
+            return std::max(1, (1 << 16) / std::max(width, 1));
+        }
+    };
+}
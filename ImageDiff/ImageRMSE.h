@@ -0,0 +1,3578 @@
+#pragma once
+
+#include "freeImage/FreeImagePlus.h"
+#include "ImageBuffer.h"
+#include "PixelFormats.h"
+#include "ExrDecoder.h"
+#include "GpuMetrics.h"
+#include "SimdKernels.h"
+#include "ThreadPool.h"
+#include "Manifest.h"
+#include "RawImage.h"
+#include "Profiler.h"
+#include "AsyncImageWriter.h"
+#include "BufferPool.h"
+#include "ImageMetrics.h"
+#include "ErrorHistogram.h"
+#include "FrameSequence.h"
+#include "ResultCache.h"
+
+#include <iostream>
+#include <locale>
+#include <string>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include <sys/stat.h>
+
+namespace ImageUtil
+{
+    inline double luminance(float r, float g, float b)
+    {
+        return 0.212671f * r + 0.715160f * g + 0.072169f * b;
+    }
+
+    template<typename T>
+    std::vector<T> diffVector(const std::vector<T>& v1, const std::vector<T>& v2)
+    {
+        assert(v1.size() == v2.size());
+        
+        std::vector<T> res;
+        res.reserve(v1.size());
+        for (size_t i = 0; i < v1.size(); ++i)
+        {
+            res.push_back(std::abs(v1[i] - v2[i]));
+        }
+        return res;
+    }
+
+    /**
+     * @brief Storage type of luminance buffers. Luminance is computed in float,
+     *        so wider storage would only cost memory bandwidth and SIMD width.
+     */
+    typedef float LuminanceType;
+    typedef std::vector<LuminanceType> LuminanceBuffer;
+
+    /**
+     * @brief Read-only luminance image, owning a buffer or viewing a mapped raw file.
+     */
+    struct LuminanceView
+    {
+        const LuminanceType *data = nullptr;
+        int width = 0;
+        int height = 0;
+        /* Keeps the buffer or the mapping alive. */
+        std::shared_ptr<const void> owner;
+        /* NaN/Inf pixels found while loading, see NanPolicy. */
+        size_t nonFinite = 0;
+        /* NanPolicy::Mask: sorted indices of the NaN/Inf pixels, which were set to 0. */
+        std::shared_ptr<const std::vector<size_t>> masked;
+
+        explicit operator bool() const
+        {
+            return data != nullptr;
+        }
+    };
+
+    /**
+     * @brief Plain double accumulation.
+     */
+    struct DoubleAccumulator
+    {
+        double sum = 0.0;
+
+        void add(double value)
+        {
+            sum += value;
+        }
+
+        double result() const
+        {
+            return sum;
+        }
+    };
+
+    /**
+     * @brief Compensated (Kahan-Babuska) accumulation, for very large pixel counts.
+     */
+    struct KahanAccumulator
+    {
+        double sum = 0.0;
+        double compensation = 0.0;
+
+        void add(double value)
+        {
+            double t = sum + value;
+            if (std::abs(sum) >= std::abs(value))
+                compensation += (sum - t) + value;
+            else
+                compensation += (value - t) + sum;
+            sum = t;
+        }
+
+        double result() const
+        {
+            return sum + compensation;
+        }
+    };
+
+    /**
+     * @brief Error statistics of one image pair, gathered in a single pass.
+     */
+    struct ErrorMetrics
+    {
+        double sumSquaredError = 0.0;
+        double maxDiff = 0.0;
+        int maxDiffIndex = 0;
+        size_t pixelCount = 0;
+        /* NaN/Inf luminance pixels of the candidate, see NanPolicy. */
+        size_t nonFinite = 0;
+
+        double rmse() const
+        {
+            return sqrt(1.0 / pixelCount * sumSquaredError);
+        }
+    };
+
+    /**
+     * @brief Per-channel error statistics (R, G, B and optionally A) of one image pair.
+     */
+    struct ChannelMetrics
+    {
+        int channels = 0;
+        double sumSquaredError[4] = { 0.0, 0.0, 0.0, 0.0 };
+        double maxDiff[4] = { 0.0, 0.0, 0.0, 0.0 };
+        size_t pixelCount = 0;
+
+        double mse(int channel) const
+        {
+            return sumSquaredError[channel] / pixelCount;
+        }
+
+        double rmse(int channel) const
+        {
+            return sqrt(mse(channel));
+        }
+    };
+
+    /**
+     * @brief Per-tile error statistics of one image pair, tiles in row-major order from the top.
+     */
+    struct TileMetrics
+    {
+        int tileSize = 0;
+        int columns = 0;
+        int rows = 0;
+        int width = 0;
+        int height = 0;
+        std::vector<double> sumSquaredError;
+        std::vector<double> sumAbsDiff;
+        std::vector<double> maxDiff;
+
+        void reset(int imageWidth, int imageHeight, int size)
+        {
+            tileSize = size;
+            width = imageWidth;
+            height = imageHeight;
+            columns = (imageWidth + size - 1) / size;
+            rows = (imageHeight + size - 1) / size;
+            sumSquaredError.assign(static_cast<size_t>(columns) * rows, 0.0);
+            sumAbsDiff.assign(sumSquaredError.size(), 0.0);
+            maxDiff.assign(sumSquaredError.size(), 0.0);
+        }
+
+        /**
+         * @brief Pixels of tile (column, row), edge tiles may be smaller.
+         */
+        size_t pixelCount(int column, int row) const
+        {
+            return static_cast<size_t>(std::min(tileSize, width - column * tileSize)) * std::min(tileSize, height - row * tileSize);
+        }
+
+        double rmse(int column, int row) const
+        {
+            return sqrt(sumSquaredError[static_cast<size_t>(row) * columns + column] / pixelCount(column, row));
+        }
+
+        double meanDiff(int column, int row) const
+        {
+            return sumAbsDiff[static_cast<size_t>(row) * columns + column] / pixelCount(column, row);
+        }
+    };
+
+    /**
+     * @brief Pixel layout of diff images: RGBA (R=G=B, A=1) or single channel float or
+     *        half, which is a quarter of the size and is written by the metric pass directly.
+     */
+    enum class DiffFormat
+    {
+        RGBA,
+        Float,
+        Half
+    };
+
+    /**
+     * @brief Handling of NaN/Inf luminance pixels, which are counted by a vectorized scan
+     *        of every converted row in any case.
+     */
+    enum class NanPolicy
+    {
+        /* Compare them as they are, the RMSE of an affected pair becomes NaN or Inf. */
+        Count,
+        /* Replace NaN by 0 and infinities by the largest finite floats. */
+        Clamp,
+        /* Leave pixels that are NaN/Inf in either image out of the comparison: they
+           compare equal and don't count as pixels of the RMSE. */
+        Mask,
+        /* Don't compare images with NaN/Inf pixels, without stopping the other comparisons. */
+        Fail
+    };
+
+    /**
+     * @brief Options of a single comparison.
+     */
+    struct CompareOptions
+    {
+        /* Output path of the diff image, empty for none. */
+        std::string diffFilename;
+        /* FreeImage EXR save flags of the diff image, e.g. EXR_ZIP or EXR_NONE. */
+        int diffSaveFlags = EXR_DEFAULT;
+        DiffFormat diffFormat = DiffFormat::RGBA;
+        /* Output path of the tile statistics image, empty for none. */
+        std::string tileFilename;
+        /* Edge length of the tiles in tileFilename. */
+        int tileSize = 32;
+        /* Quality metrics computed next to RMSE. */
+        MetricSelection metrics;
+        /* Compared region, empty for the whole image. */
+        Region roi;
+    };
+
+    /**
+     * @brief Options of computeRMSE()/computeRMSEStreaming() runs over N candidates.
+     */
+    struct RunOptions
+    {
+        /* Write the full resolution diff image diff<i>.exr per candidate. */
+        bool diffImage = false;
+        /* FreeImage EXR save flags of the diff images, e.g. EXR_ZIP or EXR_NONE. */
+        int diffSaveFlags = EXR_DEFAULT;
+        DiffFormat diffFormat = DiffFormat::RGBA;
+        /* If > 0, write per-tile RMSE/max/mean of tiles of this size to tiles<i>.exr. */
+        int tileSize = 0;
+        /* 3 or 4: also report RMSE, MSE and max diff of R, G, B (and A), gathered by the
+           streaming sweep. A missing alpha channel counts as 1. */
+        int channels = 0;
+        /* Quality metrics computed next to RMSE, by computeRMSE() only. */
+        MetricSelection metrics;
+        /* Compared region, empty for the whole image. */
+        Region roi;
+        /* Directory of the result cache of computeRMSE(), empty for none. Candidates whose
+           content, reference content and options match a stored result aren't decoded.
+           Runs writing diff images, tile statistics, mip levels or error histograms
+           bypass the cache. */
+        std::string resultCache;
+        /* If > 0, computeRMSE() also reports the RMSE of this many box-filtered mip levels
+           (level 1 is half the resolution), coarsest first, as each candidate finishes. */
+        int mipLevels = 0;
+        /* If > 0, computeRMSE() stops at this mip level: its RMSE (and quality metrics) are
+           reported as the result, and the full resolution pass, diff image and tile
+           statistics are skipped. Max diff indices then refer to the level's pixels. */
+        int approximateLevel = 0;
+        /* Also report p50/p99/p99.9 of the absolute error, from an ErrorHistogram filled
+           by the metric pass, e.g. to tell a few fireflies from a broad error. */
+        bool percentiles = false;
+        /* If >= 0, also report the pixels whose absolute error is above it. */
+        double errorThreshold = -1.0;
+
+        bool histogram() const
+        {
+            return percentiles || errorThreshold >= 0.0;
+        }
+    };
+
+    /**
+     * @brief Outcome of a single comparison, error is set when ok is false.
+     */
+    struct ComparisonResult
+    {
+        bool ok = false;
+        std::string error;
+        /* Messages of the loaders, e.g. why a file failed to load or NaN/Inf pixels in the reference. */
+        std::vector<std::string> warnings;
+        ErrorMetrics metrics;
+        QualityMetrics quality;
+    };
+
+    /**
+     * @brief While in scope, collects the messages the loaders report on this thread
+     *        (see ImageRMSE::report()) instead of writing them to std::cerr.
+     */
+    class Diagnostics
+    {
+    public:
+        Diagnostics() : previous(current())
+        {
+            current() = this;
+        }
+
+        ~Diagnostics()
+        {
+            current() = previous;
+        }
+
+        Diagnostics(const Diagnostics &) = delete;
+        Diagnostics & operator=(const Diagnostics &) = delete;
+
+        /**
+         * @brief Innermost capture of the calling thread, nullptr if none.
+         */
+        static Diagnostics *& current()
+        {
+            thread_local Diagnostics *capture = nullptr;
+            return capture;
+        }
+
+        std::vector<std::string> messages;
+
+    private:
+        Diagnostics *previous;
+    };
+
+    /**
+     * @brief Options of a pass/fail comparison against an RMSE tolerance.
+     */
+    struct ThresholdOptions
+    {
+        /* A candidate passes if its RMSE is at most maxRMSE. */
+        double maxRMSE = 0.0;
+        /* If > 0, all luminance values are promised to lie in [0, valueRange]. That
+           bounds the error of pixels not yet compared, so a pass can be decided early. */
+        double valueRange = 0.0;
+        /* Compared region, empty for the whole image. */
+        Region roi;
+    };
+
+    /**
+     * @brief Outcome of a pass/fail comparison, error is set when ok is false.
+     */
+    struct ThresholdResult
+    {
+        bool ok = false;
+        std::string error;
+        bool passed = false;
+        /* True if the outcome was certain before all pixels were compared. */
+        bool earlyOut = false;
+        /* Exact RMSE without early out, otherwise the bound that decided the outcome:
+           a lower bound for a failure, an upper bound for a pass. */
+        double rmse = std::numeric_limits<double>::quiet_NaN();
+        size_t pixelsCompared = 0;
+        size_t pixelCount = 0;
+        /* NaN/Inf luminance pixels of the candidate found so far, see NanPolicy. Masked
+           pixels compare equal but stay in pixelCount, the early out bounds need it fixed. */
+        size_t nonFinite = 0;
+    };
+
+    /**
+     * @brief Utility class for loading image and compute RMSE.
+     */
+    class ImageRMSE
+    {
+        /* Times the private stages, see ImageBench. */
+        friend class Benchmark;
+
+    public:
+        /**
+         * @brief Compute RMSE and output directly.
+         */
+        static void computeRMSE(const std::string & data1, const std::string & data2, const std::string & ref, bool diffImage = false)
+        {
+            computeRMSE(std::vector<std::string>{ data1, data2 }, ref, diffImage);
+        }
+
+        /**
+         * @brief Compute RMSE of N candidates against one reference and output directly.
+         *        The reference is decoded once and kept in the reference cache, so
+         *        successive calls with the same (unchanged) reference skip decoding.
+         * @return RMSE per candidate, NaN if the candidate could not be compared.
+         */
+        static std::vector<double> computeRMSE(const std::vector<std::string> & candidates, const std::string & ref, bool diffImage)
+        {
+            RunOptions options;
+            options.diffImage = diffImage;
+            return computeRMSE(candidates, ref, options);
+        }
+
+        /**
+         * @brief computeRMSE() with a region of interest and diff/tile/channel outputs.
+         *        With a region, max diff indices are relative to the region. Channel
+         *        metrics need the RGB(A) scanlines and run computeRMSEStreaming().
+         */
+        static std::vector<double> computeRMSE(const std::vector<std::string> & candidates, const std::string & ref, const RunOptions & options = RunOptions())
+        {
+            if (options.channels > 0)
+                return computeRMSEStreaming(candidates, ref, options);
+
+            std::vector<ErrorMetrics> results(candidates.size());
+            std::vector<QualityMetrics> quality(options.metrics.any() ? candidates.size() : 0);
+            std::vector<ErrorHistogram> histograms(options.histogram() ? candidates.size() : 0, ErrorHistogram(histogramThreshold(options)));
+            const Region & roi = options.roi;
+
+            // With a result cache the reference is hashed up front, so candidate loads can
+            // look up their results, and only decoded on the first miss.
+            const bool pyramid = options.mipLevels > 0 || options.approximateLevel > 0;
+            const ResultCache cache(options.diffImage || options.tileSize > 0 || pyramid || options.histogram() ? std::string() : options.resultCache);
+            uint64_t refHash = 0;
+            std::vector<BYTE> refEncoded;
+            const bool useCache = cache.enabled() && fileHash(ref, &refHash, &refEncoded);
+            // Candidates with the bytes of the reference file aren't decoded when the
+            // reference luminance can stand in for theirs, see identicalFiles().
+            const bool identicalShortcut = !options.diffImage && options.tileSize <= 0 && !options.metrics.any() && !pyramid;
+
+            // Reference and first candidate are decoded concurrently, afterwards the
+            // next candidate is decoded while the current one is being compared.
+            std::vector<int> widths(candidates.size()), heights(candidates.size());
+            auto loadCandidate = [&](size_t i)
+            {
+                return pool()->submit([&, i]
+                {
+                    CandidateLoad load;
+                    if (identicalShortcut && identicalFiles(candidates[i], ref))
+                    {
+                        load.identical = true;
+                        return load;
+                    }
+                    std::vector<BYTE> encoded;
+                    if (useCache && fileHash(candidates[i], &load.hash, &encoded))
+                    {
+                        load.hashed = true;
+                        ResultCache::Values values;
+                        if (cache.load(resultKey(load.hash, refHash, options), &values) &&
+                            fromCacheValues(values, options.metrics, &load.metrics, &load.quality))
+                        {
+                            Profiler::Stage stage("resultCacheHit", candidates[i]);
+                            load.cached = true;
+                            return load;
+                        }
+                    }
+                    load.image = loadImageToLuminance(candidates[i], &widths[i], &heights[i], roi, encoded.empty() ? nullptr : &encoded, &load.nonFinite);
+                    return load;
+                });
+            };
+
+            std::future<LuminanceView> refFuture;
+            if (!useCache)
+                refFuture = pool()->submit([&ref, &roi] { return loadReference(ref, roi); });
+            std::future<CandidateLoad> next;
+            if (!candidates.empty())
+                next = loadCandidate(0);
+
+            LuminanceView imageRef;
+            if (!useCache)
+            {
+                imageRef = refFuture.get();
+                if (!imageRef)
+                {
+                    if (next.valid())
+                        next.wait();
+                    std::cerr << "Failed to load reference image: " << ref << std::endl;
+                    return reportResults(results, false);
+                }
+            }
+
+            // Diff images are encoded in the background while the next candidate is compared.
+            std::vector<std::pair<std::string, std::future<bool>>> saves;
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                CandidateLoad load = next.get();
+                if (i + 1 < candidates.size())
+                    next = loadCandidate(i + 1);
+
+                if (load.cached)
+                {
+                    results[i] = load.metrics;
+                    if (options.metrics.any())
+                        quality[i] = load.quality;
+                    continue;
+                }
+
+                if (!imageRef && useCache)
+                {
+                    imageRef = loadReference(ref, roi, refEncoded.empty() ? nullptr : &refEncoded);
+                    std::vector<BYTE>().swap(refEncoded);
+                    if (!imageRef)
+                    {
+                        recycleBuffer(std::move(load.image));
+                        if (next.valid())
+                            next.wait();
+                        std::cerr << "Failed to load reference image: " << ref << std::endl;
+                        return reportResults(results, false);
+                    }
+                }
+
+                if (load.identical)
+                {
+                    // The candidate's luminance would be the reference's, NaN/Inf pixels
+                    // aside, which the policies have to see.
+                    if (!imageRef.nonFinite)
+                    {
+                        results[i] = identicalMetrics(imageRef.width, imageRef.height);
+                        if (!histograms.empty())
+                            histograms[i].addZeros(results[i].pixelCount);
+                        continue;
+                    }
+                    load.image = loadImageToLuminance(candidates[i], &widths[i], &heights[i], roi, nullptr, &load.nonFinite);
+                }
+
+                LuminanceBuffer & image = load.image;
+                int width = widths[i], height = heights[i];
+                if (image.empty() || width != imageRef.width || height != imageRef.height)
+                {
+                    std::cerr << "Image" << i + 1 << ": " << candidates[i] << " could not be compared against the reference." << std::endl;
+                    recycleBuffer(std::move(image));
+                    continue;
+                }
+                if (load.nonFinite && nanPolicy() == NanPolicy::Fail)
+                {
+                    std::cerr << "Image" << i + 1 << ": " << candidates[i] << " has " << load.nonFinite << " NaN/Inf pixels, not compared." << std::endl;
+                    results[i].nonFinite = load.nonFinite;
+                    recycleBuffer(std::move(image));
+                    continue;
+                }
+                size_t masked = nanPolicy() == NanPolicy::Mask ?
+                    maskPixels(image.data(), imageRef.data, 0, image.size(), imageRef.masked.get(), load.nonFinite > 0) : 0;
+
+                if (pyramid && compareLevels(i, image, imageRef, ref, roi, options, &results[i], options.metrics.any() ? &quality[i] : nullptr))
+                {
+                    results[i].nonFinite = load.nonFinite;
+                    recycleBuffer(std::move(image));
+                    continue;
+                }
+
+                /* Diff image and tile statistics are written by the metric pass itself. */
+                FIBITMAP* diffBitmap = options.diffImage ? allocateDiffBitmap(width, height, options.diffFormat) : nullptr;
+                if (options.diffImage && !diffBitmap)
+                    std::cerr << "Failed to allocate diff image: " << diffFilename(i) << std::endl;
+                TileMetrics tiles;
+                if (options.tileSize > 0)
+                    tiles.reset(width, height, options.tileSize);
+                {
+                    Profiler::Stage stage("metrics", candidates[i]);
+                    bool identical = !diffBitmap && options.tileSize <= 0 && !load.nonFinite && !imageRef.nonFinite &&
+                                     identicalPixels(image.data(), imageRef.data, width, height, candidates[i]);
+                    results[i] = identical ? identicalMetrics(width, height) :
+                                             metricPass(image, load.nonFinite, imageRef, diffBitmap, options.tileSize > 0 ? &tiles : nullptr,
+                                                        histograms.empty() ? nullptr : &histograms[i]);
+                    results[i].pixelCount -= masked;
+                    if (!histograms.empty() && identical)
+                        histograms[i].addZeros(results[i].pixelCount);
+                    else if (!histograms.empty())
+                        histograms[i].removeZeros(masked);
+                    results[i].nonFinite = load.nonFinite;
+                    stage.set("pixels", static_cast<long long>(width) * height);
+                }
+                if (!results[i].pixelCount)
+                {
+                    std::cerr << "Image" << i + 1 << ": " << candidates[i] << " has no pixels left after masking NaN/Inf pixels, not compared." << std::endl;
+                    if (diffBitmap)
+                        recycleBitmap(diffBitmap);
+                    recycleBuffer(std::move(image));
+                    continue;
+                }
+                if (options.metrics.any())
+                {
+                    Profiler::Stage stage("quality", candidates[i]);
+                    quality[i] = ImageMetrics::compute(image.data(), imageRef.data, width, height, results[i].sumSquaredError / results[i].pixelCount, options.metrics, *pool());
+                    stage.set("pixels", static_cast<long long>(width) * height);
+                }
+                recycleBuffer(std::move(image));
+                if (load.hashed && !cache.store(resultKey(load.hash, refHash, options), cacheValues(results[i], options.metrics.any() ? &quality[i] : nullptr)))
+                    std::cerr << "Failed to store result of " << candidates[i] << " in the result cache." << std::endl;
+
+                if (diffBitmap)
+                    saves.emplace_back(diffFilename(i), writer().save(diffBitmap, diffFilename(i), FIF_EXR, diffSaveFlags(options.diffFormat, options.diffSaveFlags), recycleBitmap));
+                if (options.tileSize > 0 && !saveTileMetrics(tiles, tileFilename(i)))
+                    std::cerr << "Failed to save tile statistics: " << tileFilename(i) << std::endl;
+            }
+
+            waitForSaves(&saves);
+            std::vector<double> rmses = reportResults(results, options.diffImage);
+            reportQualityResults(quality, options.metrics);
+            reportHistograms(histograms, options);
+            return rmses;
+        }
+
+        /**
+         * @brief Streaming variant of computeRMSE: matching scanlines of all inputs are
+         *        converted and compared in lockstep and dropped right away, so luminance
+         *        memory is O(width) per image and thread instead of O(width * height).
+         *        The decoded FreeImage bitmaps themselves are still whole images.
+         *        Output is identical to computeRMSE.
+         */
+        static std::vector<double> computeRMSEStreaming(const std::vector<std::string> & candidates, const std::string & ref, bool diffImage)
+        {
+            RunOptions options;
+            options.diffImage = diffImage;
+            return computeRMSEStreaming(candidates, ref, options);
+        }
+
+        /**
+         * @brief computeRMSEStreaming() with a region of interest and diff/tile/channel outputs.
+         *        Channel errors come from the same scanline reads as the luminance.
+         */
+        static std::vector<double> computeRMSEStreaming(const std::vector<std::string> & candidates, const std::string & ref, const RunOptions & options = RunOptions())
+        {
+            if (options.metrics.any())
+                std::cerr << "Quality metrics need whole luminance images and are not computed by the streaming sweep." << std::endl;
+
+            std::vector<ErrorMetrics> results(candidates.size());
+            const Region & roi = options.roi;
+
+            std::vector<std::future<FIBITMAP *>> loads;
+            loads.push_back(pool()->submit([&ref] { return loadBitmap(ref); }));
+            for (const auto & candidate : candidates)
+                loads.push_back(pool()->submit([&candidate] { return loadBitmap(candidate); }));
+
+            std::vector<FIBITMAP *> bitmaps;
+            for (auto & load : loads)
+                bitmaps.push_back(load.get());
+
+            FIBITMAP *refBitmap = bitmaps[0];
+            if (!refBitmap || !isLuminanceConvertible(refBitmap))
+            {
+                std::cerr << "Failed to load reference image: " << ref << std::endl;
+                for (FIBITMAP *bitmap : bitmaps)
+                    FreeImage_Unload(bitmap);
+                return reportResults(results, false);
+            }
+
+            Region crop;
+            if (!resolveRegion(roi, FreeImage_GetWidth(refBitmap), FreeImage_GetHeight(refBitmap), &crop))
+            {
+                std::cerr << "Region of interest is outside of the reference image: " << ref << std::endl;
+                for (FIBITMAP *bitmap : bitmaps)
+                    FreeImage_Unload(bitmap);
+                return reportResults(results, false);
+            }
+            int width = crop.width;
+            int height = crop.height;
+            const int imageWidth = FreeImage_GetWidth(refBitmap);
+            const int imageHeight = FreeImage_GetHeight(refBitmap);
+
+            // Candidates taking part in the sweep, with their diff bitmaps.
+            std::vector<size_t> active;
+            std::vector<FIBITMAP *> diffBitmaps(candidates.size(), nullptr);
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                FIBITMAP *bitmap = bitmaps[i + 1];
+                if (!bitmap || !isLuminanceConvertible(bitmap) ||
+                    static_cast<int>(FreeImage_GetWidth(bitmap)) != imageWidth || static_cast<int>(FreeImage_GetHeight(bitmap)) != imageHeight)
+                {
+                    std::cerr << "Image" << i + 1 << ": " << candidates[i] << " could not be compared against the reference." << std::endl;
+                    continue;
+                }
+                active.push_back(i);
+                if (options.diffImage && !(diffBitmaps[i] = allocateDiffBitmap(width, height, options.diffFormat)))
+                    std::cerr << "Failed to allocate diff image: " << diffFilename(i) << std::endl;
+            }
+
+            const int channels = std::min(std::max(options.channels, 0), 4);
+            std::vector<std::vector<RowResult>> rows(candidates.size());
+            std::vector<std::vector<SpanError>> channelRows(candidates.size());
+            std::vector<int> channelStrides(candidates.size(), channels);
+            std::vector<TileMetrics> tiles(candidates.size());
+            std::vector<ErrorHistogram> histograms(options.histogram() ? candidates.size() : 0, ErrorHistogram(histogramThreshold(options)));
+            std::mutex histogramMutex;
+            // NaN/Inf pixels and pixels masked out per row, see NanPolicy.
+            std::vector<size_t> refNonFiniteRows(height);
+            std::vector<std::vector<size_t>> nonFiniteRows(candidates.size()), maskedRows(candidates.size());
+            const bool mask = nanPolicy() == NanPolicy::Mask;
+            for (size_t i : active)
+            {
+                rows[i].resize(height);
+                nonFiniteRows[i].resize(height);
+                maskedRows[i].resize(height);
+                channelRows[i].resize(static_cast<size_t>(height) * channels);
+                // RGB of two RGBA images is cheaper to take from all four channels in place.
+                if (channels == 3 && channelCount(refBitmap) == 4 && channelCount(bitmaps[i + 1]) == 4)
+                    channelStrides[i] = 4;
+                if (options.tileSize > 0)
+                    tiles[i].reset(width, height, options.tileSize);
+            }
+
+            Profiler::Stage stage("sweep", ref);
+            stage.set("pixels", static_cast<long long>(width) * height * (active.size() + 1));
+            pool()->parallelFor(height, metricGrain(width, options.tileSize), [&](int begin, int end)
+            {
+                LuminanceBuffer refRow(width), row(width);
+                std::vector<float> refExpanded, refPacked, expanded, packed;
+                std::vector<size_t> refMasked, rowMasked;
+                std::vector<float> maskedChannels, refMaskedChannels;
+                SpanError channelErrors[4];
+                // Each chunk fills its own histograms, merged once at the end of the chunk.
+                std::vector<ErrorHistogram> partial(histograms.size(), ErrorHistogram(histogramThreshold(options)));
+                for (auto y = begin; y < end; ++y)
+                {
+                    refNonFiniteRows[y] = convertScanline(refBitmap, crop.y + y, crop.x, width, refRow.data());
+                    refMasked.clear();
+                    if (mask && refNonFiniteRows[y])
+                    {
+                        for (auto x = 0; x < width; ++x)
+                        {
+                            if (!std::isfinite(refRow[x]))
+                            {
+                                refRow[x] = 0.f;
+                                refMasked.push_back(x);
+                            }
+                        }
+                    }
+                    for (size_t i : active)
+                    {
+                        nonFiniteRows[i][y] = convertScanline(bitmaps[i + 1], crop.y + y, crop.x, width, row.data());
+                        if (mask && channels)
+                        {
+                            rowMasked = refMasked;
+                            if (nonFiniteRows[i][y])
+                                for (auto x = 0; x < width; ++x)
+                                    if (!std::isfinite(row[x]))
+                                        rowMasked.push_back(x);
+                        }
+                        if (mask)
+                            maskedRows[i][y] = maskPixels(row.data(), refRow.data(), 0, width, &refMasked, nonFiniteRows[i][y] > 0);
+                        rows[i][y] = rowMetrics(row.data(), refRow.data(), width, height, y, diffBitmaps[i], partial.empty() ? nullptr : &partial[i]);
+                        if (options.tileSize > 0)
+                            tileRowMetrics(row.data(), refRow.data(), y, &tiles[i]);
+                        if (channels)
+                        {
+                            int stride = channelStrides[i];
+                            const float *data = channelScanline(bitmaps[i + 1], crop.y + y, crop.x, width, stride, &expanded, &packed);
+                            const float *refData = channelScanline(refBitmap, crop.y + y, crop.x, width, stride, &refExpanded, &refPacked);
+                            if (mask && !rowMasked.empty())
+                            {
+                                // Masked pixels compare equal in every channel too.
+                                maskedChannels.assign(data, data + static_cast<size_t>(width) * stride);
+                                refMaskedChannels.assign(refData, refData + static_cast<size_t>(width) * stride);
+                                for (size_t x : rowMasked)
+                                {
+                                    std::fill_n(&maskedChannels[x * stride], stride, 0.f);
+                                    std::fill_n(&refMaskedChannels[x * stride], stride, 0.f);
+                                }
+                                data = maskedChannels.data();
+                                refData = refMaskedChannels.data();
+                            }
+                            SimdKernels::interleavedError(data, refData, width, stride, channelErrors);
+                            std::copy(channelErrors, channelErrors + channels, &channelRows[i][static_cast<size_t>(y) * channels]);
+                        }
+                    }
+                }
+                if (!partial.empty())
+                {
+                    std::lock_guard<std::mutex> lock(histogramMutex);
+                    for (size_t i : active)
+                        histograms[i].merge(partial[i]);
+                }
+            });
+
+            // All diff images are encoded in parallel while the inputs are released.
+            std::vector<std::pair<std::string, std::future<bool>>> saves;
+            std::vector<ChannelMetrics> channelResults(channels ? candidates.size() : 0);
+            size_t refNonFinite = 0;
+            for (size_t count : refNonFiniteRows)
+                refNonFinite += count;
+            if (refNonFinite)
+                warnReference(ref, refNonFinite);
+            if (refNonFinite && nanPolicy() == NanPolicy::Fail)
+                std::cerr << "Failed to load reference image: " << ref << std::endl;
+            for (size_t i : active)
+            {
+                size_t nonFinite = 0, masked = 0;
+                for (auto y = 0; y < height; ++y)
+                {
+                    nonFinite += nonFiniteRows[i][y];
+                    masked += maskedRows[i][y];
+                }
+                if (nanPolicy() == NanPolicy::Fail && (nonFinite || refNonFinite))
+                {
+                    if (!refNonFinite)
+                        std::cerr << "Image" << i + 1 << ": " << candidates[i] << " has " << nonFinite << " NaN/Inf pixels, not compared." << std::endl;
+                    results[i].nonFinite = nonFinite;
+                    if (diffBitmaps[i])
+                        recycleBitmap(diffBitmaps[i]);
+                    continue;
+                }
+
+                results[i] = reduceRows(rows[i], static_cast<size_t>(width) * height - masked);
+                results[i].nonFinite = nonFinite;
+                if (!results[i].pixelCount)
+                {
+                    std::cerr << "Image" << i + 1 << ": " << candidates[i] << " has no pixels left after masking NaN/Inf pixels, not compared." << std::endl;
+                    if (diffBitmaps[i])
+                        recycleBitmap(diffBitmaps[i]);
+                    continue;
+                }
+                if (!histograms.empty())
+                    histograms[i].removeZeros(masked);
+                if (channels)
+                    channelResults[i] = reduceChannelRows(channelRows[i], channels, results[i].pixelCount);
+                if (diffBitmaps[i])
+                    saves.emplace_back(diffFilename(i), writer().save(diffBitmaps[i], diffFilename(i), FIF_EXR, diffSaveFlags(options.diffFormat, options.diffSaveFlags), recycleBitmap));
+                if (options.tileSize > 0 && !saveTileMetrics(tiles[i], tileFilename(i)))
+                    std::cerr << "Failed to save tile statistics: " << tileFilename(i) << std::endl;
+            }
+
+            for (FIBITMAP *bitmap : bitmaps)
+                FreeImage_Unload(bitmap);
+            waitForSaves(&saves);
+
+            std::vector<double> rmses = reportResults(results, options.diffImage);
+            reportChannelResults(channelResults);
+            reportHistograms(histograms, options);
+            return rmses;
+        }
+
+        /**
+         * @brief Compare frames [first, last] of a candidate sequence against a reference
+         *        sequence, see FrameSequence for the patterns, and output per-frame and
+         *        aggregate RMSE. While frame N is compared, both images of frame N+1 are
+         *        decoded and the diff image of frame N-1 (diff.NNNN.exr) is written, so
+         *        each frame costs roughly its slowest stage. Frames of a reference pattern
+         *        without a placeholder share one cached reference, others aren't cached.
+         * @return RMSE per frame, NaN if the frame could not be compared.
+         */
+        static std::vector<double> computeSequence(const std::string & candidatePattern, const std::string & refPattern, int first, int last,
+                                                   const RunOptions & options = RunOptions())
+        {
+            if (options.tileSize > 0 || options.channels > 0 || options.histogram() || options.mipLevels > 0 || options.approximateLevel > 0)
+                std::cerr << "Tile, channel, histogram and mip statistics are not computed for sequences." << std::endl;
+
+            struct DecodedFrame
+            {
+                LuminanceBuffer image;
+                int width = 0;
+                int height = 0;
+                size_t nonFinite = 0;
+            };
+            struct PendingFrame
+            {
+                std::future<DecodedFrame> candidate;
+                std::future<LuminanceView> reference;
+            };
+            const Region roi = options.roi;
+            const bool sharedReference = !FrameSequence::hasPlaceholder(refPattern);
+            auto decodeFrame = [&](int frame)
+            {
+                PendingFrame pending;
+                std::string candidate = FrameSequence::path(candidatePattern, frame);
+                std::string ref = FrameSequence::path(refPattern, frame);
+                pending.reference = pool()->submit([ref, roi, sharedReference]
+                {
+                    return sharedReference ? loadReference(ref, roi) : decodeReference(ref, roi);
+                });
+                pending.candidate = pool()->submit([candidate, roi]
+                {
+                    DecodedFrame decoded;
+                    decoded.image = loadImageToLuminance(candidate, &decoded.width, &decoded.height, roi, nullptr, &decoded.nonFinite);
+                    return decoded;
+                });
+                return pending;
+            };
+
+            CompareOptions compareOptions;
+            compareOptions.diffSaveFlags = options.diffSaveFlags;
+            compareOptions.diffFormat = options.diffFormat;
+            compareOptions.metrics = options.metrics;
+            compareOptions.roi = roi;
+
+            std::vector<double> rmses;
+            std::vector<std::pair<std::string, std::future<bool>>> saves;
+            DoubleAccumulator sumSquaredError;
+            size_t pixelCount = 0, compared = 0;
+            double maxRMSE = -1.0;
+            int maxFrame = -1;
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+
+            PendingFrame next = decodeFrame(first);
+            for (int frame = first; frame <= last; ++frame)
+            {
+                PendingFrame current = std::move(next);
+                if (frame < last)
+                    next = decodeFrame(frame + 1);
+
+                std::string candidate = FrameSequence::path(candidatePattern, frame);
+                LuminanceView imageRef = current.reference.get();
+                DecodedFrame decoded = current.candidate.get();
+                ComparisonResult result;
+                if (!imageRef)
+                {
+                    result.error = "failed to load reference " + FrameSequence::path(refPattern, frame);
+                    recycleBuffer(std::move(decoded.image));
+                }
+                else if (decoded.image.empty())
+                    result.error = "failed to load candidate " + candidate;
+                else
+                {
+                    compareOptions.diffFilename = options.diffImage ? FrameSequence::path("diff.%04d.exr", frame) : std::string();
+                    result = compareLuminance(candidate, std::move(decoded.image), decoded.width, decoded.height, decoded.nonFinite, imageRef, compareOptions, &saves);
+                }
+
+                const ErrorMetrics & metrics = result.metrics;
+                double rmse = result.ok && metrics.pixelCount ? metrics.rmse() : std::numeric_limits<double>::quiet_NaN();
+                rmses.push_back(rmse);
+                if (!result.ok)
+                    std::cerr << "Frame " << frame << ": " << result.error << std::endl;
+                std::cout << "Frame " << frame << " RMSE: " << rmse << std::endl;
+                if (metrics.nonFinite)
+                    std::cout << "Frame " << frame << " NaN/Inf pixels: " << metrics.nonFinite << std::endl;
+                if (result.ok && options.diffImage)
+                    std::cout << "Frame " << frame << " maxDiff at: " << metrics.maxDiffIndex << " value: " << metrics.maxDiff << std::endl;
+                if (result.ok && options.metrics.psnr)
+                    std::cout << "Frame " << frame << " PSNR: " << result.quality.psnr << std::endl;
+                if (result.ok && options.metrics.relMSE)
+                    std::cout << "Frame " << frame << " relMSE: " << result.quality.relMSE << std::endl;
+                if (result.ok && options.metrics.ssim)
+                    std::cout << "Frame " << frame << " SSIM: " << result.quality.ssim << std::endl;
+
+                if (result.ok && metrics.pixelCount)
+                {
+                    ++compared;
+                    sumSquaredError.add(metrics.sumSquaredError);
+                    pixelCount += metrics.pixelCount;
+                    if (rmse > maxRMSE)
+                    {
+                        maxRMSE = rmse;
+                        maxFrame = frame;
+                    }
+                }
+            }
+            waitForSaves(&saves);
+
+            // Pooled over all pixels, so every pixel weighs the same whatever its frame.
+            std::cout << "Sequence frames compared: " << compared << " of " << rmses.size() << std::endl;
+            std::cout << "Sequence RMSE: " << (pixelCount ? std::sqrt(sumSquaredError.result() / pixelCount) : std::numeric_limits<double>::quiet_NaN()) << std::endl;
+            std::cout << "Sequence max frame RMSE: " << (compared ? maxRMSE : std::numeric_limits<double>::quiet_NaN()) << " at frame: " << maxFrame << std::endl;
+            return rmses;
+        }
+
+        /**
+         * @brief Pass/fail comparison of N candidates against an RMSE tolerance, output directly.
+         *        Candidate rows are converted and compared in bands from top to bottom, and a
+         *        candidate stops as soon as its outcome is certain: the squared error already
+         *        exceeds the budget, or (with options.valueRange) even the largest possible
+         *        error on the remaining pixels keeps it within the budget.
+         */
+        static std::vector<ThresholdResult> computeRMSEThreshold(const std::vector<std::string> & candidates, const std::string & ref, const ThresholdOptions & options)
+        {
+            std::vector<ThresholdResult> results(candidates.size());
+
+            // The next candidate is decoded while the current one is being compared.
+            auto openCandidate = [&](size_t i)
+            {
+                return pool()->submit([&candidates, i]
+                {
+                    auto source = std::make_shared<LuminanceSource>();
+                    if (!source->open(candidates[i]))
+                        source.reset();
+                    return source;
+                });
+            };
+
+            auto refFuture = pool()->submit([&ref, &options] { return loadReference(ref, options.roi); });
+            std::future<std::shared_ptr<LuminanceSource>> next;
+            if (!candidates.empty())
+                next = openCandidate(0);
+
+            LuminanceView imageRef = refFuture.get();
+            if (!imageRef)
+            {
+                if (next.valid())
+                    next.wait();
+                std::cerr << "Failed to load reference image: " << ref << std::endl;
+                for (auto & result : results)
+                    result.error = "failed to load reference " + ref;
+                return reportThresholdResults(results, options);
+            }
+
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                auto source = next.get();
+                if (i + 1 < candidates.size())
+                    next = openCandidate(i + 1);
+
+                if (!source)
+                {
+                    results[i].error = "failed to load candidate " + candidates[i];
+                    continue;
+                }
+                Profiler::Stage stage("threshold", candidates[i]);
+                results[i] = thresholdMetrics(*source, imageRef, options);
+                stage.set("pixels", static_cast<long long>(results[i].pixelsCompared));
+            }
+
+            return reportThresholdResults(results, options);
+        }
+
+        /**
+         * @brief Compare one candidate against a (cached) reference without printing,
+         *        messages of the loaders end up in the result's warnings.
+         */
+        static ComparisonResult compare(const std::string & candidate, const std::string & ref, const CompareOptions & options = CompareOptions())
+        {
+            return withDiagnostics([&]
+            {
+                ComparisonResult result;
+
+                LuminanceView imageRef = loadReference(ref, options.roi);
+                if (!imageRef)
+                {
+                    result.error = "failed to load reference " + ref;
+                    return result;
+                }
+                if (options.diffFilename.empty() && options.tileFilename.empty() && !options.metrics.any() && !imageRef.nonFinite &&
+                    identicalFiles(candidate, ref))
+                {
+                    result.metrics = identicalMetrics(imageRef.width, imageRef.height);
+                    result.ok = true;
+                    return result;
+                }
+
+                int width, height;
+                size_t nonFinite = 0;
+                auto image = loadImageToLuminance(candidate, &width, &height, options.roi, nullptr, &nonFinite);
+                if (image.empty())
+                {
+                    result.error = "failed to load candidate " + candidate;
+                    return result;
+                }
+                return compareLuminance(candidate, std::move(image), width, height, nonFinite, imageRef, options);
+            });
+        }
+
+        /**
+         * @brief Compare in-memory images, e.g. a live framebuffer against a golden image,
+         *        without any file I/O. Both buffers are only read during the call.
+         */
+        static ComparisonResult compare(const ImageBuffer & candidate, const ImageBuffer & ref, const CompareOptions & options = CompareOptions())
+        {
+            return withDiagnostics([&]
+            {
+                LuminanceSource source, refSource;
+                if (!refSource.open(ref))
+                {
+                    ComparisonResult result;
+                    result.error = "invalid reference buffer";
+                    return result;
+                }
+                if (!source.open(candidate))
+                {
+                    ComparisonResult result;
+                    result.error = "invalid candidate buffer";
+                    return result;
+                }
+                return compareSources(source, refSource, options);
+            });
+        }
+
+        /**
+         * @brief Compare decoded FreeImage bitmaps (see isLuminanceConvertible()), which
+         *        stay owned by the caller.
+         */
+        static ComparisonResult compare(FIBITMAP *candidate, FIBITMAP *ref, const CompareOptions & options = CompareOptions())
+        {
+            return withDiagnostics([&]
+            {
+                LuminanceSource source, refSource;
+                if (!refSource.open(ref))
+                {
+                    ComparisonResult result;
+                    result.error = "reference bitmap has no luminance conversion";
+                    return result;
+                }
+                if (!source.open(candidate))
+                {
+                    ComparisonResult result;
+                    result.error = "candidate bitmap has no luminance conversion";
+                    return result;
+                }
+                return compareSources(source, refSource, options);
+            });
+        }
+
+        /**
+         * @brief Run every comparison of a manifest on the thread pool, keeping at most
+         *        two comparisons per thread in flight. One JSON object per comparison is
+         *        written to out in completion order, "index" refers to the manifest order.
+         * @return Number of failed comparisons.
+         */
+        static size_t runManifest(const std::vector<ManifestEntry> & entries, std::ostream & out)
+        {
+            std::vector<size_t> indices(entries.size());
+            for (size_t i = 0; i < indices.size(); ++i)
+                indices[i] = i;
+            return runManifest(entries, indices, out);
+        }
+
+        /**
+         * @brief Run the comparisons indices of a manifest, e.g. one shard of it (see
+         *        Manifest::shard()). "index" of the results still refers to the manifest order.
+         */
+        static size_t runManifest(const std::vector<ManifestEntry> & entries, const std::vector<size_t> & indices, std::ostream & out)
+        {
+            std::mutex mutex;
+            std::condition_variable slotFree;
+            size_t inFlight = 0, failures = 0;
+            const size_t maxInFlight = 2 * pool()->threadCount();
+
+            for (size_t i : indices)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    slotFree.wait(lock, [&] { return inFlight < maxInFlight; });
+                    ++inFlight;
+                }
+
+                pool()->submit([&, i]
+                {
+                    const ManifestEntry & entry = entries[i];
+                    ComparisonResult result = compareEntry(entry);
+                    std::string line = formatResult(i, entry, result);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    out << line << std::endl;
+                    if (!result.ok)
+                        ++failures;
+                    --inFlight;
+                    slotFree.notify_all();
+                });
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFree.wait(lock, [&] { return inFlight == 0; });
+            return failures;
+        }
+
+        /**
+         * @brief Run one manifest comparison, with its per-comparison options applied.
+         */
+        static ComparisonResult compareEntry(const ManifestEntry & entry)
+        {
+            CompareOptions options;
+            auto diff = entry.options.find("diff");
+            if (diff != entry.options.end())
+                options.diffFilename = diff->second;
+            auto compression = entry.options.find("exrCompression");
+            auto format = entry.options.find("diffFormat");
+            auto tiles = entry.options.find("tiles");
+            if (tiles != entry.options.end())
+                options.tileFilename = tiles->second;
+            auto tileSize = entry.options.find("tileSize");
+            if (tileSize != entry.options.end())
+                options.tileSize = std::atoi(tileSize->second.c_str());
+            auto metrics = entry.options.find("metrics");
+            auto peak = entry.options.find("peak");
+            if (peak != entry.options.end())
+                options.metrics.peak = std::atof(peak->second.c_str());
+
+            ComparisonResult result;
+            auto roi = entry.options.find("roi");
+            if (roi != entry.options.end() && !parseRegion(roi->second, &options.roi))
+                result.error = "invalid roi " + roi->second;
+            else if (compression != entry.options.end() && !parseExrCompression(compression->second, &options.diffSaveFlags))
+                result.error = "unknown exrCompression " + compression->second;
+            else if (format != entry.options.end() && !parseDiffFormat(format->second, &options.diffFormat))
+                result.error = "unknown diffFormat " + format->second;
+            else if (metrics != entry.options.end() && !ImageMetrics::parseSelection(metrics->second, &options.metrics))
+                result.error = "unknown metrics " + metrics->second;
+            else
+                result = compare(entry.candidate, entry.reference, options);
+            return result;
+        }
+
+        /**
+         * @brief JSON result line of a manifest comparison, as written by runManifest().
+         */
+        static std::string formatResult(size_t index, const ManifestEntry & entry, const ComparisonResult & result)
+        {
+            std::ostringstream line;
+            line.precision(std::numeric_limits<double>::max_digits10);
+            line << "{\"index\":" << index
+                 << ",\"candidate\":" << Json::quote(entry.candidate)
+                 << ",\"reference\":" << Json::quote(entry.reference);
+            if (result.ok)
+            {
+                const ErrorMetrics & metrics = result.metrics;
+                line << ",\"status\":\"ok\""
+                     << ",\"rmse\":" << Json::number(metrics.rmse())
+                     << ",\"maxDiff\":" << Json::number(metrics.maxDiff)
+                     << ",\"maxDiffIndex\":" << metrics.maxDiffIndex
+                     << ",\"pixels\":" << metrics.pixelCount
+                     << ",\"nonFinite\":" << metrics.nonFinite;
+                const QualityMetrics & quality = result.quality;
+                if (quality.computed.psnr)
+                    line << ",\"psnr\":" << Json::number(quality.psnr);
+                if (quality.computed.relMSE)
+                    line << ",\"relMSE\":" << Json::number(quality.relMSE);
+                if (quality.computed.ssim)
+                    line << ",\"ssim\":" << Json::number(quality.ssim);
+            }
+            else
+            {
+                line << ",\"status\":\"error\",\"error\":" << Json::quote(result.error);
+            }
+            if (!result.warnings.empty())
+            {
+                std::string warnings;
+                for (const std::string & warning : result.warnings)
+                    warnings += (warnings.empty() ? "" : "; ") + warning;
+                line << ",\"warnings\":" << Json::quote(warnings);
+            }
+            line << "}";
+            return line.str();
+        }
+
+        /**
+         * @brief Convert an image into the raw (.iuraw) format that references
+         *        can be mapped from without decoding.
+         * @param rgb Store RGB instead of luminance; luminance is then computed on load.
+         * @param half Store half floats, half the size and bandwidth of float32.
+         */
+        static bool convertToRaw(const std::string & input, const std::string & output, bool rgb = false, bool half = false)
+        {
+            FIBITMAP *bitmap = loadBitmap(input);
+            if (!bitmap)
+                return false;
+            if (!isLuminanceConvertible(bitmap))
+            {
+                report("Type of the image has no luminance conversion, not supported yet...");
+                FreeImage_Unload(bitmap);
+                return false;
+            }
+
+            int width = FreeImage_GetWidth(bitmap);
+            int height = FreeImage_GetHeight(bitmap);
+            int channels = rgb ? 3 : 1;
+            std::vector<float> samples(static_cast<size_t>(width) * height * channels);
+
+            pool()->parallelFor(height, rowGrain(width), [&](int begin, int end)
+            {
+                std::vector<float> expanded, packed;
+                for (auto y = begin; y < end; ++y)
+                {
+                    float *dst = &samples[static_cast<size_t>(width) * y * channels];
+                    if (!rgb)
+                    {
+                        convertScanline(bitmap, y, dst);
+                        continue;
+                    }
+                    const float *bits = channelScanline(bitmap, y, 0, width, 3, &expanded, &packed);
+                    std::copy(bits, bits + static_cast<size_t>(width) * 3, dst);
+                }
+            });
+            FreeImage_Unload(bitmap);
+
+            bool written;
+            if (half)
+            {
+                std::vector<uint16_t> halves(samples.size());
+                pool()->parallelFor(height, rowGrain(width * channels), [&](int begin, int end)
+                {
+                    for (size_t i = static_cast<size_t>(width) * channels * begin; i < static_cast<size_t>(width) * channels * end; ++i)
+                        halves[i] = SimdKernels::floatToHalf(samples[i]);
+                });
+                written = RawImage::write(output, halves.data(), width, height, channels);
+            }
+            else
+                written = RawImage::write(output, samples.data(), width, height, channels);
+            if (!written)
+            {
+                std::cerr << "Failed to write raw image: " << output << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Drop all decoded references and content hashes kept by computeRMSE().
+         */
+        static void clearReferenceCache()
+        {
+            {
+                std::lock_guard<std::mutex> lock(referenceCacheMutex());
+                referenceCache().clear();
+            }
+            std::lock_guard<std::mutex> lock(hashCacheMutex());
+            hashCache().clear();
+        }
+
+        /**
+         * @brief Parse an EXR compression name into FreeImage save flags: piz (the default),
+         *        zip, none, or the lossy pxr24 and b44. Fast ones pay off on throughput-bound runs.
+         * @return False for an unknown name.
+         */
+        static bool parseExrCompression(const std::string & name, int *flags)
+        {
+            static const std::pair<const char *, int> compressions[] = {
+                { "piz", EXR_DEFAULT }, { "zip", EXR_ZIP }, { "none", EXR_NONE }, { "pxr24", EXR_PXR24 }, { "b44", EXR_B44 }
+            };
+            for (const auto & compression : compressions)
+            {
+                if (name == compression.first)
+                {
+                    *flags = compression.second;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief Parse a diff format name: rgba, float or half.
+         * @return False for an unknown name.
+         */
+        static bool parseDiffFormat(const std::string & name, DiffFormat *format)
+        {
+            if (name == "rgba")
+                *format = DiffFormat::RGBA;
+            else if (name == "float")
+                *format = DiffFormat::Float;
+            else if (name == "half")
+                *format = DiffFormat::Half;
+            else
+                return false;
+            return true;
+        }
+
+        /**
+         * @brief Parse a NaN/Inf policy name: count, clamp, mask or fail.
+         * @return False for an unknown name.
+         */
+        static bool parseNanPolicy(const std::string & name, NanPolicy *policy)
+        {
+            for (NanPolicy candidate : { NanPolicy::Count, NanPolicy::Clamp, NanPolicy::Mask, NanPolicy::Fail })
+            {
+                if (name == nanPolicyName(candidate))
+                {
+                    *policy = candidate;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static const char * nanPolicyName(NanPolicy policy)
+        {
+            switch (policy)
+            {
+            case NanPolicy::Clamp: return "clamp";
+            case NanPolicy::Mask:  return "mask";
+            case NanPolicy::Fail:  return "fail";
+            default:               return "count";
+            }
+        }
+
+        /**
+         * @brief Run the metric passes of whole images on the CUDA device (IMAGEUTIL_WITH_CUDA
+         *        builds), see GpuMetrics. The CPU takes over if there is no device, a device
+         *        call fails, or the pass needs an error histogram or NaN/Inf handling.
+         */
+        static void setGpuEnabled(bool enabled)
+        {
+#ifndef IMAGEUTIL_WITH_CUDA
+            if (enabled)
+                std::cerr << "Built without IMAGEUTIL_WITH_CUDA, metric passes run on the CPU." << std::endl;
+#endif
+            gpuEnabled() = enabled;
+        }
+
+        /**
+         * @brief Set how NaN/Inf luminance pixels are handled by every comparison, count by default.
+         *        Comparisons already running when it changes may see either policy.
+         */
+        static void setNanPolicy(NanPolicy policy)
+        {
+            nanPolicyHolder().store(policy);
+        }
+
+        static NanPolicy nanPolicy()
+        {
+            return nanPolicyHolder();
+        }
+
+        /**
+         * @brief Parse a region given as "x,y,width,height".
+         * @return False on malformed text or an empty region.
+         */
+        static bool parseRegion(const std::string & text, Region *roi)
+        {
+            int values[4];
+            std::istringstream stream(text);
+            for (int i = 0; i < 4; ++i)
+            {
+                char separator = ',';
+                if ((i > 0 && !(stream >> separator)) || separator != ',' || !(stream >> values[i]))
+                    return false;
+            }
+            if (!(stream >> std::ws).eof())
+                return false;
+            Region parsed;
+            parsed.x = values[0];
+            parsed.y = values[1];
+            parsed.width = values[2];
+            parsed.height = values[3];
+            if (parsed.empty() || parsed.x < 0 || parsed.y < 0)
+                return false;
+            *roi = parsed;
+            return true;
+        }
+
+        /**
+         * @brief Bytes of released luminance buffers and of released diff bitmaps kept
+         *        for reuse by later comparisons of the same size (each, 1 GiB by default).
+         *        0 turns recycling off.
+         */
+        static void setPoolLimit(size_t bytes)
+        {
+            bufferPool().setLimit(bytes);
+            bitmapPool().setLimit(bytes);
+        }
+
+        /**
+         * @brief Memory budget of the decoded references kept across comparisons, 0 (the
+         *        default) for no limit. Least recently used references are dropped first.
+         */
+        static void setReferenceCacheLimit(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(referenceCacheMutex());
+            referenceCacheLimit() = bytes;
+            evictReferences(std::string());
+        }
+
+        /**
+         * @brief Number and memory of the decoded references currently cached.
+         */
+        static void referenceCacheUsage(size_t *entries, size_t *bytes)
+        {
+            std::lock_guard<std::mutex> lock(referenceCacheMutex());
+            *entries = 0;
+            *bytes = 0;
+            for (const auto & entry : referenceCache())
+            {
+                if (entry.second.bytes)
+                    ++*entries;
+                *bytes += entry.second.bytes;
+            }
+        }
+
+        /**
+         * @brief Set the number of threads used for decoding and metric loops (1 = serial).
+         *        Results are bit-identical for any thread count. Safe while comparisons
+         *        run, their loops already started finish on the previous pool.
+         */
+        static void setThreadCount(unsigned threads)
+        {
+            std::atomic_store(&poolHolder(), makePool(std::max(threads, 1u)));
+#ifdef IMAGEUTIL_WITH_OPENEXR
+            // Decodes running on the pool wait for OpenEXR's one global pool, so threads
+            // workers serve any number of concurrent decodes; 1 decodes on the caller.
+            ExrDecoder::setThreadCount(threads > 1 ? threads : 0);
+#endif
+        }
+
+        static unsigned threadCount()
+        {
+            return pool()->threadCount();
+        }
+
+        /**
+         * @brief Run compareEntry() on the thread pool, done gets the result on the worker.
+         */
+        static void compareAsync(const ManifestEntry & entry, std::function<void(const ComparisonResult &)> done)
+        {
+            pool()->submit([entry, done] { done(compareEntry(entry)); });
+        }
+
+        /**
+         * @brief For 32-bpc HDR/OpenEXR file only.
+         * @return NaN if either image fails to load or their sizes differ.
+         */
+        static double computeRMSE(const std::string & filename1, const std::string & filename2)
+        {
+            int width1 = 0, height1 = 0, width2 = 0, height2 = 0;
+            auto image1 = loadImageToLuminance(filename1, &width1, &height1);
+            auto image2 = loadImageToLuminance(filename2, &width2, &height2);
+            if (image1.empty() || image2.empty() || width1 != width2 || height1 != height2)
+                return std::numeric_limits<double>::quiet_NaN();
+
+            return rmse(image1, image2);
+        }
+
+    private:
+        /**
+         * @brief Decoded reference, valid as long as the file keeps its mtime and size.
+         *        Concurrent requests for a reference being decoded wait for that decode.
+         */
+        struct CachedReference
+        {
+            long long mtime = 0;
+            long long size = 0;
+            std::shared_future<LuminanceView> loaded;
+            /* Memory held once loaded, 0 while the decode is pending. */
+            size_t bytes = 0;
+            /* Value of referenceClock() at the last lookup, for LRU eviction. */
+            unsigned long long lastUse = 0;
+            /* Mip levels 1.. of the reference, built on first use by referencePyramid(). */
+            std::shared_ptr<const std::vector<LuminanceView>> pyramid;
+        };
+
+        /**
+         * @brief Content hash of a file, valid as long as the file keeps its mtime and size.
+         */
+        struct CachedHash
+        {
+            long long mtime;
+            long long size;
+            uint64_t hash;
+        };
+
+        /**
+         * @brief A candidate decoded to luminance, or its stored result on a result cache hit.
+         */
+        struct CandidateLoad
+        {
+            LuminanceBuffer image;
+            bool hashed = false;
+            uint64_t hash = 0;
+            bool cached = false;
+            ErrorMetrics metrics;
+            QualityMetrics quality;
+            size_t nonFinite = 0;
+            /* Same bytes as the reference file, not decoded. */
+            bool identical = false;
+        };
+
+        /**
+         * @brief Image whose rows are converted to luminance on demand: a decoded bitmap
+         *        (see isLuminanceConvertible()), a mapped float or half raw image, or a
+         *        caller-owned bitmap or pixel buffer.
+         */
+        class LuminanceSource
+        {
+        public:
+            LuminanceSource() = default;
+
+            ~LuminanceSource()
+            {
+                if (bitmap && ownsBitmap)
+                    FreeImage_Unload(bitmap);
+            }
+
+            LuminanceSource(const LuminanceSource &) = delete;
+            LuminanceSource & operator=(const LuminanceSource &) = delete;
+
+            /**
+             * @param encoded File contents if already read, see fileHash().
+             * @return False if the image can't be loaded or has no luminance conversion.
+             */
+            bool open(const std::string & filename, const std::vector<BYTE> *encoded = nullptr)
+            {
+                if (RawImage::isRawFilename(filename))
+                {
+                    Profiler::Stage stage("mapRaw", filename);
+                    RawImage::Header header;
+                    const void *samples = nullptr;
+                    mapping = RawImage::map(filename, &header, &samples);
+                    if (!mapping)
+                    {
+                        report("Invalid raw image: " + filename);
+                        return false;
+                    }
+                    stage.set("bytesMapped", static_cast<long long>(mapping->size()));
+                    imageWidth = static_cast<int>(header.width);
+                    imageHeight = static_cast<int>(header.height);
+                    const bool half = RawImage::isHalf(header);
+                    const PixelFormat format = header.channels == 1 ? (half ? PixelFormat::Gray16F : PixelFormat::Gray32F)
+                                                                    : (half ? PixelFormat::RGB16F : PixelFormat::RGB32F);
+                    buffer = ImageBuffer(samples, imageWidth, imageHeight, format);
+                    return true;
+                }
+
+                /* Load image using FreeImage. */
+                bitmap = loadBitmap(filename, encoded);
+                if (!bitmap)
+                    return false;
+                if (!isLuminanceConvertible(bitmap))
+                {
+                    report("Type of the image has no luminance conversion, not supported yet...");
+                    return false;
+                }
+                imageWidth = FreeImage_GetWidth(bitmap);
+                imageHeight = FreeImage_GetHeight(bitmap);
+                buffer = bitmapBuffer(bitmap);
+                return true;
+            }
+
+            /**
+             * @brief Use a bitmap owned by the caller.
+             * @return False if it has no luminance conversion.
+             */
+            bool open(FIBITMAP *image)
+            {
+                if (!image || !isLuminanceConvertible(image))
+                    return false;
+                bitmap = image;
+                ownsBitmap = false;
+                imageWidth = FreeImage_GetWidth(bitmap);
+                imageHeight = FreeImage_GetHeight(bitmap);
+                buffer = bitmapBuffer(bitmap);
+                return true;
+            }
+
+            /**
+             * @brief Use pixels owned by the caller, which must outlive the source.
+             * @return False for a null or inconsistent buffer.
+             */
+            bool open(const ImageBuffer & image)
+            {
+                if (!image.valid())
+                    return false;
+                buffer = image;
+                imageWidth = image.width;
+                imageHeight = image.height;
+                return true;
+            }
+
+            int width() const
+            {
+                return imageWidth;
+            }
+
+            int height() const
+            {
+                return imageHeight;
+            }
+
+            /**
+             * @brief Convert count pixels of row y (counted from the top) starting at column x.
+             * @return NaN/Inf pixels of the row, see validateRow().
+             */
+            size_t convertRow(int y, int x, int count, LuminanceType *dst) const
+            {
+                return convertBufferRow(buffer, y, x, count, dst);
+            }
+
+        private:
+            FIBITMAP *bitmap = nullptr;
+            bool ownsBitmap = true;
+            std::shared_ptr<const MappedFile> mapping;
+            /* Pixels of the bitmap, the mapping or the caller. */
+            ImageBuffer buffer;
+            int imageWidth = 0;
+            int imageHeight = 0;
+        };
+
+        /**
+         * @brief Convert both sources and compare them, the reference without the reference cache.
+         */
+        static ComparisonResult compareSources(const LuminanceSource & source, const LuminanceSource & refSource, const CompareOptions & options)
+        {
+            ComparisonResult result;
+            LuminanceView imageRef;
+            auto luminance = std::make_shared<LuminanceBuffer>(convertToLuminance(refSource, "reference", &imageRef.width, &imageRef.height, options.roi, &imageRef.nonFinite));
+            if (luminance->empty())
+            {
+                result.error = "failed to convert reference";
+                return result;
+            }
+            if (!finishReference(luminance, "reference", &imageRef))
+            {
+                result.error = std::to_string(imageRef.nonFinite) + " NaN/Inf pixels in reference";
+                return result;
+            }
+
+            int width, height;
+            size_t nonFinite = 0;
+            auto image = convertToLuminance(source, "candidate", &width, &height, options.roi, &nonFinite);
+            if (image.empty())
+            {
+                result.error = "failed to convert candidate";
+                return result;
+            }
+            return compareLuminance("candidate", std::move(image), width, height, nonFinite, imageRef, options);
+        }
+
+        /**
+         * @brief Metric pass of compare() on a converted candidate, which is recycled.
+         * @param saves If set, the diff image is saved in the background and its save is
+         *              added here for waitForSaves(), which reports a failure.
+         */
+        static ComparisonResult compareLuminance(const std::string & candidate, LuminanceBuffer && image, int width, int height, size_t nonFinite,
+                                                 const LuminanceView & imageRef, const CompareOptions & options,
+                                                 std::vector<std::pair<std::string, std::future<bool>>> *saves = nullptr)
+        {
+            ComparisonResult result;
+            if (width != imageRef.width || height != imageRef.height)
+            {
+                result.error = "size mismatch " + std::to_string(width) + "x" + std::to_string(height) +
+                               " vs reference " + std::to_string(imageRef.width) + "x" + std::to_string(imageRef.height);
+                recycleBuffer(std::move(image));
+                return result;
+            }
+            if (nonFinite && nanPolicy() == NanPolicy::Fail)
+            {
+                result.error = std::to_string(nonFinite) + " NaN/Inf pixels in candidate " + candidate;
+                result.metrics.nonFinite = nonFinite;
+                recycleBuffer(std::move(image));
+                return result;
+            }
+            size_t masked = nanPolicy() == NanPolicy::Mask ?
+                maskPixels(image.data(), imageRef.data, 0, image.size(), imageRef.masked.get(), nonFinite > 0) : 0;
+
+            FIBITMAP* diffBitmap = options.diffFilename.empty() ? nullptr : allocateDiffBitmap(width, height, options.diffFormat);
+            TileMetrics tiles;
+            bool tileStats = !options.tileFilename.empty() && options.tileSize > 0;
+            if (tileStats)
+                tiles.reset(width, height, options.tileSize);
+            {
+                Profiler::Stage stage("metrics", candidate);
+                bool identical = !diffBitmap && !tileStats && !nonFinite && !imageRef.nonFinite &&
+                                 identicalPixels(image.data(), imageRef.data, width, height, candidate);
+                result.metrics = identical ? identicalMetrics(width, height) : metricPass(image, nonFinite, imageRef, diffBitmap, tileStats ? &tiles : nullptr);
+                result.metrics.pixelCount -= masked;
+                result.metrics.nonFinite = nonFinite;
+                stage.set("pixels", static_cast<long long>(width) * height);
+            }
+            if (!result.metrics.pixelCount)
+            {
+                result.error = "no pixels left after masking NaN/Inf pixels in " + candidate;
+                if (diffBitmap)
+                    recycleBitmap(diffBitmap);
+                recycleBuffer(std::move(image));
+                return result;
+            }
+            if (options.metrics.any())
+            {
+                Profiler::Stage stage("quality", candidate);
+                result.quality = ImageMetrics::compute(image.data(), imageRef.data, width, height, result.metrics.sumSquaredError / result.metrics.pixelCount, options.metrics, *pool());
+                stage.set("pixels", static_cast<long long>(width) * height);
+            }
+            recycleBuffer(std::move(image));
+            result.ok = true;
+
+            if (!options.diffFilename.empty() && !diffBitmap)
+            {
+                result.ok = false;
+                result.error = "failed to allocate diff image " + options.diffFilename;
+            }
+            if (tileStats && !saveTileMetrics(tiles, options.tileFilename))
+            {
+                result.ok = false;
+                result.error = "failed to save tile statistics " + options.tileFilename;
+            }
+
+            if (diffBitmap && saves)
+                saves->emplace_back(options.diffFilename, writer().save(diffBitmap, options.diffFilename, FIF_EXR, diffSaveFlags(options.diffFormat, options.diffSaveFlags), recycleBitmap));
+            else if (diffBitmap)
+            {
+                if (!saveDiffBitmap(diffBitmap, options.diffFilename, diffSaveFlags(options.diffFormat, options.diffSaveFlags)))
+                {
+                    result.ok = false;
+                    result.error = "failed to save diff image " + options.diffFilename;
+                }
+                recycleBitmap(diffBitmap);
+            }
+            return result;
+        }
+
+        static std::atomic<bool> & gpuEnabled()
+        {
+            static std::atomic<bool> enabled(false);
+            return enabled;
+        }
+
+        /**
+         * @brief Metric pass of a converted candidate against the reference: on the GPU if
+         *        enabled and possible, else fusedMetrics().
+         * @param nonFinite NaN/Inf pixels of the candidate.
+         */
+        static ErrorMetrics metricPass(const LuminanceBuffer & image, size_t nonFinite, const LuminanceView & imageRef, FIBITMAP *diffBitmap,
+                                       TileMetrics *tiles, ErrorHistogram *histogram = nullptr)
+        {
+#ifdef IMAGEUTIL_WITH_CUDA
+            ErrorMetrics metrics;
+            if (gpuEnabled() && !histogram && !nonFinite && !imageRef.nonFinite && gpuMetrics(image.data(), imageRef, diffBitmap, tiles, &metrics))
+                return metrics;
+#else
+            (void)nonFinite;
+#endif
+            return fusedMetrics(image.data(), imageRef.data, imageRef.width, imageRef.height, diffBitmap, tiles, histogram);
+        }
+
+#ifdef IMAGEUTIL_WITH_CUDA
+        /**
+         * @brief Reference that is on the device. Its owner keeps the pixels alive, so
+         *        while it hasn't expired, the same owner and data are the same reference.
+         */
+        struct GpuReference
+        {
+            std::weak_ptr<const void> owner;
+            const LuminanceType *data = nullptr;
+        };
+
+        /**
+         * @brief GpuMetrics pass, reduced like fusedMetrics(). Device calls are serialized.
+         * @return False if the CPU has to do the pass, which it then does from now on.
+         */
+        static bool gpuMetrics(const LuminanceType *candidate, const LuminanceView & imageRef, FIBITMAP *diffBitmap, TileMetrics *tiles, ErrorMetrics *metrics)
+        {
+            static std::mutex mutex;
+            static GpuReference uploaded;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!GpuMetrics::available())
+            {
+                report("No CUDA device, metric passes run on the CPU.");
+                gpuEnabled() = false;
+                return false;
+            }
+
+            std::string error;
+            Profiler::Stage stage("gpuMetrics", "candidate");
+            std::shared_ptr<const void> owner = uploaded.owner.lock();
+            bool ok = true;
+            if (!owner || owner != imageRef.owner || uploaded.data != imageRef.data)
+            {
+                uploaded = GpuReference();
+                ok = GpuMetrics::uploadReference(imageRef.data, imageRef.width, imageRef.height, &error);
+                if (ok)
+                    uploaded = GpuReference{ imageRef.owner, imageRef.data };
+                stage.set("referenceUploaded", 1LL);
+            }
+
+            GpuMetrics::Rows rows;
+            GpuMetrics::Tiles deviceTiles;
+            deviceTiles.tileSize = tiles ? tiles->tileSize : 0;
+            std::vector<float> diff;
+            ok = ok && GpuMetrics::compute(candidate, &rows, &deviceTiles, diffBitmap ? &diff : nullptr, &error);
+            if (!ok)
+            {
+                report("GPU metric pass failed, metric passes run on the CPU: " + error);
+                uploaded = GpuReference();
+                gpuEnabled() = false;
+                return false;
+            }
+
+            const int width = imageRef.width, height = imageRef.height;
+            std::vector<RowResult> rowResults(height);
+            for (int y = 0; y < height; ++y)
+            {
+                rowResults[y].error = SpanError{ rows.sumSquaredError[y], rows.maxDiff[y] };
+                rowResults[y].maxIndex = width * y + std::min(rows.maxIndex[y], width - 1);
+            }
+            *metrics = reduceRows(rowResults, static_cast<size_t>(width) * height);
+            if (tiles)
+            {
+                tiles->sumSquaredError = std::move(deviceTiles.sumSquaredError);
+                tiles->sumAbsDiff = std::move(deviceTiles.sumAbsDiff);
+                tiles->maxDiff = std::move(deviceTiles.maxDiff);
+            }
+            for (int y = 0; diffBitmap && y < height; ++y)
+            {
+                const float *absDiff = &diff[static_cast<size_t>(width) * y];
+                writeDiffRow([absDiff](int x) { return absDiff[x]; }, width, height, y, diffBitmap);
+            }
+            stage.set("pixels", static_cast<long long>(width) * height);
+            return true;
+        }
+#endif
+
+        static std::atomic<NanPolicy> & nanPolicyHolder()
+        {
+            static std::atomic<NanPolicy> policy(NanPolicy::Count);
+            return policy;
+        }
+
+        static std::map<std::string, CachedReference> & referenceCache()
+        {
+            static std::map<std::string, CachedReference> cache;
+            return cache;
+        }
+
+        static std::mutex & referenceCacheMutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static size_t & referenceCacheLimit()
+        {
+            static size_t limit = 0;
+            return limit;
+        }
+
+        static unsigned long long & referenceClock()
+        {
+            static unsigned long long clock = 0;
+            return clock;
+        }
+
+        /**
+         * @brief Drop least recently used loaded references until the cache fits its limit,
+         *        keeping the entry keep. The caller holds referenceCacheMutex(). Comparisons
+         *        still using an evicted reference keep its pixels alive until they finish.
+         */
+        static void evictReferences(const std::string & keep)
+        {
+            size_t limit = referenceCacheLimit();
+            if (limit == 0)
+                return;
+            auto & cache = referenceCache();
+            for (;;)
+            {
+                size_t bytes = 0;
+                auto oldest = cache.end();
+                for (auto it = cache.begin(); it != cache.end(); ++it)
+                {
+                    bytes += it->second.bytes;
+                    if (it->second.bytes && it->first != keep && (oldest == cache.end() || it->second.lastUse < oldest->second.lastUse))
+                        oldest = it;
+                }
+                if (bytes <= limit || oldest == cache.end())
+                    return;
+                cache.erase(oldest);
+            }
+        }
+
+        static std::map<std::string, CachedHash> & hashCache()
+        {
+            static std::map<std::string, CachedHash> cache;
+            return cache;
+        }
+
+        static std::mutex & hashCacheMutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        /**
+         * @brief Current pool, swapped atomically by setThreadCount(). Callers hold the
+         *        returned pointer while they use the pool, so a replaced pool lives until
+         *        its last parallelFor() returns.
+         */
+        static std::shared_ptr<ThreadPool> & poolHolder()
+        {
+            static std::shared_ptr<ThreadPool> holder = makePool(1);
+            return holder;
+        }
+
+        static std::shared_ptr<ThreadPool> pool()
+        {
+            return std::atomic_load(&poolHolder());
+        }
+
+        static std::shared_ptr<ThreadPool> makePool(unsigned threads)
+        {
+            // The last user of a replaced pool may be one of its workers, which can't join itself.
+            return std::shared_ptr<ThreadPool>(new ThreadPool(threads), [](ThreadPool *retired)
+            {
+                if (retired->isWorkerThread())
+                    std::thread([retired] { delete retired; }).detach();
+                else
+                    delete retired;
+            });
+        }
+
+        /**
+         * @brief Luminance buffers recycled between comparisons, see setPoolLimit().
+         */
+        static BufferPool<LuminanceType> & bufferPool()
+        {
+            static BufferPool<LuminanceType> buffers;
+            return buffers;
+        }
+
+        /**
+         * @brief Diff bitmaps recycled between comparisons, see setPoolLimit().
+         */
+        static BitmapPool & bitmapPool()
+        {
+            static BitmapPool bitmaps;
+            return bitmaps;
+        }
+
+        static void recycleBuffer(LuminanceBuffer && buffer)
+        {
+            bufferPool().release(std::move(buffer));
+        }
+
+        static void recycleBitmap(FIBITMAP *bitmap)
+        {
+            bitmapPool().release(bitmap);
+        }
+
+        /**
+         * @brief Writer encoding diff images in the background, two files at a time.
+         */
+        static AsyncImageWriter & writer()
+        {
+            static AsyncImageWriter instance(2, 4);
+            return instance;
+        }
+
+        /**
+         * @brief Rows per parallelFor chunk, roughly 64K pixels.
+         */
+        static int rowGrain(int width)
+        {
+            return std::max(1, (1 << 16) / std::max(width, 1));
+        }
+
+        /**
+         * @brief Threshold of the run's error histograms, counting nothing without one.
+         */
+        static double histogramThreshold(const RunOptions & options)
+        {
+            return options.errorThreshold >= 0.0 ? options.errorThreshold : std::numeric_limits<double>::infinity();
+        }
+
+        /**
+         * @brief Rows per chunk of a metric pass: whole tile rows when tiles are gathered.
+         */
+        static int metricGrain(int width, int tileSize)
+        {
+            if (tileSize <= 0)
+                return rowGrain(width);
+            return tileSize * std::max(1, rowGrain(width) / tileSize);
+        }
+
+        /**
+         * @brief Resolve roi against the image size, an empty roi is the whole image.
+         * @return False if roi doesn't lie inside the image.
+         */
+        static bool resolveRegion(const Region & roi, int imageWidth, int imageHeight, Region *crop)
+        {
+            if (roi.empty())
+            {
+                crop->x = 0;
+                crop->y = 0;
+                crop->width = imageWidth;
+                crop->height = imageHeight;
+                return true;
+            }
+            *crop = roi;
+            return roi.x >= 0 && roi.y >= 0 && roi.x + roi.width <= imageWidth && roi.y + roi.height <= imageHeight;
+        }
+
+        /**
+         * @brief Query modification time and size of a file.
+         * @return False if the file does not exist.
+         */
+        static bool getFileStamp(const std::string & filename, long long *mtime, long long *size)
+        {
+#ifdef _WIN32
+            struct _stat64 info;
+            if (_stat64(filename.c_str(), &info) != 0)
+                return false;
+#else
+            struct stat info;
+            if (stat(filename.c_str(), &info) != 0)
+                return false;
+#endif
+            *mtime = static_cast<long long>(info.st_mtime);
+            *size = static_cast<long long>(info.st_size);
+            return true;
+        }
+
+        /**
+         * @brief Load reference luminance (of roi) through the reference cache.
+         *        Whole raw (.iuraw) luminance references are mapped and used without a copy.
+         * @param encoded File contents if already read, see fileHash().
+         * @return Empty view if fails.
+         */
+        static LuminanceView loadReference(const std::string & filename, const Region & roi = Region(), const std::vector<BYTE> *encoded = nullptr)
+        {
+            long long mtime, size;
+            if (!getFileStamp(filename, &mtime, &size))
+                return LuminanceView();
+
+            std::string key = referenceKey(filename, roi);
+
+            std::promise<LuminanceView> promise;
+            std::shared_future<LuminanceView> pending;
+            {
+                std::lock_guard<std::mutex> lock(referenceCacheMutex());
+                auto & cache = referenceCache();
+                auto it = cache.find(key);
+                if (it != cache.end() && it->second.mtime == mtime && it->second.size == size)
+                {
+                    pending = it->second.loaded;
+                    it->second.lastUse = ++referenceClock();
+                }
+                else
+                {
+                    CachedReference entry;
+                    entry.mtime = mtime;
+                    entry.size = size;
+                    entry.loaded = promise.get_future().share();
+                    entry.lastUse = ++referenceClock();
+                    cache[key] = entry;
+                }
+            }
+
+            if (pending.valid())
+            {
+                Profiler::Stage stage("referenceCacheHit", filename);
+                return pending.get();
+            }
+
+            LuminanceView loaded = decodeReference(filename, roi, encoded);
+            promise.set_value(loaded);
+
+            std::lock_guard<std::mutex> lock(referenceCacheMutex());
+            auto it = referenceCache().find(key);
+            if (it != referenceCache().end() && it->second.mtime == mtime && it->second.size == size)
+            {
+                if (!loaded)
+                    referenceCache().erase(it);
+                else
+                {
+                    it->second.bytes = static_cast<size_t>(loaded.width) * loaded.height * sizeof(LuminanceType) +
+                                       (loaded.masked ? loaded.masked->size() * sizeof(size_t) : 0);
+                    evictReferences(key);
+                }
+            }
+            return loaded;
+        }
+
+        /**
+         * @brief Load reference luminance (of roi) without the reference cache, with the
+         *        NaN/Inf policy applied. Whole raw (.iuraw) luminance references are mapped.
+         * @return Empty view if fails.
+         */
+        static LuminanceView decodeReference(const std::string & filename, const Region & roi = Region(), const std::vector<BYTE> *encoded = nullptr)
+        {
+            LuminanceView loaded = RawImage::isRawFilename(filename) && roi.empty() ? mapRawLuminance(filename) : LuminanceView();
+            // Mapped pixels are read-only, clamped or masked ones need a converted copy.
+            if (loaded)
+            {
+                loaded.nonFinite = SimdKernels::nonFiniteCount(loaded.data, static_cast<size_t>(loaded.width) * loaded.height);
+                if (loaded.nonFinite && (nanPolicy() == NanPolicy::Clamp || nanPolicy() == NanPolicy::Mask))
+                    loaded = LuminanceView();
+            }
+            if (!loaded)
+            {
+                auto luminance = std::make_shared<LuminanceBuffer>(loadImageToLuminance(filename, &loaded.width, &loaded.height, roi, encoded, &loaded.nonFinite));
+                if (!luminance->empty())
+                    finishReference(luminance, filename, &loaded);
+            }
+            else if (loaded.nonFinite)
+                warnReference(filename, loaded.nonFinite);
+            if (loaded && loaded.nonFinite && nanPolicy() == NanPolicy::Fail)
+                loaded = LuminanceView();
+            return loaded;
+        }
+
+        /**
+         * @brief Key of a reference in referenceCache(). Crops of the same file are cached
+         *        separately, and so are NaN/Inf policies.
+         */
+        static std::string referenceKey(const std::string & filename, const Region & roi)
+        {
+            std::string key = filename;
+            if (!roi.empty())
+                key += "#" + std::to_string(roi.x) + "," + std::to_string(roi.y) + "," + std::to_string(roi.width) + "," + std::to_string(roi.height);
+            if (nanPolicy() != NanPolicy::Count)
+                key += std::string("|") + nanPolicyName(nanPolicy());
+            return key;
+        }
+
+        /**
+         * @brief At least levels mip levels (1 = half resolution) of a loaded reference, kept
+         *        with the cached reference so later runs against it don't filter it again.
+         */
+        static std::shared_ptr<const std::vector<LuminanceView>> referencePyramid(const std::string & filename, const Region & roi,
+                                                                                  const LuminanceView & reference, int levels)
+        {
+            const std::string key = referenceKey(filename, roi);
+            {
+                std::lock_guard<std::mutex> lock(referenceCacheMutex());
+                auto it = referenceCache().find(key);
+                if (it != referenceCache().end() && it->second.pyramid && static_cast<int>(it->second.pyramid->size()) >= levels)
+                    return it->second.pyramid;
+            }
+
+            std::shared_ptr<const std::vector<LuminanceView>> pyramid;
+            {
+                Profiler::Stage stage("referencePyramid", filename);
+                pyramid = std::make_shared<const std::vector<LuminanceView>>(buildPyramid(reference, levels));
+            }
+
+            // Only stored if the reference is still the cached one, concurrent builds are harmless.
+            std::lock_guard<std::mutex> lock(referenceCacheMutex());
+            auto it = referenceCache().find(key);
+            if (it != referenceCache().end() && it->second.bytes && it->second.loaded.get().data == reference.data)
+            {
+                size_t bytes = 0;
+                for (const auto & level : *pyramid)
+                    bytes += static_cast<size_t>(level.width) * level.height * sizeof(LuminanceType);
+                if (it->second.pyramid)
+                    for (const auto & level : *it->second.pyramid)
+                        it->second.bytes -= static_cast<size_t>(level.width) * level.height * sizeof(LuminanceType);
+                it->second.pyramid = pyramid;
+                it->second.bytes += bytes;
+                evictReferences(key);
+            }
+            return pyramid;
+        }
+
+        /**
+         * @brief Half resolution copy of image, each pixel the mean of a 2x2 box. Odd edges
+         *        repeat their last row or column.
+         */
+        static LuminanceView downsample(const LuminanceView & image)
+        {
+            LuminanceView level;
+            level.width = (image.width + 1) / 2;
+            level.height = (image.height + 1) / 2;
+            auto pixels = std::make_shared<LuminanceBuffer>(static_cast<size_t>(level.width) * level.height);
+            pool()->parallelFor(level.height, rowGrain(image.width * 2), [&](int begin, int end)
+            {
+                for (int y = begin; y < end; ++y)
+                {
+                    const LuminanceType *row0 = image.data + static_cast<size_t>(image.width) * (2 * y);
+                    const LuminanceType *row1 = image.data + static_cast<size_t>(image.width) * std::min(2 * y + 1, image.height - 1);
+                    LuminanceType *dst = pixels->data() + static_cast<size_t>(level.width) * y;
+                    for (int x = 0; x < level.width; ++x)
+                    {
+                        int x0 = 2 * x, x1 = std::min(2 * x + 1, image.width - 1);
+                        dst[x] = (row0[x0] + row0[x1] + row1[x0] + row1[x1]) * 0.25f;
+                    }
+                }
+            });
+            level.data = pixels->data();
+            level.owner = pixels;
+            return level;
+        }
+
+        /**
+         * @brief Mip levels 1..levels of image, fewer if it shrinks to 1x1 before.
+         */
+        static std::vector<LuminanceView> buildPyramid(const LuminanceView & image, int levels)
+        {
+            std::vector<LuminanceView> pyramid;
+            const LuminanceView *previous = &image;
+            for (int level = 1; level <= levels && (previous->width > 1 || previous->height > 1); ++level)
+            {
+                pyramid.push_back(downsample(*previous));
+                previous = &pyramid.back();
+            }
+            return pyramid;
+        }
+
+        /**
+         * @brief Report the RMSE of candidate i at the mip levels of options, coarsest first.
+         * @return True if options.approximateLevel was reached, results and quality then hold
+         *         that level's metrics and the full resolution pass is to be skipped.
+         */
+        static bool compareLevels(size_t i, const LuminanceBuffer & image, const LuminanceView & imageRef, const std::string & ref, const Region & roi,
+                                  const RunOptions & options, ErrorMetrics *results, QualityMetrics *quality)
+        {
+            const int levels = std::max(options.mipLevels, options.approximateLevel);
+            auto refPyramid = referencePyramid(ref, roi, imageRef, levels);
+            LuminanceView candidate;
+            candidate.data = image.data();
+            candidate.width = imageRef.width;
+            candidate.height = imageRef.height;
+            std::vector<LuminanceView> pyramid;
+            {
+                Profiler::Stage stage("pyramid", "Image" + std::to_string(i + 1));
+                pyramid = buildPyramid(candidate, std::min(levels, static_cast<int>(refPyramid->size())));
+            }
+
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (int level = static_cast<int>(pyramid.size()); level >= 1; --level)
+            {
+                const LuminanceView & levelCandidate = pyramid[level - 1];
+                const LuminanceView & levelRef = (*refPyramid)[level - 1];
+                ErrorMetrics metrics = fusedMetrics(levelCandidate.data, levelRef.data, levelCandidate.width, levelCandidate.height);
+                std::cout << "Image" << i + 1 << " level " << level << " (" << levelCandidate.width << "x" << levelCandidate.height
+                          << ") RMSE: " << metrics.rmse() << std::endl;
+                if (level > options.approximateLevel)
+                    continue;
+
+                *results = metrics;
+                if (quality)
+                    *quality = ImageMetrics::compute(levelCandidate.data, levelRef.data, levelCandidate.width, levelCandidate.height,
+                                                     metrics.sumSquaredError / metrics.pixelCount, options.metrics, *pool());
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief Content hash of a file, kept (like references) while the file keeps its
+         *        mtime and size. Encoded images are read into encoded on the way, so a
+         *        decode after a result cache miss doesn't read the file again. Raw images
+         *        are hashed through a mapping and leave encoded empty.
+         * @return False if the file can't be read.
+         */
+        static bool fileHash(const std::string & filename, uint64_t *hash, std::vector<BYTE> *encoded)
+        {
+            long long mtime, size;
+            if (!getFileStamp(filename, &mtime, &size))
+                return false;
+            {
+                std::lock_guard<std::mutex> lock(hashCacheMutex());
+                auto it = hashCache().find(filename);
+                if (it != hashCache().end() && it->second.mtime == mtime && it->second.size == size)
+                {
+                    *hash = it->second.hash;
+                    return true;
+                }
+            }
+
+            Profiler::Stage stage("hash", filename);
+            if (RawImage::isRawFilename(filename))
+            {
+                MappedFile file;
+                if (!file.open(filename))
+                    return false;
+                ContentHash content;
+                content.update(file.data(), file.size());
+                *hash = content.digest();
+            }
+            else if (!readFile(filename, encoded, hash))
+            {
+                encoded->clear();
+                return false;
+            }
+            stage.set("bytesRead", size);
+
+            std::lock_guard<std::mutex> lock(hashCacheMutex());
+            hashCache()[filename] = CachedHash{ mtime, size, *hash };
+            return true;
+        }
+
+        /**
+         * @brief Result cache key of a candidate against a reference: both content hashes
+         *        and every option that changes the result. Bump the version whenever the
+         *        computed values change for the same inputs.
+         */
+        static std::string resultKey(uint64_t candidateHash, uint64_t refHash, const RunOptions & options)
+        {
+            std::ostringstream key;
+            key.precision(std::numeric_limits<double>::max_digits10);
+            key << "rmse/4 candidate " << ContentHash::hex(candidateHash) << " reference " << ContentHash::hex(refHash);
+            const Region & roi = options.roi;
+            if (!roi.empty())
+                key << " roi " << roi.x << "," << roi.y << "," << roi.width << "," << roi.height;
+            const MetricSelection & metrics = options.metrics;
+            if (metrics.any())
+                key << " metrics " << metrics.psnr << metrics.relMSE << metrics.ssim << " peak " << metrics.peak;
+            if (nanPolicy() != NanPolicy::Count)
+                key << " nan " << nanPolicyName(nanPolicy());
+            return key.str();
+        }
+
+        static ResultCache::Values cacheValues(const ErrorMetrics & metrics, const QualityMetrics *quality)
+        {
+            ResultCache::Values values;
+            values["sumSquaredError"] = metrics.sumSquaredError;
+            values["maxDiff"] = metrics.maxDiff;
+            values["maxDiffIndex"] = metrics.maxDiffIndex;
+            values["pixelCount"] = static_cast<double>(metrics.pixelCount);
+            values["nonFinite"] = static_cast<double>(metrics.nonFinite);
+            if (quality && quality->computed.psnr)
+                values["psnr"] = quality->psnr;
+            if (quality && quality->computed.relMSE)
+                values["relMSE"] = quality->relMSE;
+            if (quality && quality->computed.ssim)
+                values["ssim"] = quality->ssim;
+            return values;
+        }
+
+        /**
+         * @return False if values lack a metric of selection.
+         */
+        static bool fromCacheValues(const ResultCache::Values & values, const MetricSelection & selection, ErrorMetrics *metrics, QualityMetrics *quality)
+        {
+            auto get = [&values](const char *name, double *value)
+            {
+                auto it = values.find(name);
+                if (it == values.end())
+                    return false;
+                *value = it->second;
+                return true;
+            };
+
+            double maxDiffIndex, pixelCount, nonFinite;
+            if (!get("sumSquaredError", &metrics->sumSquaredError) || !get("maxDiff", &metrics->maxDiff) ||
+                !get("maxDiffIndex", &maxDiffIndex) || !get("pixelCount", &pixelCount) || pixelCount <= 0.0 ||
+                !get("nonFinite", &nonFinite))
+                return false;
+            metrics->maxDiffIndex = static_cast<int>(maxDiffIndex);
+            metrics->pixelCount = static_cast<size_t>(pixelCount);
+            metrics->nonFinite = static_cast<size_t>(nonFinite);
+
+            quality->computed = selection;
+            return (!selection.psnr || get("psnr", &quality->psnr)) &&
+                   (!selection.relMSE || get("relMSE", &quality->relMSE)) &&
+                   (!selection.ssim || get("ssim", &quality->ssim));
+        }
+
+        /**
+         * @brief Make view (with width, height and nonFinite set) own the converted
+         *        reference luminance, with NaN/Inf pixels masked out under NanPolicy::Mask.
+         * @return False under NanPolicy::Fail if there are NaN/Inf pixels.
+         */
+        static bool finishReference(const std::shared_ptr<LuminanceBuffer> & luminance, const std::string & name, LuminanceView *view)
+        {
+            if (view->nonFinite)
+            {
+                warnReference(name, view->nonFinite);
+                if (nanPolicy() == NanPolicy::Fail)
+                    return false;
+            }
+            if (view->nonFinite && nanPolicy() == NanPolicy::Mask)
+            {
+                auto masked = std::make_shared<std::vector<size_t>>();
+                for (size_t i = 0; i < luminance->size(); ++i)
+                {
+                    if (!std::isfinite((*luminance)[i]))
+                    {
+                        (*luminance)[i] = 0.f;
+                        masked->push_back(i);
+                    }
+                }
+                view->masked = masked;
+            }
+            view->data = luminance->data();
+            view->owner = luminance;
+            return true;
+        }
+
+        static void warnReference(const std::string & name, size_t nonFinite)
+        {
+            report("Reference image has " + std::to_string(nonFinite) + " NaN/Inf pixels (" + nanPolicyName(nanPolicy()) + "): " + name);
+        }
+
+        /**
+         * @brief Report a message of the loaders to the Diagnostics capture of this thread,
+         *        or to std::cerr without one.
+         */
+        static void report(const std::string & message)
+        {
+            if (Diagnostics *diagnostics = Diagnostics::current())
+                diagnostics->messages.push_back(message);
+            else
+                std::cerr << message << std::endl;
+        }
+
+        /**
+         * @brief Run compare, returning its result with the messages reported meanwhile.
+         */
+        template<typename Compare>
+        static ComparisonResult withDiagnostics(Compare compare)
+        {
+            Diagnostics diagnostics;
+            ComparisonResult result = compare();
+            result.warnings = std::move(diagnostics.messages);
+            return result;
+        }
+
+        /**
+         * @brief Zero-copy view of a single channel float raw image.
+         * @return Empty view if the file isn't a float luminance raw image.
+         */
+        static LuminanceView mapRawLuminance(const std::string & filename)
+        {
+            Profiler::Stage stage("mapRaw", filename);
+            RawImage::Header header;
+            const void *samples;
+            auto mapping = RawImage::map(filename, &header, &samples);
+            LuminanceView view;
+            if (mapping && header.channels == 1 && !RawImage::isHalf(header))
+            {
+                view.data = static_cast<const float *>(samples);
+                view.width = static_cast<int>(header.width);
+                view.height = static_cast<int>(header.height);
+                view.owner = mapping;
+                stage.set("bytesMapped", static_cast<long long>(mapping->size()));
+            }
+            return view;
+        }
+
+        template<typename T>
+        static std::pair<int,double> maxDiff(const std::vector<T> &data1, const std::vector<T> &data2)
+        {
+            /* index, value */
+            std::pair<int, double> res = std::make_pair(0, std::abs(data1[0] - data2[0]));
+            
+            for (size_t i = 0; i < data1.size(); ++i)
+            {
+                if (std::abs(data1[i] - data2[i]) > res.second)
+                {
+                    res.second = std::abs(data1[i] - data2[i]);
+                    res.first = static_cast<int>(i);
+                }
+                    
+            }
+            return res;
+        }
+
+        /**
+         * @brief Print RMSE (and max diff) per candidate.
+         *        Candidates that could not be compared have no pixels and report NaN.
+         * @return RMSE per candidate.
+         */
+        static std::vector<double> reportResults(const std::vector<ErrorMetrics> & results, bool diffImage)
+        {
+            std::vector<double> rmses;
+            for (const auto & metrics : results)
+                rmses.push_back(metrics.pixelCount ? metrics.rmse() : std::numeric_limits<double>::quiet_NaN());
+
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (size_t i = 0; i < rmses.size(); ++i)
+                std::cout << "Image" << i + 1 << " RMSE: " << rmses[i] << std::endl;
+            for (size_t i = 0; i < results.size(); ++i)
+                if (results[i].nonFinite)
+                    std::cout << "Image" << i + 1 << " NaN/Inf pixels: " << results[i].nonFinite << std::endl;
+
+            if (diffImage)
+            {
+                for (size_t i = 0; i < results.size(); ++i)
+                {
+                    if (results[i].pixelCount)
+                        std::cout << "Image" << i + 1 << " maxDiff at: " << results[i].maxDiffIndex << " value: " << results[i].maxDiff << std::endl;
+                    else
+                        std::cout << "Image" << i + 1 << " maxDiff at: -1 value: " << std::numeric_limits<double>::quiet_NaN() << std::endl;
+                }
+            }
+            return rmses;
+        }
+
+        /**
+         * @brief Print the selected quality metrics per candidate, NaN if not compared.
+         */
+        static void reportQualityResults(const std::vector<QualityMetrics> & results, const MetricSelection & selection)
+        {
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                const QualityMetrics & quality = results[i];
+                if (selection.psnr)
+                    std::cout << "Image" << i + 1 << " PSNR: " << quality.psnr << std::endl;
+                if (selection.relMSE)
+                    std::cout << "Image" << i + 1 << " relMSE: " << quality.relMSE << std::endl;
+                if (selection.ssim)
+                    std::cout << "Image" << i + 1 << " SSIM: " << quality.ssim << std::endl;
+            }
+        }
+
+        /**
+         * @brief Print the error percentiles and/or the pixels above the error threshold per
+         *        candidate, NaN (or 0 pixels) if not compared.
+         */
+        static void reportHistograms(const std::vector<ErrorHistogram> & histograms, const RunOptions & options)
+        {
+            std::ostringstream threshold;
+            threshold << options.errorThreshold;
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (size_t i = 0; i < histograms.size(); ++i)
+            {
+                const ErrorHistogram & histogram = histograms[i];
+                if (options.percentiles)
+                    std::cout << "Image" << i + 1 << " absDiff p50: " << histogram.percentile(50.0)
+                              << " p99: " << histogram.percentile(99.0)
+                              << " p99.9: " << histogram.percentile(99.9) << std::endl;
+                if (options.errorThreshold >= 0.0)
+                    std::cout << "Image" << i + 1 << " pixels above " << threshold.str() << ": " << histogram.countAbove() << std::endl;
+            }
+        }
+
+        /**
+         * @brief Print RMSE, MSE and max diff per channel and candidate, NaN if not compared.
+         */
+        static void reportChannelResults(const std::vector<ChannelMetrics> & results)
+        {
+            static const char names[] = { 'R', 'G', 'B', 'A' };
+            const double nan = std::numeric_limits<double>::quiet_NaN();
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                const ChannelMetrics & metrics = results[i];
+                for (int c = 0; c < metrics.channels; ++c)
+                {
+                    bool compared = metrics.pixelCount > 0;
+                    std::cout << "Image" << i + 1 << " " << names[c] << " RMSE: " << (compared ? metrics.rmse(c) : nan)
+                              << " MSE: " << (compared ? metrics.mse(c) : nan)
+                              << " maxDiff: " << (compared ? metrics.maxDiff[c] : nan) << std::endl;
+                }
+            }
+        }
+
+        /**
+         * @brief Print PASS/FAIL and RMSE (or the deciding bound) per candidate.
+         */
+        static std::vector<ThresholdResult> reportThresholdResults(const std::vector<ThresholdResult> & results, const ThresholdOptions & options)
+        {
+            std::cout.precision(std::numeric_limits<double>::max_digits10);
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                const ThresholdResult & result = results[i];
+                std::cout << "Image" << i + 1 << (result.passed ? " PASS" : " FAIL");
+                if (!result.ok)
+                {
+                    std::cout << " (" << result.error << ")" << std::endl;
+                    continue;
+                }
+                const char *relation = !result.earlyOut ? ": " : (result.passed ? " <= " : " >= ");
+                std::cout << " RMSE" << relation << result.rmse << " threshold: "
+                          << std::setprecision(std::numeric_limits<double>::digits10) << options.maxRMSE
+                          << std::setprecision(std::numeric_limits<double>::max_digits10);
+                if (result.earlyOut)
+                    std::cout << " (decided after " << result.pixelsCompared << " of " << result.pixelCount << " pixels)";
+                if (result.nonFinite)
+                    std::cout << " NaN/Inf pixels: " << result.nonFinite;
+                std::cout << std::endl;
+            }
+            return results;
+        }
+
+        /**
+         * @brief Threshold comparison of one candidate, see computeRMSEThreshold().
+         */
+        static ThresholdResult thresholdMetrics(const LuminanceSource & source, const LuminanceView & imageRef, const ThresholdOptions & options)
+        {
+            ThresholdResult result;
+            Region crop;
+            if (!resolveRegion(options.roi, source.width(), source.height(), &crop) ||
+                crop.width != imageRef.width || crop.height != imageRef.height)
+            {
+                result.error = "size mismatch against the reference";
+                return result;
+            }
+
+            const int width = crop.width;
+            result.ok = true;
+            result.pixelCount = static_cast<size_t>(width) * crop.height;
+            const double budget = options.maxRMSE * options.maxRMSE * result.pixelCount;
+            const double boundPerPixel = options.valueRange * options.valueRange;
+
+            // A band keeps every thread busy, bounds are checked between bands.
+            const int bandRows = rowGrain(width) * static_cast<int>(pool()->threadCount());
+            std::vector<double> rowErrors(bandRows);
+            std::vector<size_t> rowNonFinite(bandRows);
+            const bool mask = nanPolicy() == NanPolicy::Mask;
+            DoubleAccumulator sumSquaredError;
+            for (int band = 0; band < crop.height; band += bandRows)
+            {
+                int rows = std::min(bandRows, crop.height - band);
+                pool()->parallelFor(rows, rowGrain(width), [&](int begin, int end)
+                {
+                    LuminanceBuffer row(width);
+                    for (auto y = begin; y < end; ++y)
+                    {
+                        rowNonFinite[y] = source.convertRow(crop.y + band + y, crop.x, width, row.data());
+                        const size_t first = static_cast<size_t>(width) * (band + y);
+                        if (mask)
+                            maskPixels(row.data(), imageRef.data + first, first, width, imageRef.masked.get(), rowNonFinite[y] > 0);
+                        rowErrors[y] = SimdKernels::spanError(row.data(), imageRef.data + first, width).sumSquaredError;
+                    }
+                });
+                // Row order, so the result doesn't depend on the thread count.
+                for (int y = 0; y < rows; ++y)
+                {
+                    sumSquaredError.add(rowErrors[y]);
+                    result.nonFinite += rowNonFinite[y];
+                }
+                result.pixelsCompared += static_cast<size_t>(width) * rows;
+                if (result.nonFinite && nanPolicy() == NanPolicy::Fail)
+                {
+                    result.ok = false;
+                    result.error = "NaN/Inf pixels in candidate";
+                    return result;
+                }
+
+                double remaining = static_cast<double>(result.pixelCount - result.pixelsCompared);
+                if (sumSquaredError.result() > budget)
+                {
+                    result.rmse = std::sqrt(sumSquaredError.result() / result.pixelCount);
+                    result.earlyOut = result.pixelsCompared < result.pixelCount;
+                    return result;
+                }
+                if (options.valueRange > 0.0 && remaining > 0.0 && sumSquaredError.result() + remaining * boundPerPixel <= budget)
+                {
+                    result.passed = true;
+                    result.earlyOut = true;
+                    result.rmse = std::sqrt((sumSquaredError.result() + remaining * boundPerPixel) / result.pixelCount);
+                    return result;
+                }
+            }
+
+            result.rmse = std::sqrt(sumSquaredError.result() / result.pixelCount);
+            result.passed = sumSquaredError.result() <= budget;
+            return result;
+        }
+
+        static std::string diffFilename(size_t candidate)
+        {
+            return "diff" + std::to_string(candidate + 1) + ".exr";
+        }
+
+        static std::string tileFilename(size_t candidate)
+        {
+            return "tiles" + std::to_string(candidate + 1) + ".exr";
+        }
+
+        /**
+         * @brief Save tile statistics as a columns x rows RGB float EXR:
+         *        R = RMSE, G = max abs diff, B = mean abs diff of each tile.
+         */
+        static bool saveTileMetrics(const TileMetrics & tiles, const std::string & filename)
+        {
+            Profiler::Stage stage("saveTiles", filename);
+            FIBITMAP *bitmap = FreeImage_AllocateT(FIT_RGBF, tiles.columns, tiles.rows);
+            if (!bitmap)
+                return false;
+            for (int row = 0; row < tiles.rows; ++row)
+            {
+                FIRGBF *bits = reinterpret_cast<FIRGBF *>(FreeImage_GetScanLine(bitmap, tiles.rows - row - 1));
+                for (int column = 0; column < tiles.columns; ++column)
+                {
+                    bits[column].red = static_cast<float>(tiles.rmse(column, row));
+                    bits[column].green = static_cast<float>(tiles.maxDiff[static_cast<size_t>(row) * tiles.columns + column]);
+                    bits[column].blue = static_cast<float>(tiles.meanDiff(column, row));
+                }
+            }
+            stage.set("tiles", static_cast<long long>(tiles.columns) * tiles.rows);
+            bool saved = FreeImage_Save(FIF_EXR, bitmap, filename.c_str(), EXR_FLOAT) != 0;
+            FreeImage_Unload(bitmap);
+            return saved;
+        }
+
+        static FIBITMAP * allocateDiffBitmap(int width, int height, DiffFormat format)
+        {
+            return bitmapPool().acquire(format == DiffFormat::RGBA ? FIT_RGBAF : FIT_FLOAT, width, height);
+        }
+
+        /**
+         * @brief EXR save flags of a diff image: OpenEXR stores float bitmaps as half
+         *        unless EXR_FLOAT is given.
+         */
+        static int diffSaveFlags(DiffFormat format, int compressionFlags)
+        {
+            return format == DiffFormat::Float ? (compressionFlags | EXR_FLOAT) : (compressionFlags & ~EXR_FLOAT);
+        }
+
+        static bool saveDiffBitmap(FIBITMAP *diffBitmap, const std::string & filename, int flags)
+        {
+            Profiler::Stage stage("save", filename);
+            stage.set("pixels", static_cast<long long>(FreeImage_GetWidth(diffBitmap)) * FreeImage_GetHeight(diffBitmap));
+            return FreeImage_Save(FIF_EXR, diffBitmap, filename.c_str(), flags) != 0;
+        }
+
+        /**
+         * @brief Wait for background saves, reporting the ones that failed.
+         */
+        static void waitForSaves(std::vector<std::pair<std::string, std::future<bool>>> *saves)
+        {
+            for (auto & save : *saves)
+                if (!save.second.get())
+                    std::cerr << "Failed to save diff image: " << save.first << std::endl;
+            saves->clear();
+        }
+
+        /**
+         * @brief Whether both files hold the same bytes, compared through memory mappings.
+         *        Files of different sizes cost two stat() calls, others stop at the first
+         *        differing byte. Files that only differ in metadata are caught by
+         *        identicalPixels() after conversion.
+         */
+        static bool identicalFiles(const std::string & filename1, const std::string & filename2)
+        {
+            long long mtime1, size1, mtime2, size2;
+            if (!getFileStamp(filename1, &mtime1, &size1) || !getFileStamp(filename2, &mtime2, &size2) || size1 != size2)
+                return false;
+            Profiler::Stage stage("identicalFiles", filename1);
+            MappedFile file1, file2;
+            if (!file1.open(filename1) || !file2.open(filename2) || file1.size() != file2.size())
+                return false;
+            bool identical = std::memcmp(file1.data(), file2.data(), file1.size()) == 0;
+            stage.set("bytes", static_cast<long long>(file1.size()));
+            stage.set("identical", identical ? 1LL : 0LL);
+            return identical;
+        }
+
+        /**
+         * @brief Whether two width x height luminance buffers are bitwise equal, e.g. of files
+         *        that only differ in metadata. Row chunks are compared in parallel a few rows
+         *        at a time and all of them stop at the first difference. Callers rule out NaN
+         *        pixels, which are bitwise equal but don't compare equal.
+         */
+        static bool identicalPixels(const LuminanceType *data1, const LuminanceType *data2, int width, int height, const std::string & file)
+        {
+            Profiler::Stage stage("identicalPixels", file);
+            std::atomic<bool> differs(false);
+            const int step = std::max(1, 4096 / std::max(width, 1));
+            pool()->parallelFor(height, rowGrain(width), [&](int begin, int end)
+            {
+                for (int y = begin; y < end && !differs.load(std::memory_order_relaxed); y += step)
+                {
+                    size_t offset = static_cast<size_t>(width) * y;
+                    size_t count = static_cast<size_t>(width) * (std::min(end, y + step) - y);
+                    if (std::memcmp(data1 + offset, data2 + offset, count * sizeof(LuminanceType)) != 0)
+                        differs.store(true, std::memory_order_relaxed);
+                }
+            });
+            bool identical = !differs.load();
+            stage.set("identical", identical ? 1LL : 0LL);
+            return identical;
+        }
+
+        /**
+         * @brief Metrics of a comparison of identical width x height images, as the metric
+         *        pass finds them: no error and the first pixel as the maximum.
+         */
+        static ErrorMetrics identicalMetrics(int width, int height)
+        {
+            ErrorMetrics metrics;
+            metrics.pixelCount = static_cast<size_t>(width) * height;
+            return metrics;
+        }
+
+        /**
+         * @brief Partial metrics of one row. Rows are independent; reducing them in row
+         *        order keeps the result identical for any thread count.
+         */
+        struct RowResult
+        {
+            SpanError error;
+            int maxIndex;
+        };
+
+        /**
+         * @brief Write row y of diffBitmap, grey in FIT_FLOAT or opaque grey in RGBA.
+         * @param absDiff Absolute difference of column x as float, absDiff(x).
+         */
+        template<typename AbsDiff>
+        static void writeDiffRow(AbsDiff absDiff, int width, int height, int y, FIBITMAP *diffBitmap)
+        {
+            float *bits = reinterpret_cast<float *>(FreeImage_GetScanLine(diffBitmap, height - y - 1));
+            if (FreeImage_GetImageType(diffBitmap) == FIT_FLOAT)
+            {
+                for (auto x = 0; x < width; ++x)
+                    bits[x] = absDiff(x);
+                return;
+            }
+            int bytespp = FreeImage_GetLine(diffBitmap) / width / sizeof(float);
+            for (auto x = 0; x < width; ++x)
+            {
+                float value = absDiff(x);
+                bits[0] = value;
+                bits[1] = value;
+                bits[2] = value;
+                bits[3] = 1.f;
+                bits += bytespp;
+            }
+        }
+
+        /**
+         * @brief Metrics of row y and optional diff output into the same scanline of diffBitmap.
+         * @param histogram Optional histogram receiving the absolute errors of the row.
+         */
+        template<typename T>
+        static RowResult rowMetrics(const T *row1, const T *row2, int width, int height, int y, FIBITMAP *diffBitmap, ErrorHistogram *histogram = nullptr)
+        {
+            RowResult row;
+            row.error = SimdKernels::spanError(row1, row2, width);
+
+            // The row is still in cache, so locating the first maximum is cheap.
+            row.maxIndex = width * y;
+            for (auto x = 0; x < width; ++x)
+            {
+                // Same widening as the span kernel so the comparison is exact.
+                if (std::abs(static_cast<double>(row1[x]) - row2[x]) == row.error.maxAbsDiff)
+                {
+                    row.maxIndex = width * y + x;
+                    break;
+                }
+            }
+            if (histogram)
+                histogram->add(row1, row2, width);
+
+            if (diffBitmap)
+                writeDiffRow([row1, row2](int x) { return static_cast<float>(std::abs(static_cast<double>(row1[x]) - row2[x])); },
+                             width, height, y, diffBitmap);
+            return row;
+        }
+
+        /**
+         * @brief Add row y to its tiles. Tile rows must not be split across threads,
+         *        see metricGrain(); rows then add up in order for any thread count.
+         */
+        template<typename T>
+        static void tileRowMetrics(const T *row1, const T *row2, int y, TileMetrics *tiles)
+        {
+            size_t tileRow = static_cast<size_t>(y / tiles->tileSize) * tiles->columns;
+            for (int column = 0; column < tiles->columns; ++column)
+            {
+                int begin = column * tiles->tileSize;
+                int count = std::min(tiles->tileSize, tiles->width - begin);
+                SpanError error = SimdKernels::spanError(row1 + begin, row2 + begin, count);
+                double sumAbsDiff = 0.0;
+                for (int x = begin; x < begin + count; ++x)
+                    sumAbsDiff += std::abs(static_cast<double>(row1[x]) - row2[x]);
+
+                size_t tile = tileRow + column;
+                tiles->sumSquaredError[tile] += error.sumSquaredError;
+                tiles->sumAbsDiff[tile] += sumAbsDiff;
+                tiles->maxDiff[tile] = std::max(tiles->maxDiff[tile], error.maxAbsDiff);
+            }
+        }
+
+        template<typename Accumulator = DoubleAccumulator>
+        static ErrorMetrics reduceRows(const std::vector<RowResult> & rows, size_t pixelCount)
+        {
+            ErrorMetrics res;
+            res.pixelCount = pixelCount;
+            res.maxDiff = -1.0;
+            Accumulator sumSquaredError;
+            for (const RowResult & row : rows)
+            {
+                sumSquaredError.add(row.error.sumSquaredError);
+                if (row.error.maxAbsDiff > res.maxDiff)
+                {
+                    res.maxDiff = row.error.maxAbsDiff;
+                    res.maxDiffIndex = row.maxIndex;
+                }
+            }
+            res.sumSquaredError = sumSquaredError.result();
+            return res;
+        }
+
+        /**
+         * @brief Reduce per-row channel errors (channels entries per row) in row order.
+         */
+        static ChannelMetrics reduceChannelRows(const std::vector<SpanError> & rows, int channels, size_t pixelCount)
+        {
+            ChannelMetrics res;
+            res.channels = channels;
+            res.pixelCount = pixelCount;
+            for (int c = 0; c < channels; ++c)
+            {
+                DoubleAccumulator sumSquaredError;
+                for (size_t row = c; row < rows.size(); row += channels)
+                {
+                    sumSquaredError.add(rows[row].sumSquaredError);
+                    res.maxDiff[c] = std::max(res.maxDiff[c], rows[row].maxAbsDiff);
+                }
+                res.sumSquaredError[c] = sumSquaredError.result();
+            }
+            return res;
+        }
+
+        /**
+         * @brief Fused rmse/maxDiff/diffVector: walks both buffers once.
+         * @param diffBitmap Optional FIT_RGBAF bitmap (width x height) receiving
+         *                   the absolute difference (R=G=B, A=1), may be nullptr.
+         */
+        template<typename T, typename Accumulator = DoubleAccumulator>
+        static ErrorMetrics fusedMetrics(const std::vector<T> &data1, const std::vector<T> &data2, int width, int height, FIBITMAP *diffBitmap = nullptr, TileMetrics *tiles = nullptr,
+                                         ErrorHistogram *histogram = nullptr)
+        {
+            assert(data1.size() == data2.size() && data1.size() == static_cast<size_t>(width) * height);
+            return fusedMetrics<T, Accumulator>(data1.data(), data2.data(), width, height, diffBitmap, tiles, histogram);
+        }
+
+        /**
+         * @brief Fused metrics of two width x height buffers, e.g. a mapped reference.
+         * @param tiles Optional per-tile statistics, reset() to the image size by the caller.
+         * @param histogram Optional histogram the absolute errors are added to.
+         */
+        template<typename T, typename Accumulator = DoubleAccumulator>
+        static ErrorMetrics fusedMetrics(const T *data1, const T *data2, int width, int height, FIBITMAP *diffBitmap = nullptr, TileMetrics *tiles = nullptr,
+                                         ErrorHistogram *histogram = nullptr)
+        {
+            std::vector<RowResult> rows(height);
+            std::mutex histogramMutex;
+            pool()->parallelFor(height, metricGrain(width, tiles ? tiles->tileSize : 0), [&](int begin, int end)
+            {
+                // Each chunk fills its own histogram, merged once at the end of the chunk.
+                std::unique_ptr<ErrorHistogram> partial(histogram ? new ErrorHistogram(histogram->threshold()) : nullptr);
+                for (auto y = begin; y < end; ++y)
+                {
+                    size_t offset = static_cast<size_t>(width) * y;
+                    rows[y] = rowMetrics(&data1[offset], &data2[offset], width, height, y, diffBitmap, partial.get());
+                    if (tiles)
+                        tileRowMetrics(&data1[offset], &data2[offset], y, tiles);
+                }
+                if (partial)
+                {
+                    std::lock_guard<std::mutex> lock(histogramMutex);
+                    histogram->merge(*partial);
+                }
+            });
+            return reduceRows<Accumulator>(rows, static_cast<size_t>(width) * height);
+        }
+
+        static double squaredError(const float *data1, const float *data2, size_t count)
+        {
+            return SimdKernels::spanError(data1, data2, count).sumSquaredError;
+        }
+
+        static double squaredError(const double *data1, const double *data2, size_t count)
+        {
+            return SimdKernels::spanError(data1, data2, count).sumSquaredError;
+        }
+
+        template<typename T>
+        static double squaredError(const T *data1, const T *data2, size_t count)
+        {
+            double sum = 0.0;
+            for (size_t i = 0; i < count; ++i)
+                sum += (static_cast<double>(data1[i]) - data2[i]) * (static_cast<double>(data1[i]) - data2[i]);
+            return sum;
+        }
+
+        template<typename T, typename Accumulator = DoubleAccumulator>
+        static double rmse(const std::vector<T> &data1, const std::vector<T> &data2)
+        {
+            // Blocks go through the span kernel, block sums through the accumulator.
+            const size_t blockSize = 4096;
+            Accumulator rmse;
+            for (size_t i = 0; i < data1.size(); i += blockSize)
+                rmse.add(squaredError(&data1[i], &data2[i], std::min(blockSize, data1.size() - i)));
+
+            return sqrt(1.0 / data1.size() * rmse.result());
+        }
+
+        /**
+         * @brief Load 32bpc HDR/OpenEXR image with FreeImage.
+         * @param encoded File contents if already read, see fileHash().
+         * @return nullptr if fails, otherwise release with FreeImage_Unload().
+         */
+        static FIBITMAP * loadBitmap(const std::string & filename, const std::vector<BYTE> *encoded = nullptr)
+        {
+            // Extension check.
+            auto getFreeImageFormat = [&filename]()->FREE_IMAGE_FORMAT
+            {
+                // Get the filename extension                                                
+                std::string::size_type extension_index = filename.find_last_of(".");
+                std::string ext = extension_index != std::string::npos ?
+                    filename.substr(extension_index + 1) :
+                    std::string();
+                std::locale loc;
+                for (std::string::size_type i = 0; i < ext.length(); ++i)
+                    ext[i] = std::tolower(ext[i], loc);
+                if (ext == "hdr")
+                    return FIF_HDR;
+                if (ext == "exr")
+                    return FIF_EXR;
+                if (ext == "png")
+                    return FIF_PNG;
+                if (ext == "tif" || ext == "tiff")
+                    return FIF_TIFF;
+                if (ext == "bmp")
+                    return FIF_BMP;
+                if (ext == "tga")
+                    return FIF_TARGA;
+                return FIF_UNKNOWN;
+            };
+
+            auto imageFormat = getFreeImageFormat();
+            if (imageFormat == FIF_UNKNOWN)
+            {
+                report("The format is none of HDR, EXR, PNG, TIFF, BMP or TGA, not supported for RMSE computation...");
+                return nullptr;
+            }
+
+            // Read and decode are separate steps so that profiles tell I/O from decoding.
+            std::vector<BYTE> contents;
+            if (!encoded)
+            {
+                Profiler::Stage stage("read", filename);
+                if (!readFile(filename, &contents))
+                {
+                    report("Failed to load image: " + filename);
+                    return nullptr;
+                }
+                stage.set("bytesRead", static_cast<long long>(contents.size()));
+                encoded = &contents;
+            }
+
+            Profiler::Stage stage("decode", filename);
+            FIMEMORY *memory = FreeImage_OpenMemory(const_cast<BYTE *>(encoded->data()), static_cast<DWORD>(encoded->size()));
+            FIBITMAP* bitmap = memory ? FreeImage_LoadFromMemory(imageFormat, memory) : nullptr;
+            if (memory)
+                FreeImage_CloseMemory(memory);
+            if (!bitmap)
+            {
+                report("Failed to load image: " + filename);
+                return nullptr;
+            }
+
+            // Palettized and low bit depth bitmaps are expanded once, so rows convert natively.
+            if (FreeImage_GetImageType(bitmap) == FIT_BITMAP && !isLuminanceConvertible(bitmap))
+            {
+                FIBITMAP *expanded = FreeImage_ConvertTo32Bits(bitmap);
+                FreeImage_Unload(bitmap);
+                if (!expanded)
+                {
+                    report("Failed to expand image to 32 bits: " + filename);
+                    return nullptr;
+                }
+                bitmap = expanded;
+            }
+
+            int imageWidth = FreeImage_GetWidth(bitmap);
+            int imageHeight = FreeImage_GetHeight(bitmap);
+            stage.set("width", imageWidth);
+            stage.set("height", imageHeight);
+            stage.set("bitsPerPixel", FreeImage_GetBPP(bitmap));
+            stage.set("imageType", FreeImage_GetImageType(bitmap));
+            stage.set("bufferBytes", static_cast<long long>(FreeImage_GetPitch(bitmap)) * imageHeight);
+            stage.set("pixels", static_cast<long long>(imageWidth) * imageHeight);
+            return bitmap;
+        }
+
+        /**
+         * @brief Read a whole file into memory.
+         * @param hash If set, receives the content hash, computed chunk by chunk while the
+         *             chunk is still in cache.
+         * @return False if the file can't be read or doesn't fit a FreeImage memory stream.
+         */
+        static bool readFile(const std::string & filename, std::vector<BYTE> *bytes, uint64_t *hash = nullptr)
+        {
+            std::ifstream file(filename, std::ios::binary | std::ios::ate);
+            if (!file)
+                return false;
+            std::streamoff size = file.tellg();
+            if (size <= 0 || static_cast<unsigned long long>(size) > std::numeric_limits<DWORD>::max())
+                return false;
+            bytes->resize(static_cast<size_t>(size));
+            file.seekg(0);
+
+            const size_t chunk = 4 << 20;
+            ContentHash content;
+            for (size_t offset = 0; offset < bytes->size(); offset += chunk)
+            {
+                size_t count = std::min(chunk, bytes->size() - offset);
+                if (!file.read(reinterpret_cast<char *>(bytes->data() + offset), static_cast<std::streamsize>(count)))
+                    return false;
+                if (hash)
+                    content.update(bytes->data() + offset, count);
+            }
+            if (hash)
+                *hash = content.digest();
+            return true;
+        }
+
+        /**
+         * @brief Float (RGBF, RGBAF, FLOAT), 16-bit (RGB16, RGBA16, UINT16) and 8-bit
+         *        (24/32-bit and greyscale) bitmaps convert to luminance natively.
+         */
+        static bool isLuminanceConvertible(FIBITMAP *bitmap)
+        {
+            switch (FreeImage_GetImageType(bitmap))
+            {
+            case FIT_RGBF:
+            case FIT_RGBAF:
+            case FIT_FLOAT:
+            case FIT_RGB16:
+            case FIT_RGBA16:
+            case FIT_UINT16:
+                return true;
+            case FIT_BITMAP:
+                return FreeImage_GetBPP(bitmap) == 24 || FreeImage_GetBPP(bitmap) == 32 ||
+                       (FreeImage_GetBPP(bitmap) == 8 && FreeImage_GetColorType(bitmap) == FIC_MINISBLACK);
+            default:
+                return false;
+            }
+        }
+
+        /**
+         * @brief Samples per pixel of a convertible bitmap: 1 (grey), 3 (RGB) or 4 (RGBA).
+         */
+        static int channelCount(FIBITMAP *bitmap)
+        {
+            switch (FreeImage_GetImageType(bitmap))
+            {
+            case FIT_FLOAT:
+            case FIT_UINT16:
+                return 1;
+            case FIT_RGBF:
+            case FIT_RGB16:
+                return 3;
+            case FIT_RGBAF:
+            case FIT_RGBA16:
+                return 4;
+            default:
+                return FreeImage_GetBPP(bitmap) / 8;
+            }
+        }
+
+        /**
+         * @brief PixelFormat of a convertible bitmap. 8-bit pixels are stored BGR(A) on
+         *        little-endian machines, see FI_RGBA_RED.
+         */
+        static PixelFormat bitmapFormat(FIBITMAP *bitmap)
+        {
+            const bool swapped = FI_RGBA_RED == 2;
+            switch (FreeImage_GetImageType(bitmap))
+            {
+            case FIT_RGBAF:  return PixelFormat::RGBA32F;
+            case FIT_RGBF:   return PixelFormat::RGB32F;
+            case FIT_FLOAT:  return PixelFormat::Gray32F;
+            case FIT_RGBA16: return PixelFormat::RGBA16;
+            case FIT_RGB16:  return PixelFormat::RGB16;
+            case FIT_UINT16: return PixelFormat::Gray16;
+            default:
+                switch (FreeImage_GetBPP(bitmap))
+                {
+                case 32: return swapped ? PixelFormat::BGRA8 : PixelFormat::RGBA8;
+                case 24: return swapped ? PixelFormat::BGR8 : PixelFormat::RGB8;
+                default: return PixelFormat::Gray8;
+                }
+            }
+        }
+
+        /**
+         * @brief The pixels of a convertible bitmap, rows bottom-up as FreeImage stores them.
+         */
+        static ImageBuffer bitmapBuffer(FIBITMAP *bitmap)
+        {
+            ImageBuffer image(FreeImage_GetBits(bitmap), FreeImage_GetWidth(bitmap), FreeImage_GetHeight(bitmap),
+                              bitmapFormat(bitmap), FreeImage_GetPitch(bitmap));
+            image.bottomUp = true;
+            return image;
+        }
+
+        /**
+         * @brief count pixels of row y (counted from the top) starting at column x as
+         *        channelCount() floats per pixel in R, G, B(, A) order. Float rows are
+         *        returned in place, 16-bit and 8-bit ones are decoded into scratch, colour
+         *        from sRGB to linear light and alpha to [0, 1].
+         */
+        static const float * expandScanline(FIBITMAP *bitmap, int y, int x, int count, std::vector<float> *scratch)
+        {
+            const ImageBuffer image = bitmapBuffer(bitmap);
+            const size_t offset = static_cast<size_t>(x) * ImageBuffer::channels(image.format) * ImageBuffer::sampleBytes(image.format);
+            return PixelFormats::converter(image.format).expand(image.row(y) + offset, count, scratch);
+        }
+
+        /**
+         * @brief Convert row y (counted from the top of the image) of a convertible bitmap to luminance.
+         * @return NaN/Inf pixels of the row, see validateRow().
+         */
+        static size_t convertScanline(FIBITMAP *bitmap, int y, LuminanceType *dst)
+        {
+            return convertScanline(bitmap, y, 0, FreeImage_GetWidth(bitmap), dst);
+        }
+
+        /**
+         * @brief Convert count pixels of row y starting at column x.
+         */
+        static size_t convertScanline(FIBITMAP *bitmap, int y, int x, int count, LuminanceType *dst)
+        {
+            return convertBufferRow(bitmapBuffer(bitmap), y, x, count, dst);
+        }
+
+        /**
+         * @brief Convert count pixels of row y (counted from the top) of a pixel buffer, bitmap
+         *        or raw mapping starting at column x, through the converter of its format.
+         */
+        static size_t convertBufferRow(const ImageBuffer & image, int y, int x, int count, LuminanceType *dst)
+        {
+            const size_t offset = static_cast<size_t>(x) * ImageBuffer::channels(image.format) * ImageBuffer::sampleBytes(image.format);
+            PixelFormats::converter(image.format).luminance(image.row(y) + offset, count, dst);
+            return validateRow(dst, count);
+        }
+
+        /**
+         * @brief Count the NaN/Inf pixels of a converted luminance row and clamp them under
+         *        NanPolicy::Clamp. Luminance is NaN/Inf whenever R, G or B is, so one scan
+         *        of the row covers all channels, and rows without any take no branches.
+         * @return NaN/Inf pixels of the row, before clamping.
+         */
+        static size_t validateRow(LuminanceType *row, int count)
+        {
+            size_t found = SimdKernels::nonFiniteCount(row, count);
+            if (found == 0 || nanPolicy() != NanPolicy::Clamp)
+                return found;
+            for (auto x = 0; x < count; ++x)
+            {
+                if (std::isnan(row[x]))
+                    row[x] = 0.f;
+                else if (std::isinf(row[x]))
+                    row[x] = row[x] > 0.f ? std::numeric_limits<LuminanceType>::max() : std::numeric_limits<LuminanceType>::lowest();
+            }
+            return found;
+        }
+
+        /**
+         * @brief NanPolicy::Mask: make count candidate pixels starting at pixel first compare
+         *        equal where either image is NaN/Inf. NaN/Inf candidate pixels take the
+         *        reference value, pixels masked in the reference (zeroed) are zeroed.
+         * @param candidate, reference The pixel with index first of each image.
+         * @param refMasked Sorted indices of the masked reference pixels, may be null.
+         * @param scan Whether the candidate span has NaN/Inf pixels at all.
+         * @return Pixels masked in the span.
+         */
+        static size_t maskPixels(LuminanceType *candidate, const LuminanceType *reference, size_t first, size_t count,
+                                 const std::vector<size_t> *refMasked, bool scan)
+        {
+            size_t masked = 0;
+            if (refMasked)
+            {
+                auto end = std::lower_bound(refMasked->begin(), refMasked->end(), first + count);
+                for (auto it = std::lower_bound(refMasked->begin(), refMasked->end(), first); it != end; ++it, ++masked)
+                    candidate[*it - first] = 0.f;
+            }
+            if (scan)
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if (!std::isfinite(candidate[i]))
+                    {
+                        candidate[i] = reference[i];
+                        ++masked;
+                    }
+                }
+            }
+            return masked;
+        }
+
+        /**
+         * @brief First channels (3 or 4) floats per pixel of count pixels of row y starting
+         *        at column x. Rows already laid out that way are returned as expanded, others
+         *        are packed into packed, with grey repeated into RGB and a missing alpha set to 1.
+         */
+        static const float * channelScanline(FIBITMAP *bitmap, int y, int x, int count, int channels,
+                                             std::vector<float> *expanded, std::vector<float> *packed)
+        {
+            const int available = channelCount(bitmap);
+            const float *bits = expandScanline(bitmap, y, x, count, expanded);
+            if (available == channels)
+                return bits;
+
+            packed->resize(static_cast<size_t>(count) * channels);
+            float *dst = packed->data();
+            for (auto i = 0; i < count; ++i, bits += available, dst += channels)
+                for (auto c = 0; c < channels; ++c)
+                    dst[c] = c < available ? bits[c] : (c < 3 ? bits[0] : 1.f);
+            return packed->data();
+        }
+
+        /**
+         * @brief Load 32bpc HDR/OpenEXR (or raw) image and convert RGB channels to luminance.
+         * @param[out] width Width of the converted region.
+         * @param[out] height Height of the converted region.
+         * @param roi Only this region is converted, empty for the whole image.
+         * @param encoded File contents if already read, see fileHash().
+         * @param nonFinite If set, receives the number of NaN/Inf pixels, see NanPolicy.
+         * @return Empty vector if fails.
+         */
+        static LuminanceBuffer loadImageToLuminance(const std::string & filename, int *width, int *height, const Region & roi = Region(),
+                                                    const std::vector<BYTE> *encoded = nullptr, size_t *nonFinite = nullptr)
+        {
+#ifdef IMAGEUTIL_WITH_OPENEXR
+            if (isExrFilename(filename))
+            {
+                bool supported = true;
+                LuminanceBuffer luminance = loadExrToLuminance(filename, width, height, roi, encoded, nonFinite, &supported);
+                if (supported)
+                    return luminance;
+            }
+#endif
+            LuminanceSource source;
+            if (!source.open(filename, encoded))
+                return LuminanceBuffer();
+            return convertToLuminance(source, filename, width, height, roi, nonFinite);
+        }
+
+#ifdef IMAGEUTIL_WITH_OPENEXR
+        static bool isExrFilename(const std::string & filename)
+        {
+            std::string::size_type dot = filename.find_last_of('.');
+            if (dot == std::string::npos || filename.size() - dot != 4)
+                return false;
+            std::string ext = filename.substr(dot + 1);
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+            return ext == "exr";
+        }
+
+        /**
+         * @brief loadImageToLuminance() of an EXR file through ExrDecoder. Bands of rows are
+         *        decoded with their chunks in parallel and converted straight into the
+         *        luminance buffer, without a bitmap of the whole image.
+         * @param[out] supported False if the file is left to FreeImage, nothing is reported then.
+         */
+        static LuminanceBuffer loadExrToLuminance(const std::string & filename, int *width, int *height, const Region & roi,
+                                                  const std::vector<BYTE> *encoded, size_t *nonFinite, bool *supported)
+        {
+            std::vector<BYTE> contents;
+            if (!encoded)
+            {
+                Profiler::Stage stage("read", filename);
+                if (!readFile(filename, &contents))
+                {
+                    report("Failed to load image: " + filename);
+                    return LuminanceBuffer();
+                }
+                stage.set("bytesRead", static_cast<long long>(contents.size()));
+                encoded = &contents;
+            }
+
+            ExrDecoder decoder(filename, *encoded);
+            std::string error;
+            if (!decoder.open(supported, &error))
+            {
+                if (*supported)
+                    report("Failed to load image: " + filename + " (" + error + ")");
+                return LuminanceBuffer();
+            }
+
+            Region crop;
+            if (!resolveRegion(roi, decoder.width(), decoder.height(), &crop))
+            {
+                report("Region of interest is outside of image: " + filename);
+                return LuminanceBuffer();
+            }
+            *width = crop.width;
+            *height = crop.height;
+
+            Profiler::Stage stage("decodeExr", filename);
+            const size_t pixels = static_cast<size_t>(crop.width) * crop.height;
+            stage.set("width", decoder.width());
+            stage.set("height", decoder.height());
+            stage.set("bufferBytes", static_cast<long long>(pixels * sizeof(LuminanceType)));
+            stage.set("pixels", static_cast<long long>(pixels));
+
+            // Bands span enough chunks (16 or 32 rows for most compressions) to keep every thread busy.
+            const int channels = decoder.channels();
+            const int bandRows = std::min(std::max(64, 32 * static_cast<int>(pool()->threadCount())), crop.height);
+            std::vector<float> band(static_cast<size_t>(decoder.width()) * channels * bandRows);
+            LuminanceBuffer luminanceBuffer = bufferPool().acquire(pixels);
+            std::atomic<size_t> found(0);
+            for (int first = 0; first < crop.height; first += bandRows)
+            {
+                const int rows = std::min(bandRows, crop.height - first);
+                if (!decoder.readRows(crop.y + first, crop.y + first + rows, band.data(), &error))
+                {
+                    report("Failed to load image: " + filename + " (" + error + ")");
+                    recycleBuffer(std::move(luminanceBuffer));
+                    return LuminanceBuffer();
+                }
+                pool()->parallelFor(rows, rowGrain(crop.width), [&](int begin, int end)
+                {
+                    size_t rowsFound = 0;
+                    for (auto y = begin; y < end; ++y)
+                    {
+                        const float *src = band.data() + (static_cast<size_t>(decoder.width()) * y + crop.x) * channels;
+                        LuminanceType *dst = &luminanceBuffer[static_cast<size_t>(crop.width) * (first + y)];
+                        if (channels == 1)
+                            std::copy(src, src + crop.width, dst);
+                        else
+                            SimdKernels::luminanceScanline(src, channels, crop.width, dst);
+                        rowsFound += validateRow(dst, crop.width);
+                    }
+                    found += rowsFound;
+                });
+            }
+            stage.set("nonFinite", static_cast<long long>(found));
+            if (nonFinite)
+                *nonFinite = found;
+            return luminanceBuffer;
+        }
+#endif
+
+        /**
+         * @brief Convert source (roi of it) to luminance, rows in parallel.
+         * @param name Names the image in messages and profiles.
+         * @return Empty vector if fails.
+         */
+        static LuminanceBuffer convertToLuminance(const LuminanceSource & source, const std::string & name, int *width, int *height,
+                                                  const Region & roi = Region(), size_t *nonFinite = nullptr)
+        {
+            Region crop;
+            if (!resolveRegion(roi, source.width(), source.height(), &crop))
+            {
+                report("Region of interest is outside of image: " + name);
+                return LuminanceBuffer();
+            }
+            *width = crop.width;
+            *height = crop.height;
+
+            // Caveat: BITMAP scanline is upside down 
+            //         -- doesn't matter for RMSE computation however.
+
+            Profiler::Stage stage("convert", name);
+            size_t pixels = static_cast<size_t>(crop.width) * crop.height;
+            stage.set("bufferBytes", static_cast<long long>(pixels * sizeof(LuminanceType)));
+            stage.set("pixels", static_cast<long long>(pixels));
+
+            LuminanceBuffer luminanceBuffer = bufferPool().acquire(pixels);
+            std::atomic<size_t> found(0);
+            pool()->parallelFor(crop.height, rowGrain(crop.width), [&](int begin, int end)
+            {
+                size_t rows = 0;
+                for (auto y = begin; y < end; ++y)
+                    rows += source.convertRow(crop.y + y, crop.x, crop.width, &luminanceBuffer[static_cast<size_t>(crop.width) * y]);
+                found += rows;
+            });
+            stage.set("nonFinite", static_cast<long long>(found));
+            if (nonFinite)
+                *nonFinite = found;
+            return luminanceBuffer;
+        }
+
+        /**
+         * @brief Save luminance (R=G=B) buffer to OpenEXR image.
+         */
+        template<typename T>
+        static void saveLuminanceImage(const std::vector<T> &buffer, int width, int height, const std::string & filename)
+        {
+            FIBITMAP* bitmap = FreeImage_AllocateT(FIT_RGBAF, width, height);
+
+            int bytespp = FreeImage_GetLine(bitmap) / width / sizeof(float);
+
+            for (auto y = 0; y < height; ++y)
+            {
+                //Note the scanline fetched by FreeImage is upside down--the first scanline corresponds to the buttom of the image!
+                FLOAT *bits = reinterpret_cast<FLOAT *>(FreeImage_GetScanLine(bitmap, height - y - 1));
+
+                for (auto x = 0; x < width; ++x)
+                {
+                    unsigned int buf_index = (width * y + x) * 1;
+
+                    //32bit image texture is linear.
+                    bits[0] = static_cast<float>(buffer[buf_index]);
+                    bits[1] = static_cast<float>(buffer[buf_index]);
+                    bits[2] = static_cast<float>(buffer[buf_index]);
+                    bits[3] = 1.f;
+                    // jump to next pixel
+                    bits += bytespp;
+                }
+            }
+
+            FreeImage_Save(FIF_EXR, bitmap, filename.c_str());
+            // Unload the 32-bit colour bitmap
+            FreeImage_Unload(bitmap);
+        }
+    };
+}
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief One comparison of a batch manifest.
+     */
+    struct ManifestEntry
+    {
+        std::string candidate;
+        std::string reference;
+        /* Per-comparison options, e.g. "diff" (output path of the diff image). */
+        std::map<std::string, std::string> options;
+        /* Line in the manifest file, for error messages. */
+        int line = 0;
+    };
+
+    /**
+     * @brief Result line of a manifest comparison, as read back from a results file.
+     */
+    struct ManifestResult
+    {
+        std::string line;
+        bool ok = false;
+    };
+
+    /**
+     * @brief Minimal reader/writer for flat JSON objects (string, number, bool and null values).
+     */
+    class Json
+    {
+    public:
+        /**
+         * @brief Parse one flat object, non-string values are kept as their literal text.
+         * @return False on malformed input.
+         */
+        static bool parseObject(const std::string & text, std::map<std::string, std::string> *values)
+        {
+            size_t pos = 0;
+            skipSpace(text, &pos);
+            if (pos >= text.size() || text[pos] != '{')
+                return false;
+            ++pos;
+
+            skipSpace(text, &pos);
+            if (pos < text.size() && text[pos] == '}')
+                return true;
+
+            for (;;)
+            {
+                std::string key, value;
+                skipSpace(text, &pos);
+                if (!parseString(text, &pos, &key))
+                    return false;
+                skipSpace(text, &pos);
+                if (pos >= text.size() || text[pos] != ':')
+                    return false;
+                ++pos;
+                skipSpace(text, &pos);
+                if (pos < text.size() && text[pos] == '"')
+                {
+                    if (!parseString(text, &pos, &value))
+                        return false;
+                }
+                else
+                {
+                    size_t begin = pos;
+                    while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && !std::isspace(static_cast<unsigned char>(text[pos])))
+                        ++pos;
+                    value = text.substr(begin, pos - begin);
+                    if (value.empty())
+                        return false;
+                }
+                (*values)[key] = value;
+
+                skipSpace(text, &pos);
+                if (pos >= text.size())
+                    return false;
+                if (text[pos] == '}')
+                    return true;
+                if (text[pos] != ',')
+                    return false;
+                ++pos;
+            }
+        }
+
+        /**
+         * @brief Quote and escape a string value.
+         */
+        static std::string quote(const std::string & value)
+        {
+            std::string res = "\"";
+            for (char c : value)
+            {
+                switch (c)
+                {
+                case '"':  res += "\\\""; break;
+                case '\\': res += "\\\\"; break;
+                case '\n': res += "\\n"; break;
+                case '\r': res += "\\r"; break;
+                case '\t': res += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20)
+                    {
+                        const char *hex = "0123456789abcdef";
+                        res += "\\u00";
+                        res += hex[(c >> 4) & 0xF];
+                        res += hex[c & 0xF];
+                    }
+                    else
+                        res += c;
+                }
+            }
+            return res + "\"";
+        }
+
+        /**
+         * @brief Format a number, JSON has no NaN/Inf so they are written as null.
+         */
+        static std::string number(double value)
+        {
+            if (!std::isfinite(value))
+                return "null";
+            std::ostringstream text;
+            text.precision(std::numeric_limits<double>::max_digits10);
+            text << value;
+            return text.str();
+        }
+
+    private:
+        static void skipSpace(const std::string & text, size_t *pos)
+        {
+            while (*pos < text.size() && std::isspace(static_cast<unsigned char>(text[*pos])))
+                ++*pos;
+        }
+
+        static bool parseString(const std::string & text, size_t *pos, std::string *out)
+        {
+            if (*pos >= text.size() || text[*pos] != '"')
+                return false;
+            for (++*pos; *pos < text.size(); ++*pos)
+            {
+                char c = text[*pos];
+                if (c == '"')
+                {
+                    ++*pos;
+                    return true;
+                }
+                if (c != '\\')
+                {
+                    *out += c;
+                    continue;
+                }
+                if (++*pos >= text.size())
+                    return false;
+                switch (text[*pos])
+                {
+                case 'n': *out += '\n'; break;
+                case 'r': *out += '\r'; break;
+                case 't': *out += '\t'; break;
+                case 'b': *out += '\b'; break;
+                case 'f': *out += '\f'; break;
+                case 'u':
+                {
+                    // Only code points below 0x80 are expected in paths and options.
+                    if (*pos + 4 >= text.size())
+                        return false;
+                    unsigned code = 0;
+                    for (size_t i = *pos + 1; i <= *pos + 4; ++i)
+                    {
+                        if (!std::isxdigit(static_cast<unsigned char>(text[i])))
+                            return false;
+                        code = code * 16 + (std::isdigit(static_cast<unsigned char>(text[i])) ? text[i] - '0' : (std::tolower(text[i]) - 'a' + 10));
+                    }
+                    *out += code < 0x80 ? static_cast<char>(code) : '?';
+                    *pos += 4;
+                    break;
+                }
+                default: *out += text[*pos]; break;
+                }
+            }
+            return false;
+        }
+    };
+
+    /**
+     * @brief Batch manifest: one comparison per line, either as JSON object
+     *        {"candidate": ..., "reference": ..., <options>} or as CSV
+     *        candidate,reference[,diff]. Blank lines and lines starting with '#' are skipped.
+     */
+    class Manifest
+    {
+    public:
+        /**
+         * @return False if the file can't be read or a line is malformed.
+         */
+        static bool load(const std::string & filename, std::vector<ManifestEntry> *entries, std::string *error)
+        {
+            std::ifstream file(filename);
+            if (!file)
+            {
+                *error = "cannot open manifest " + filename;
+                return false;
+            }
+
+            std::string line;
+            for (int lineNumber = 1; std::getline(file, line); ++lineNumber)
+            {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                std::string trimmed = trim(line);
+                if (trimmed.empty() || trimmed[0] == '#')
+                    continue;
+
+                ManifestEntry entry;
+                entry.line = lineNumber;
+                bool header = false;
+                std::string lineError;
+                if (!parseEntry(trimmed, &entry, &header, &lineError))
+                {
+                    *error = filename + ":" + std::to_string(lineNumber) + ": " + lineError;
+                    return false;
+                }
+                if (header)
+                    continue;
+                entries->push_back(entry);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Indices of the entries of shard (0-based) out of count. All comparisons
+         *        against one reference go to the same shard, so each node decodes a
+         *        reference once. References are spread greedily by their number of
+         *        comparisons, the same way on every node that reads the same manifest.
+         */
+        static std::vector<size_t> shard(const std::vector<ManifestEntry> & entries, int shard, int count)
+        {
+            std::map<std::string, size_t> comparisons;
+            for (const auto & entry : entries)
+                ++comparisons[entry.reference];
+
+            std::vector<std::pair<size_t, std::string>> references;
+            for (const auto & reference : comparisons)
+                references.emplace_back(reference.second, reference.first);
+            std::sort(references.begin(), references.end(), [](const std::pair<size_t, std::string> & a, const std::pair<size_t, std::string> & b)
+            {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+
+            std::vector<size_t> load(static_cast<size_t>(count), 0);
+            std::map<std::string, int> owner;
+            for (const auto & reference : references)
+            {
+                int least = static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+                load[least] += reference.first;
+                owner[reference.second] = least;
+            }
+
+            std::vector<size_t> indices;
+            for (size_t i = 0; i < entries.size(); ++i)
+                if (owner[entries[i].reference] == shard)
+                    indices.push_back(i);
+            return indices;
+        }
+
+        /**
+         * @brief Read the result lines of a results file (see ImageRMSE::runManifest()) by
+         *        manifest index, later lines replacing earlier ones. Lines that don't match
+         *        the candidate and reference of entries, e.g. one cut short by a crash or
+         *        left from another manifest, are skipped.
+         * @return False if the file can't be read.
+         */
+        static bool loadResults(const std::string & filename, const std::vector<ManifestEntry> & entries, std::map<size_t, ManifestResult> *results)
+        {
+            std::ifstream file(filename);
+            if (!file)
+                return false;
+
+            std::string line;
+            while (std::getline(file, line))
+            {
+                std::map<std::string, std::string> values;
+                if (!Json::parseObject(trim(line), &values))
+                    continue;
+                char *end = nullptr;
+                const std::string & number = values["index"];
+                unsigned long long index = std::strtoull(number.c_str(), &end, 10);
+                if (number.empty() || *end != '\0' || index >= entries.size())
+                    continue;
+                const ManifestEntry & entry = entries[static_cast<size_t>(index)];
+                if (values["candidate"] != entry.candidate || values["reference"] != entry.reference)
+                    continue;
+                ManifestResult & result = (*results)[static_cast<size_t>(index)];
+                result.line = trim(line);
+                result.ok = values["status"] == "ok";
+            }
+            return true;
+        }
+
+        /**
+         * @brief Merge the results files of the shards of a run into one report in manifest
+         *        order. A successful result wins over a failed one, and comparisons without
+         *        a result are reported as failed.
+         * @return Number of failed or missing comparisons.
+         */
+        static size_t merge(const std::vector<ManifestEntry> & entries, const std::vector<std::string> & filenames, std::ostream & out)
+        {
+            std::map<size_t, ManifestResult> merged;
+            for (const auto & filename : filenames)
+            {
+                std::map<size_t, ManifestResult> results;
+                if (!loadResults(filename, entries, &results))
+                    std::cerr << "Failed to read results file: " << filename << std::endl;
+                for (const auto & result : results)
+                {
+                    auto it = merged.find(result.first);
+                    if (it == merged.end() || result.second.ok || !it->second.ok)
+                        merged[result.first] = result.second;
+                }
+            }
+
+            size_t failures = 0, missing = 0;
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                auto it = merged.find(i);
+                if (it == merged.end())
+                {
+                    out << "{\"index\":" << i
+                        << ",\"candidate\":" << Json::quote(entries[i].candidate)
+                        << ",\"reference\":" << Json::quote(entries[i].reference)
+                        << ",\"status\":\"error\",\"error\":\"missing result\"}" << std::endl;
+                    ++missing;
+                    ++failures;
+                    continue;
+                }
+                out << it->second.line << std::endl;
+                if (!it->second.ok)
+                    ++failures;
+            }
+            if (missing)
+                std::cerr << "Missing results: " << missing << " of " << entries.size() << " comparisons" << std::endl;
+            return failures;
+        }
+
+        /**
+         * @brief Parse one trimmed, non-empty manifest line, JSON or CSV.
+         * @param header Set for the optional CSV header line, which yields no entry.
+         * @return False if the line is malformed.
+         */
+        static bool parseEntry(const std::string & line, ManifestEntry *entry, bool *header, std::string *error)
+        {
+            *header = false;
+            if (line[0] == '{')
+            {
+                std::map<std::string, std::string> values;
+                if (!Json::parseObject(line, &values))
+                {
+                    *error = "malformed JSON";
+                    return false;
+                }
+                entry->candidate = values["candidate"];
+                entry->reference = values["reference"];
+                values.erase("candidate");
+                values.erase("reference");
+                entry->options = values;
+            }
+            else
+            {
+                std::vector<std::string> fields = splitCSV(line);
+                if (fields.size() >= 2 && fields[0] == "candidate" && fields[1] == "reference")
+                {
+                    *header = true;
+                    return true;
+                }
+                if (fields.size() >= 1)
+                    entry->candidate = fields[0];
+                if (fields.size() >= 2)
+                    entry->reference = fields[1];
+                if (fields.size() >= 3 && !fields[2].empty())
+                    entry->options["diff"] = fields[2];
+            }
+
+            if (entry->candidate.empty() || entry->reference.empty())
+            {
+                *error = "candidate and reference are required";
+                return false;
+            }
+            return true;
+        }
+
+        static std::string trim(const std::string & text)
+        {
+            size_t begin = 0, end = text.size();
+            while (begin < end && std::isspace(static_cast<unsigned char>(text[begin])))
+                ++begin;
+            while (end > begin && std::isspace(static_cast<unsigned char>(text[end - 1])))
+                --end;
+            return text.substr(begin, end - begin);
+        }
+
+    private:
+        /**
+         * @brief Split a CSV line, fields may be double-quoted ("" escapes a quote).
+         */
+        static std::vector<std::string> splitCSV(const std::string & line)
+        {
+            std::vector<std::string> fields;
+            std::string field;
+            bool quoted = false;
+            for (size_t i = 0; i < line.size(); ++i)
+            {
+                char c = line[i];
+                if (quoted)
+                {
+                    if (c == '"' && i + 1 < line.size() && line[i + 1] == '"')
+                        field += line[++i];
+                    else if (c == '"')
+                        quoted = false;
+                    else
+                        field += c;
+                }
+                else if (c == '"')
+                    quoted = true;
+                else if (c == ',')
+                {
+                    fields.push_back(trim(field));
+                    field.clear();
+                }
+                else
+                    field += c;
+            }
+            fields.push_back(trim(field));
+            return fields;
+        }
+    };
+}
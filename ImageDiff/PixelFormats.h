@@ -0,0 +1,235 @@
+#pragma once
+
+#include "ImageBuffer.h"
+#include "SimdKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Sample encodings of PixelFormat. decode() converts a span of samples to float
+     *        and decodeSample() a single one, both exactly the same way on every target.
+     *        Encodings with Srgb set decode colour samples to linear light, decodeAlpha()
+     *        keeps alpha linear.
+     */
+    struct Float32Samples
+    {
+        typedef float Storage;
+        static const bool InPlace = true;
+        static const bool Srgb = false;
+
+        static float decodeSample(float value)
+        {
+            return value;
+        }
+
+        static float decodeAlpha(float value)
+        {
+            return value;
+        }
+
+        static void decode(const float *src, size_t count, float *dst)
+        {
+            std::copy(src, src + count, dst);
+        }
+    };
+
+    struct Half16Samples
+    {
+        typedef uint16_t Storage;
+        static const bool InPlace = false;
+        static const bool Srgb = false;
+
+        static float decodeSample(uint16_t value)
+        {
+            return SimdKernels::halfToFloat(value);
+        }
+
+        static float decodeAlpha(uint16_t value)
+        {
+            return decodeSample(value);
+        }
+
+        static void decode(const uint16_t *src, size_t count, float *dst)
+        {
+            SimdKernels::halfToFloat(src, count, dst);
+        }
+    };
+
+    /**
+     * @brief 16-bit and 8-bit samples are sRGB encoded (PNG, TIFF, JPEG and BMP in practice),
+     *        so luminance and errors are in linear light like those of float images and a 16-bit
+     *        export matches an 8-bit one of the same image up to quantization.
+     * @tparam MaxCode Largest code value, 65535 or 255.
+     */
+    template<typename T, int MaxCode>
+    struct SrgbUnormSamples
+    {
+        typedef T Storage;
+        static const bool InPlace = false;
+        static const bool Srgb = true;
+
+        /**
+         * @brief sRGB code value to linear float in [0, 1] (IEC 61966-2-1).
+         */
+        static const float * table()
+        {
+            static const std::vector<float> values = []
+            {
+                std::vector<float> codes(MaxCode + 1);
+                for (int i = 0; i <= MaxCode; ++i)
+                {
+                    double encoded = static_cast<double>(i) / MaxCode;
+                    codes[i] = static_cast<float>(encoded <= 0.04045 ? encoded / 12.92 : std::pow((encoded + 0.055) / 1.055, 2.4));
+                }
+                return codes;
+            }();
+            return values.data();
+        }
+
+        static float decodeSample(T value)
+        {
+            return table()[value];
+        }
+
+        static float decodeAlpha(T value)
+        {
+            return value / static_cast<float>(MaxCode);
+        }
+
+        static void decode(const T *src, size_t count, float *dst)
+        {
+            const float *codes = table();
+            for (size_t i = 0; i < count; ++i)
+                dst[i] = codes[src[i]];
+        }
+    };
+
+    typedef SrgbUnormSamples<uint16_t, 65535> Unorm16Samples;
+    typedef SrgbUnormSamples<uint8_t, 255> Unorm8Samples;
+
+    /**
+     * @brief Row converters of one pixel format, with encoding, channel count and channel
+     *        order fixed at compile time so every loop is branch-free and unrolled.
+     * @tparam Encoding One of the *Samples encodings.
+     * @tparam Channels 1 (grey), 3 (RGB) or 4 (RGBA).
+     * @tparam Swapped Stored B, G, R(, A) instead of R, G, B(, A).
+     */
+    template<typename Encoding, int Channels, bool Swapped>
+    struct PixelConverter
+    {
+        typedef typename Encoding::Storage Storage;
+
+        /* Pixels converted per block, whose floats stay in L1 between the two passes. */
+        static const int BlockPixels = 256;
+
+        /**
+         * @brief count pixels as floats in R, G, B(, A) order into dst.
+         */
+        static void expand(const Storage *src, int count, float *dst)
+        {
+            if (!Swapped)
+            {
+                Encoding::decode(src, static_cast<size_t>(count) * Channels, dst);
+                if (Encoding::Srgb && Channels == 4)
+                    for (int i = 0; i < count; ++i)
+                        dst[i * 4 + 3] = Encoding::decodeAlpha(src[i * 4 + 3]);
+                return;
+            }
+            for (int i = 0; i < count; ++i, src += Channels, dst += Channels)
+                for (int c = 0; c < Channels; ++c)
+                    dst[c] = c < 3 ? Encoding::decodeSample(src[2 - c]) : Encoding::decodeAlpha(src[c]);
+        }
+
+        static void luminance(const unsigned char *row, int count, float *dst)
+        {
+            const Storage *src = reinterpret_cast<const Storage *>(row);
+            if (Channels == 1)
+            {
+                expand(src, count, dst);
+                return;
+            }
+            if (Encoding::InPlace && !Swapped)
+            {
+                SimdKernels::luminanceScanline(reinterpret_cast<const float *>(src), Channels, count, dst);
+                return;
+            }
+            float block[BlockPixels * Channels];
+            for (int x = 0; x < count; x += BlockPixels)
+            {
+                int pixels = std::min(BlockPixels, count - x);
+                expand(src + static_cast<size_t>(x) * Channels, pixels, block);
+                SimdKernels::luminanceScanline(block, Channels, pixels, dst + x);
+            }
+        }
+
+        static const float * expandRow(const unsigned char *row, int count, std::vector<float> *scratch)
+        {
+            if (Encoding::InPlace && !Swapped)
+                return reinterpret_cast<const float *>(row);
+            scratch->resize(static_cast<size_t>(count) * Channels);
+            expand(reinterpret_cast<const Storage *>(row), count, scratch->data());
+            return scratch->data();
+        }
+    };
+
+    /**
+     * @brief Dispatch table of the PixelFormat converters, so adding a format is one
+     *        table entry and conversion costs one indirect call per row.
+     */
+    class PixelFormats
+    {
+    public:
+        /**
+         * @brief Convert count pixels starting at row to luminance.
+         */
+        typedef void (*LuminanceRow)(const unsigned char *row, int count, float *dst);
+
+        /**
+         * @brief count pixels starting at row as floats in R, G, B(, A) order, float rows
+         *        in place and others in scratch.
+         */
+        typedef const float * (*ExpandRow)(const unsigned char *row, int count, std::vector<float> *scratch);
+
+        struct Converter
+        {
+            LuminanceRow luminance;
+            ExpandRow expand;
+        };
+
+        static const Converter & converter(PixelFormat format)
+        {
+            // In PixelFormat order.
+            static const Converter table[] =
+            {
+                entry<Float32Samples, 4, false>(),
+                entry<Float32Samples, 3, false>(),
+                entry<Float32Samples, 1, false>(),
+                entry<Half16Samples, 4, false>(),
+                entry<Half16Samples, 3, false>(),
+                entry<Half16Samples, 1, false>(),
+                entry<Unorm16Samples, 4, false>(),
+                entry<Unorm16Samples, 3, false>(),
+                entry<Unorm16Samples, 1, false>(),
+                entry<Unorm8Samples, 4, false>(),
+                entry<Unorm8Samples, 3, false>(),
+                entry<Unorm8Samples, 4, true>(),
+                entry<Unorm8Samples, 3, true>(),
+                entry<Unorm8Samples, 1, false>()
+            };
+            static_assert(sizeof(table) / sizeof(table[0]) == static_cast<size_t>(PixelFormat::Gray8) + 1, "one converter per PixelFormat");
+            return table[static_cast<int>(format)];
+        }
+
+    private:
+        template<typename Encoding, int Channels, bool Swapped>
+        static Converter entry()
+        {
+            return Converter{ PixelConverter<Encoding, Channels, Swapped>::luminance, PixelConverter<Encoding, Channels, Swapped>::expandRow };
+        }
+    };
+}
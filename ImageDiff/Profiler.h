@@ -0,0 +1,200 @@
+#pragma once
+
+#include "Manifest.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace ImageUtil
+{
+    /**
+     * @brief Opt-in per-stage instrumentation (wall time, bytes, buffer sizes, pixel throughput).
+     *        While disabled a Stage costs one relaxed atomic load.
+     */
+    class Profiler
+    {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        /**
+         * @brief One timed stage, e.g. read/decode/convert of a file or a metric pass.
+         */
+        struct Record
+        {
+            std::string stage;
+            std::string file;
+            double startMs = 0.0;
+            double ms = 0.0;
+            /* Named counters such as "bytesRead", "bufferBytes" or "pixels". */
+            std::vector<std::pair<std::string, long long>> counters;
+        };
+
+        /**
+         * @brief Times its own lifetime and records it when profiling is enabled.
+         */
+        class Stage
+        {
+        public:
+            explicit Stage(const char *name, const std::string & file = std::string())
+                : active(Profiler::enabled())
+            {
+                if (!active)
+                    return;
+                record.stage = name;
+                record.file = file;
+                start = Clock::now();
+            }
+
+            ~Stage()
+            {
+                if (!active)
+                    return;
+                auto end = Clock::now();
+                record.startMs = std::chrono::duration<double, std::milli>(start - epoch()).count();
+                record.ms = std::chrono::duration<double, std::milli>(end - start).count();
+                Profiler::add(std::move(record));
+            }
+
+            Stage(const Stage &) = delete;
+            Stage & operator=(const Stage &) = delete;
+
+            void set(const char *counter, long long value)
+            {
+                if (active)
+                    record.counters.emplace_back(counter, value);
+            }
+
+        private:
+            bool active;
+            Clock::time_point start;
+            Record record;
+        };
+
+        static void setEnabled(bool enabled)
+        {
+            if (enabled)
+                epoch();
+            enabledFlag().store(enabled, std::memory_order_relaxed);
+        }
+
+        static bool enabled()
+        {
+            return enabledFlag().load(std::memory_order_relaxed);
+        }
+
+        static void reset()
+        {
+            std::lock_guard<std::mutex> lock(mutex());
+            records().clear();
+        }
+
+        /**
+         * @brief Write all records as one JSON object:
+         *        {"wallMs", "peakResidentBytes", "stages": [{"stage", "file", "startMs", "ms", counters..., "mpixelsPerSecond"}]}.
+         */
+        static void write(std::ostream & out)
+        {
+            std::lock_guard<std::mutex> lock(mutex());
+            out << "{\"wallMs\":" << fixed(std::chrono::duration<double, std::milli>(Clock::now() - epoch()).count())
+                << ",\"peakResidentBytes\":" << peakResidentBytes()
+                << ",\"stages\":[";
+            for (size_t i = 0; i < records().size(); ++i)
+            {
+                const Record & record = records()[i];
+                out << (i ? "," : "") << "\n{\"stage\":" << Json::quote(record.stage);
+                if (!record.file.empty())
+                    out << ",\"file\":" << Json::quote(record.file);
+                out << ",\"startMs\":" << fixed(record.startMs) << ",\"ms\":" << fixed(record.ms);
+                for (const auto & counter : record.counters)
+                {
+                    out << "," << Json::quote(counter.first) << ":" << counter.second;
+                    if (counter.first == "pixels")
+                        out << ",\"mpixelsPerSecond\":" << fixed(record.ms > 0.0 ? counter.second / (record.ms * 1000.0) : 0.0);
+                }
+                out << "}";
+            }
+            out << "\n]}" << std::endl;
+        }
+
+    private:
+        static void add(Record record)
+        {
+            std::lock_guard<std::mutex> lock(mutex());
+            records().push_back(std::move(record));
+        }
+
+        /**
+         * @brief Three decimals are plenty for milliseconds and MPixel/s.
+         */
+        static std::string fixed(double value)
+        {
+            if (!std::isfinite(value))
+                return "null";
+            std::ostringstream text;
+            text << std::fixed << std::setprecision(3) << value;
+            return text.str();
+        }
+
+        /**
+         * @brief Peak resident set (working set on Windows) of the process, 0 if unknown.
+         */
+        static long long peakResidentBytes()
+        {
+#ifdef _WIN32
+            PROCESS_MEMORY_COUNTERS counters;
+            if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+                return static_cast<long long>(counters.PeakWorkingSetSize);
+            return 0;
+#else
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) != 0)
+                return 0;
+#ifdef __APPLE__
+            return static_cast<long long>(usage.ru_maxrss);
+#else
+            return static_cast<long long>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+        }
+
+        static std::atomic<bool> & enabledFlag()
+        {
+            static std::atomic<bool> flag(false);
+            return flag;
+        }
+
+        static Clock::time_point epoch()
+        {
+            static const Clock::time_point start = Clock::now();
+            return start;
+        }
+
+        static std::vector<Record> & records()
+        {
+            static std::vector<Record> list;
+            return list;
+        }
+
+        static std::mutex & mutex()
+        {
+            static std::mutex lock;
+            return lock;
+        }
+    };
+}
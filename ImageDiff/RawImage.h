@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ImageUtil
+{
+    /**
+     * @brief Read-only memory mapping of a whole file.
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+
+        ~MappedFile()
+        {
+            close();
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile & operator=(const MappedFile &) = delete;
+
+        /**
+         * @return False if the file can't be opened or mapped (empty files included).
+         */
+        bool open(const std::string & filename)
+        {
+            close();
+#ifdef _WIN32
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+            {
+                close();
+                return false;
+            }
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping)
+            {
+                close();
+                return false;
+            }
+            bytes = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            if (!bytes)
+            {
+                close();
+                return false;
+            }
+            length = static_cast<size_t>(fileSize.QuadPart);
+#else
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size == 0)
+            {
+                ::close(fd);
+                return false;
+            }
+            void *address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (address == MAP_FAILED)
+                return false;
+            bytes = static_cast<const unsigned char *>(address);
+            length = static_cast<size_t>(info.st_size);
+#endif
+            return true;
+        }
+
+        void close()
+        {
+#ifdef _WIN32
+            if (bytes)
+                UnmapViewOfFile(bytes);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (bytes)
+                munmap(const_cast<unsigned char *>(bytes), length);
+#endif
+            bytes = nullptr;
+            length = 0;
+        }
+
+        const unsigned char * data() const
+        {
+            return bytes;
+        }
+
+        size_t size() const
+        {
+            return length;
+        }
+
+    private:
+        const unsigned char *bytes = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+    };
+
+    /**
+     * @brief Uncompressed float image cache (.iuraw) that can be mapped and used in place.
+     *
+     * Layout: one 4096-byte header page, then height rows (top row first) of
+     * width * channels little-endian float32 (magic IURAWF32) or half float
+     * (magic IURAWF16) samples without padding, so the sample data starts
+     * page-aligned in a mapping. channels is 1 (luminance) or 3 (RGB).
+     */
+    class RawImage
+    {
+    public:
+        static const size_t HeaderSize = 4096;
+
+        struct Header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t channels;
+            uint32_t width;
+            uint32_t height;
+            uint64_t dataOffset;
+        };
+
+        static bool isRawFilename(const std::string & filename)
+        {
+            const std::string ext = ".iuraw";
+            return filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+        }
+
+        /**
+         * @brief Write rows (top row first) of width * channels floats.
+         * @return False on I/O error.
+         */
+        static bool write(const std::string & filename, const float *samples, int width, int height, int channels)
+        {
+            return writeSamples(filename, makeHeader(width, height, channels, false), samples, sizeof(float));
+        }
+
+        /**
+         * @brief Write rows (top row first) of width * channels half floats, half the size of float32.
+         * @return False on I/O error.
+         */
+        static bool write(const std::string & filename, const uint16_t *halfSamples, int width, int height, int channels)
+        {
+            return writeSamples(filename, makeHeader(width, height, channels, true), halfSamples, sizeof(uint16_t));
+        }
+
+        static bool isHalf(const Header & header)
+        {
+            return std::memcmp(header.magic, "IURAWF16", sizeof(header.magic)) == 0;
+        }
+
+        /**
+         * @brief Map a raw image. The samples (float, or uint16_t if isHalf()) stay valid as
+         *        long as the returned mapping lives.
+         * @return nullptr if the file can't be mapped or isn't a valid raw image.
+         */
+        static std::shared_ptr<const MappedFile> map(const std::string & filename, Header *header, const void **samples)
+        {
+            std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+            if (!file->open(filename) || file->size() < HeaderSize)
+                return nullptr;
+
+            std::memcpy(header, file->data(), sizeof(Header));
+            Header expected = makeHeader(header->width, header->height, header->channels, isHalf(*header));
+            if (std::memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0 || header->version != expected.version ||
+                (header->channels != 1 && header->channels != 3) || header->dataOffset != HeaderSize ||
+                header->width == 0 || header->height == 0)
+                return nullptr;
+
+            uint64_t sampleBytes = isHalf(*header) ? sizeof(uint16_t) : sizeof(float);
+            uint64_t bytes = static_cast<uint64_t>(header->width) * header->height * header->channels * sampleBytes;
+            if (file->size() < header->dataOffset + bytes)
+                return nullptr;
+
+            *samples = file->data() + header->dataOffset;
+            return file;
+        }
+
+    private:
+        static bool writeSamples(const std::string & filename, const Header & header, const void *samples, size_t sampleBytes)
+        {
+            std::unique_ptr<unsigned char[]> page(new unsigned char[HeaderSize]());
+            std::memcpy(page.get(), &header, sizeof(header));
+
+            FILE *file = std::fopen(filename.c_str(), "wb");
+            if (!file)
+                return false;
+            size_t count = static_cast<size_t>(header.width) * header.height * header.channels;
+            bool ok = std::fwrite(page.get(), 1, HeaderSize, file) == HeaderSize &&
+                      std::fwrite(samples, sampleBytes, count, file) == count;
+            return std::fclose(file) == 0 && ok;
+        }
+
+        static Header makeHeader(int width, int height, int channels, bool half)
+        {
+            Header header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, half ? "IURAWF16" : "IURAWF32", 8);
+            header.version = 1;
+            header.channels = static_cast<uint32_t>(channels);
+            header.width = static_cast<uint32_t>(width);
+            header.height = static_cast<uint32_t>(height);
+            header.dataOffset = HeaderSize;
+            return header;
+        }
+    };
+}
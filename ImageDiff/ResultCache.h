@@ -0,0 +1,154 @@
+#pragma once
+
+#include "ContentHash.h"
+#include "Manifest.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+namespace ImageUtil
+{
+    /**
+     * @brief On-disk store of comparison results, one small JSON file per key in a
+     *        directory. Keys are built from content hashes of the inputs plus the
+     *        options, so a result is reused exactly when nothing it depends on changed.
+     *        Concurrent runs may share a directory: entries are written to a temporary
+     *        file and renamed into place.
+     */
+    class ResultCache
+    {
+    public:
+        typedef std::map<std::string, double> Values;
+
+        explicit ResultCache(const std::string & dir)
+            : directory(dir)
+        {
+        }
+
+        bool enabled() const
+        {
+            return !directory.empty();
+        }
+
+        /**
+         * @return False if there is no entry for key (or it can't be read).
+         */
+        bool load(const std::string & key, Values *values) const
+        {
+            std::ifstream file(entryFilename(key));
+            if (!file)
+                return false;
+            std::stringstream text;
+            text << file.rdbuf();
+
+            std::map<std::string, std::string> fields;
+            if (!Json::parseObject(text.str(), &fields))
+                return false;
+            // The full key is kept in the entry, so a filename collision is a miss.
+            auto stored = fields.find("key");
+            if (stored == fields.end() || stored->second != key)
+                return false;
+
+            Values parsed;
+            for (const auto & field : fields)
+            {
+                if (field.first == "key")
+                    continue;
+                char *end = nullptr;
+                double value = std::strtod(field.second.c_str(), &end);
+                if (end == field.second.c_str())
+                    return false;
+                parsed[field.first] = value;
+            }
+            *values = parsed;
+            return true;
+        }
+
+        /**
+         * @brief Store values under key, replacing an older entry.
+         * @return False if the entry can't be written.
+         */
+        bool store(const std::string & key, const Values & values) const
+        {
+            makeDirectory();
+            std::ostringstream text;
+            text.precision(std::numeric_limits<double>::max_digits10);
+            text << "{\"key\": " << Json::quote(key);
+            // Numbers are stored as strings, which keeps NaN and infinities exact.
+            for (const auto & value : values)
+            {
+                std::ostringstream number;
+                number.precision(std::numeric_limits<double>::max_digits10);
+                number << value.second;
+                text << ", " << Json::quote(value.first) << ": " << Json::quote(number.str());
+            }
+            text << "}\n";
+
+            const std::string filename = entryFilename(key);
+            const std::string temporary = filename + "." + ContentHash::hex(uniqueSuffix()) + ".tmp";
+            {
+                std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+                if (!file || !(file << text.str()) || !file.flush())
+                {
+                    file.close();
+                    std::remove(temporary.c_str());
+                    return false;
+                }
+            }
+#ifdef _WIN32
+            // rename() doesn't replace an existing file on Windows.
+            std::remove(filename.c_str());
+#endif
+            if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+            {
+                std::remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        std::string entryFilename(const std::string & key) const
+        {
+            ContentHash hash;
+            hash.update(key.data(), key.size());
+            return directory + "/" + ContentHash::hex(hash.digest()) + ".json";
+        }
+
+        void makeDirectory() const
+        {
+#ifdef _WIN32
+            _mkdir(directory.c_str());
+#else
+            mkdir(directory.c_str(), 0777);
+#endif
+        }
+
+        static uint64_t uniqueSuffix()
+        {
+            uint64_t seed = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+            ContentHash hash(seed);
+            size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+            unsigned entropy = std::random_device()();
+            hash.update(&thread, sizeof(thread));
+            hash.update(&entropy, sizeof(entropy));
+            return hash.digest();
+        }
+
+        std::string directory;
+    };
+}
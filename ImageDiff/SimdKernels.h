@@ -0,0 +1,833 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGEUTIL_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define IMAGEUTIL_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+// MSVC exposes every intrinsic unconditionally, GCC/Clang need a per-function target.
+// GCC would also fuse mul/add into FMA on FMA capable targets, which breaks the
+// bit-identical results across targets.
+#if defined(IMAGEUTIL_SIMD_X86) && defined(__GNUC__) && !defined(__clang__)
+#define IMAGEUTIL_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#elif defined(IMAGEUTIL_SIMD_X86) && defined(__GNUC__)
+#define IMAGEUTIL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define IMAGEUTIL_TARGET(isa)
+#endif
+
+namespace ImageUtil
+{
+    /**
+     * @brief Squared error sum and max absolute difference of a span.
+     */
+    struct SpanError
+    {
+        double sumSquaredError;
+        double maxAbsDiff;
+    };
+
+    /**
+     * @brief Vectorized luminance conversion and error accumulation with runtime CPU dispatch.
+     *
+     * Every target accumulates the squared error into the same 8 lanes (element i goes
+     * to lane i % 8) and reduces them in the same order, and luminance is evaluated in
+     * float with the scalar operation order, so all targets produce bit-identical results.
+     * Interleaved RGB spans use 3 sets of lanes, taken in turn by blocks of 8 elements,
+     * so that every lane only ever sees one channel.
+     */
+    class SimdKernels
+    {
+    public:
+        enum Target { Scalar, SSE2, AVX2, AVX512, NEON };
+
+        /**
+         * @brief Convert an interleaved RGB(A) float scanline to luminance.
+         * @param channels Floats per pixel, RGB order (3 or 4 are vectorized).
+         */
+        static void luminanceScanline(const float *src, int channels, int width, float *dst)
+        {
+            state().luminance(src, channels, width, dst);
+        }
+
+        /**
+         * @brief Squared error and max absolute difference of two spans.
+         *        Float samples are widened to double before subtracting.
+         */
+        static SpanError spanError(const float *data1, const float *data2, size_t count)
+        {
+            return state().errorFloat(data1, data2, count);
+        }
+
+        static SpanError spanError(const double *data1, const double *data2, size_t count)
+        {
+            return state().errorDouble(data1, data2, count);
+        }
+
+        /**
+         * @brief Per-channel squared error and max absolute difference of two spans of
+         *        pixels interleaved with the same channel count (1 to 4).
+         * @param[out] perChannel channels entries.
+         */
+        static void interleavedError(const float *data1, const float *data2, size_t pixels, int channels, SpanError *perChannel)
+        {
+            // lcm(8, channels) / 8 sets keep each lane on a single channel.
+            const int sets = channels == 3 ? 3 : 1;
+            ErrorLanes lanes;
+            state().lanesFloat(data1, data2, pixels * channels, sets, &lanes);
+
+            double sums[4][8] = { { 0.0 } };
+            for (int c = 0; c < channels; ++c)
+                perChannel[c] = SpanError{ 0.0, 0.0 };
+            for (int set = 0; set < sets; ++set)
+            {
+                for (int lane = 0; lane < 8; ++lane)
+                {
+                    int c = (8 * set + lane) % channels;
+                    sums[c][(8 * set + lane) / channels % 8] = lanes.sum[set][lane];
+                    perChannel[c].maxAbsDiff = std::max(perChannel[c].maxAbsDiff, lanes.max[set][lane]);
+                }
+            }
+            for (int c = 0; c < channels; ++c)
+                perChannel[c].sumSquaredError = reduceLanes(sums[c]);
+        }
+
+        /**
+         * @brief Convert IEEE 754 half floats to float, with F16C on x86 where available.
+         *        Every path is exact, so results don't depend on the target.
+         */
+        static void halfToFloat(const uint16_t *src, size_t count, float *dst)
+        {
+            state().halfToFloat(src, count, dst);
+        }
+
+        /**
+         * @brief Number of NaN and infinite values in a span, found by an exponent mask
+         *        compare without branches.
+         */
+        static size_t nonFiniteCount(const float *data, size_t count)
+        {
+            return state().nonFinite(data, count);
+        }
+
+        static float halfToFloat(uint16_t half)
+        {
+            uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+            uint32_t exponent = (half >> 10) & 0x1f;
+            uint32_t mantissa = half & 0x3ff;
+            uint32_t bits;
+            if (exponent == 0x1f)
+                bits = sign | 0x7f800000u | (mantissa << 13) | (mantissa ? 0x400000u : 0u);
+            else if (exponent != 0)
+                bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+            else if (mantissa == 0)
+                bits = sign;
+            else
+            {
+                // Subnormal half, normal as a float.
+                exponent = 113;
+                while (!(mantissa & 0x400))
+                {
+                    mantissa <<= 1;
+                    --exponent;
+                }
+                bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+            }
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        /**
+         * @brief Round a float to the nearest half float, ties to even.
+         */
+        static uint16_t floatToHalf(float value)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+            uint32_t magnitude = bits & 0x7fffffff;
+            if (magnitude > 0x7f800000)
+                return sign | 0x7e00 | ((magnitude >> 13) & 0x3ff);
+            if (magnitude >= 0x477ff000)
+                return sign | 0x7c00;
+
+            uint32_t half, rest, halfway;
+            if (magnitude < 0x38800000)
+            {
+                // Subnormal half (or zero): the value in units of 2^-24.
+                if (magnitude < 0x33000000)
+                    return sign;
+                int shift = 126 - static_cast<int>(magnitude >> 23);
+                uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+                half = mantissa >> shift;
+                rest = mantissa & ((1u << shift) - 1);
+                halfway = 1u << (shift - 1);
+            }
+            else
+            {
+                half = (magnitude >> 13) - (112u << 10);
+                rest = magnitude & 0x1fff;
+                halfway = 0x1000;
+            }
+            if (rest > halfway || (rest == halfway && (half & 1)))
+                ++half;
+            return static_cast<uint16_t>(sign | half);
+        }
+
+        static Target target()
+        {
+            return state().target;
+        }
+
+        /**
+         * @brief Force a target, unsupported ones fall back to the best supported one.
+         * @return The target actually selected.
+         */
+        static Target setTarget(Target target)
+        {
+            if (!supported(target))
+                target = bestTarget();
+            state() = makeState(target);
+            return target;
+        }
+
+        static const char * targetName(Target target)
+        {
+            switch (target)
+            {
+            case SSE2:   return "sse2";
+            case AVX2:   return "avx2";
+            case AVX512: return "avx512";
+            case NEON:   return "neon";
+            default:     return "scalar";
+            }
+        }
+
+        /**
+         * @return False if name is not a known target.
+         */
+        static bool parseTarget(const std::string & name, Target *target)
+        {
+            for (int t = Scalar; t <= NEON; ++t)
+            {
+                if (name == targetName(static_cast<Target>(t)))
+                {
+                    *target = static_cast<Target>(t);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        /**
+         * @brief Squared error sums and max absolute differences per set and lane.
+         */
+        struct ErrorLanes
+        {
+            double sum[3][8];
+            double max[3][8];
+        };
+
+        typedef void(*LuminanceFn)(const float *src, int channels, int width, float *dst);
+        typedef SpanError(*FloatErrorFn)(const float *data1, const float *data2, size_t count);
+        typedef SpanError(*DoubleErrorFn)(const double *data1, const double *data2, size_t count);
+        typedef void(*FloatLanesFn)(const float *data1, const float *data2, size_t count, int sets, ErrorLanes *lanes);
+        typedef void(*HalfFn)(const uint16_t *src, size_t count, float *dst);
+        typedef size_t(*NonFiniteFn)(const float *data, size_t count);
+
+        struct State
+        {
+            Target target;
+            LuminanceFn luminance;
+            FloatErrorFn errorFloat;
+            DoubleErrorFn errorDouble;
+            FloatLanesFn lanesFloat;
+            HalfFn halfToFloat;
+            NonFiniteFn nonFinite;
+        };
+
+        static State & state()
+        {
+            static State current = makeState(bestTarget());
+            return current;
+        }
+
+        static State makeState(Target target)
+        {
+            State state = makeKernels(target);
+#if defined(IMAGEUTIL_SIMD_X86)
+            if ((target == AVX2 || target == AVX512) && hasF16C())
+                state.halfToFloat = halfF16C;
+            if (target == SSE2)
+                state.nonFinite = nonFiniteSSE2;
+            else if (target == AVX2 || target == AVX512)
+                state.nonFinite = nonFiniteAVX2;
+#elif defined(IMAGEUTIL_SIMD_NEON)
+            if (target == NEON)
+            {
+                state.halfToFloat = halfNEON;
+                state.nonFinite = nonFiniteNEON;
+            }
+#endif
+            return state;
+        }
+
+        static State makeKernels(Target target)
+        {
+            switch (target)
+            {
+#if defined(IMAGEUTIL_SIMD_X86)
+            case SSE2:   return State{ SSE2, luminanceSSE2, error<float, lanesSSE2<float>>, error<double, lanesSSE2<double>>, lanesSSE2<float>, halfScalar, nonFiniteScalar };
+            case AVX2:   return State{ AVX2, luminanceAVX2, error<float, lanesAVX2<float>>, error<double, lanesAVX2<double>>, lanesAVX2<float>, halfScalar, nonFiniteScalar };
+            case AVX512: return State{ AVX512, luminanceAVX2, error<float, lanesAVX512<float>>, error<double, lanesAVX512<double>>, lanesAVX512<float>, halfScalar, nonFiniteScalar };
+#elif defined(IMAGEUTIL_SIMD_NEON)
+            case NEON:   return State{ NEON, luminanceNEON, error<float, lanesNEON<float>>, error<double, lanesNEON<double>>, lanesNEON<float>, halfScalar, nonFiniteScalar };
+#endif
+            default:     return State{ Scalar, luminanceScalar, error<float, lanesScalar<float>>, error<double, lanesScalar<double>>, lanesScalar<float>, halfScalar, nonFiniteScalar };
+            }
+        }
+
+        static bool supported(Target target)
+        {
+            switch (target)
+            {
+            case Scalar:
+                return true;
+#if defined(IMAGEUTIL_SIMD_X86)
+            case SSE2:
+                return true;
+            case AVX2:
+            case AVX512:
+            {
+                int regs[4];
+                cpuid(1, 0, regs);
+                bool osxsave = (regs[2] & (1 << 27)) != 0;
+                bool avx = (regs[2] & (1 << 28)) != 0;
+                if (!osxsave || !avx)
+                    return false;
+                unsigned long long xcr0 = xgetbv();
+                cpuid(7, 0, regs);
+                if (target == AVX2)
+                    return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+                return (xcr0 & 0xE6) == 0xE6 && (regs[1] & (1 << 16)) != 0;
+            }
+#elif defined(IMAGEUTIL_SIMD_NEON)
+            case NEON:
+                return true;
+#endif
+            default:
+                return false;
+            }
+        }
+
+#if defined(IMAGEUTIL_SIMD_X86)
+        static bool hasF16C()
+        {
+            int regs[4];
+            cpuid(1, 0, regs);
+            return (regs[2] & (1 << 29)) != 0;
+        }
+#endif
+
+        static Target bestTarget()
+        {
+            const Target order[] = { AVX512, AVX2, SSE2, NEON };
+            for (Target target : order)
+                if (supported(target))
+                    return target;
+            return Scalar;
+        }
+
+#if defined(IMAGEUTIL_SIMD_X86)
+        static void cpuid(int leaf, int subleaf, int regs[4])
+        {
+#if defined(_MSC_VER)
+            __cpuidex(regs, leaf, subleaf);
+#else
+            unsigned int a = 0, b = 0, c = 0, d = 0;
+            __cpuid_count(leaf, subleaf, a, b, c, d);
+            regs[0] = a; regs[1] = b; regs[2] = c; regs[3] = d;
+#endif
+        }
+
+        static unsigned long long xgetbv()
+        {
+#if defined(_MSC_VER)
+            return _xgetbv(0);
+#else
+            unsigned int lo, hi;
+            __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            return (static_cast<unsigned long long>(hi) << 32) | lo;
+#endif
+        }
+#endif
+
+        static double reduceLanes(const double lanes[8])
+        {
+            return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        }
+
+        /**
+         * @brief Single set span error of a lane kernel.
+         */
+        template<typename T, void(*Lanes)(const T *, const T *, size_t, int, ErrorLanes *)>
+        static SpanError error(const T *data1, const T *data2, size_t count)
+        {
+            ErrorLanes lanes;
+            Lanes(data1, data2, count, 1, &lanes);
+            return SpanError{ reduceLanes(lanes.sum[0]), *std::max_element(lanes.max[0], lanes.max[0] + 8) };
+        }
+
+        /**
+         * @brief Scalar tail shared by all targets, continues at element i (a multiple of 8).
+         */
+        template<typename T>
+        static void finishLanes(const T *data1, const T *data2, size_t i, size_t count, int sets, ErrorLanes *lanes)
+        {
+            for (; i < count; ++i)
+            {
+                int set = static_cast<int>((i >> 3) % sets);
+                double diff = static_cast<double>(data1[i]) - static_cast<double>(data2[i]);
+                lanes->sum[set][i & 7] += diff * diff;
+                lanes->max[set][i & 7] = std::max(lanes->max[set][i & 7], std::abs(diff));
+            }
+        }
+
+        static void finishLuminance(const float *src, int channels, int x, int width, float *dst)
+        {
+            for (src += x * channels; x < width; ++x, src += channels)
+                dst[x] = 0.212671f * src[0] + 0.715160f * src[1] + 0.072169f * src[2];
+        }
+
+        static void luminanceScalar(const float *src, int channels, int width, float *dst)
+        {
+            finishLuminance(src, channels, 0, width, dst);
+        }
+
+        static void halfScalar(const uint16_t *src, size_t count, float *dst)
+        {
+            for (size_t i = 0; i < count; ++i)
+                dst[i] = halfToFloat(src[i]);
+        }
+
+        /* Float exponent bits, all set for NaN and infinities only. */
+        static const uint32_t ExponentMask = 0x7f800000u;
+        /* Vector iterations per 32-bit lane count flush, far below overflow. */
+        static const size_t CountBlock = size_t(1) << 24;
+
+        static size_t nonFiniteScalar(const float *data, size_t count)
+        {
+            size_t found = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32_t bits;
+                std::memcpy(&bits, data + i, sizeof(bits));
+                found += (bits & ExponentMask) == ExponentMask;
+            }
+            return found;
+        }
+
+        template<typename T>
+        static void lanesScalar(const T *data1, const T *data2, size_t count, int sets, ErrorLanes *lanes)
+        {
+            *lanes = ErrorLanes();
+            finishLanes(data1, data2, 0, count, sets, lanes);
+        }
+
+#if defined(IMAGEUTIL_SIMD_X86)
+        /**
+         * @brief Deinterleave 4 RGB pixels (12 floats) into r, g, b registers.
+         */
+        IMAGEUTIL_TARGET("sse2")
+        static void loadRGB4(const float *src, __m128 *r, __m128 *g, __m128 *b)
+        {
+            __m128 v0 = _mm_loadu_ps(src);      // r0 g0 b0 r1
+            __m128 v1 = _mm_loadu_ps(src + 4);  // g1 b1 r2 g2
+            __m128 v2 = _mm_loadu_ps(src + 8);  // b2 r3 g3 b3
+
+            __m128 u = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2));
+            *r = _mm_shuffle_ps(v0, u, _MM_SHUFFLE(2, 0, 3, 0));
+
+            __m128 p = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 0, 1, 1));
+            __m128 q = _mm_shuffle_ps(p, v2, _MM_SHUFFLE(2, 2, 3, 3));
+            *g = _mm_shuffle_ps(p, q, _MM_SHUFFLE(2, 0, 2, 0));
+
+            __m128 w = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2));
+            *b = _mm_shuffle_ps(w, v2, _MM_SHUFFLE(3, 0, 2, 0));
+        }
+
+        IMAGEUTIL_TARGET("sse2")
+        static void luminanceSSE2(const float *src, int channels, int width, float *dst)
+        {
+            const __m128 cr = _mm_set1_ps(0.212671f);
+            const __m128 cg = _mm_set1_ps(0.715160f);
+            const __m128 cb = _mm_set1_ps(0.072169f);
+
+            int x = 0;
+            if (channels == 3 || channels == 4)
+            {
+                for (; x + 4 <= width; x += 4)
+                {
+                    __m128 r, g, b;
+                    if (channels == 4)
+                    {
+                        const float *p = src + x * 4;
+                        r = _mm_loadu_ps(p);
+                        g = _mm_loadu_ps(p + 4);
+                        b = _mm_loadu_ps(p + 8);
+                        __m128 a = _mm_loadu_ps(p + 12);
+                        _MM_TRANSPOSE4_PS(r, g, b, a);
+                    }
+                    else
+                    {
+                        loadRGB4(src + x * 3, &r, &g, &b);
+                    }
+
+                    __m128 lum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cr, r), _mm_mul_ps(cg, g)), _mm_mul_ps(cb, b));
+                    _mm_storeu_ps(dst + x, lum);
+                }
+            }
+            finishLuminance(src, channels, x, width, dst);
+        }
+
+        IMAGEUTIL_TARGET("avx2")
+        static void luminanceAVX2(const float *src, int channels, int width, float *dst)
+        {
+            const __m256 cr = _mm256_set1_ps(0.212671f);
+            const __m256 cg = _mm256_set1_ps(0.715160f);
+            const __m256 cb = _mm256_set1_ps(0.072169f);
+
+            int x = 0;
+            if (channels == 3 || channels == 4)
+            {
+                for (; x + 8 <= width; x += 8)
+                {
+                    __m256 r, g, b, lum;
+                    if (channels == 4)
+                    {
+                        // Each register holds 2 pixels, the in-lane transpose yields
+                        // pixels in (0 2 4 6 | 1 3 5 7) order which is undone below.
+                        const float *p = src + x * 4;
+                        __m256 m0 = _mm256_loadu_ps(p);
+                        __m256 m1 = _mm256_loadu_ps(p + 8);
+                        __m256 m2 = _mm256_loadu_ps(p + 16);
+                        __m256 m3 = _mm256_loadu_ps(p + 24);
+                        __m256 t0 = _mm256_unpacklo_ps(m0, m1);
+                        __m256 t1 = _mm256_unpackhi_ps(m0, m1);
+                        __m256 t2 = _mm256_unpacklo_ps(m2, m3);
+                        __m256 t3 = _mm256_unpackhi_ps(m2, m3);
+                        r = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+                        g = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+                        b = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+                        lum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cr, r), _mm256_mul_ps(cg, g)), _mm256_mul_ps(cb, b));
+                        lum = _mm256_permutevar8x32_ps(lum, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+                    }
+                    else
+                    {
+                        __m128 r0, g0, b0, r1, g1, b1;
+                        loadRGB4(src + x * 3, &r0, &g0, &b0);
+                        loadRGB4(src + x * 3 + 12, &r1, &g1, &b1);
+                        r = _mm256_insertf128_ps(_mm256_castps128_ps256(r0), r1, 1);
+                        g = _mm256_insertf128_ps(_mm256_castps128_ps256(g0), g1, 1);
+                        b = _mm256_insertf128_ps(_mm256_castps128_ps256(b0), b1, 1);
+                        lum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cr, r), _mm256_mul_ps(cg, g)), _mm256_mul_ps(cb, b));
+                    }
+
+                    _mm256_storeu_ps(dst + x, lum);
+                }
+            }
+            finishLuminance(src, channels, x, width, dst);
+        }
+
+        IMAGEUTIL_TARGET("sse2")
+        static __m128d load2(const double *p)
+        {
+            return _mm_loadu_pd(p);
+        }
+
+        IMAGEUTIL_TARGET("sse2")
+        static __m128d load2(const float *p)
+        {
+            return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(p))));
+        }
+
+        IMAGEUTIL_TARGET("avx2")
+        static __m256d load4(const double *p)
+        {
+            return _mm256_loadu_pd(p);
+        }
+
+        IMAGEUTIL_TARGET("avx2")
+        static __m256d load4(const float *p)
+        {
+            return _mm256_cvtps_pd(_mm_loadu_ps(p));
+        }
+
+        IMAGEUTIL_TARGET("avx512f")
+        static __m512d load8(const double *p)
+        {
+            return _mm512_loadu_pd(p);
+        }
+
+        IMAGEUTIL_TARGET("avx512f")
+        static __m512d load8(const float *p)
+        {
+            return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+        }
+
+        template<typename T>
+        IMAGEUTIL_TARGET("sse2")
+        static void lanesSSE2(const T *data1, const T *data2, size_t count, int sets, ErrorLanes *lanes)
+        {
+            const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+            __m128d acc[3][4], maxv[3][4];
+            for (int set = 0; set < 3; ++set)
+                for (int k = 0; k < 4; ++k)
+                    acc[set][k] = maxv[set][k] = _mm_setzero_pd();
+
+            size_t i = 0;
+            for (int set = 0; i + 8 <= count; i += 8, set = set + 1 == sets ? 0 : set + 1)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    __m128d diff = _mm_sub_pd(load2(data1 + i + 2 * k), load2(data2 + i + 2 * k));
+                    acc[set][k] = _mm_add_pd(acc[set][k], _mm_mul_pd(diff, diff));
+                    maxv[set][k] = _mm_max_pd(_mm_and_pd(diff, absMask), maxv[set][k]);
+                }
+            }
+
+            for (int set = 0; set < 3; ++set)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    _mm_storeu_pd(lanes->sum[set] + 2 * k, acc[set][k]);
+                    _mm_storeu_pd(lanes->max[set] + 2 * k, maxv[set][k]);
+                }
+            }
+            finishLanes(data1, data2, i, count, sets, lanes);
+        }
+
+        template<typename T>
+        IMAGEUTIL_TARGET("avx2")
+        static void lanesAVX2(const T *data1, const T *data2, size_t count, int sets, ErrorLanes *lanes)
+        {
+            const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+            __m256d acc[3][2], maxv[3][2];
+            for (int set = 0; set < 3; ++set)
+                for (int k = 0; k < 2; ++k)
+                    acc[set][k] = maxv[set][k] = _mm256_setzero_pd();
+
+            size_t i = 0;
+            for (int set = 0; i + 8 <= count; i += 8, set = set + 1 == sets ? 0 : set + 1)
+            {
+                __m256d d0 = _mm256_sub_pd(load4(data1 + i), load4(data2 + i));
+                __m256d d1 = _mm256_sub_pd(load4(data1 + i + 4), load4(data2 + i + 4));
+                acc[set][0] = _mm256_add_pd(acc[set][0], _mm256_mul_pd(d0, d0));
+                acc[set][1] = _mm256_add_pd(acc[set][1], _mm256_mul_pd(d1, d1));
+                maxv[set][0] = _mm256_max_pd(_mm256_and_pd(d0, absMask), maxv[set][0]);
+                maxv[set][1] = _mm256_max_pd(_mm256_and_pd(d1, absMask), maxv[set][1]);
+            }
+
+            for (int set = 0; set < 3; ++set)
+            {
+                for (int k = 0; k < 2; ++k)
+                {
+                    _mm256_storeu_pd(lanes->sum[set] + 4 * k, acc[set][k]);
+                    _mm256_storeu_pd(lanes->max[set] + 4 * k, maxv[set][k]);
+                }
+            }
+            finishLanes(data1, data2, i, count, sets, lanes);
+        }
+
+        template<typename T>
+        IMAGEUTIL_TARGET("avx512f")
+        static void lanesAVX512(const T *data1, const T *data2, size_t count, int sets, ErrorLanes *lanes)
+        {
+            __m512d acc[3], maxv[3];
+            for (int set = 0; set < 3; ++set)
+                acc[set] = maxv[set] = _mm512_setzero_pd();
+
+            size_t i = 0;
+            for (int set = 0; i + 8 <= count; i += 8, set = set + 1 == sets ? 0 : set + 1)
+            {
+                __m512d diff = _mm512_sub_pd(load8(data1 + i), load8(data2 + i));
+                acc[set] = _mm512_add_pd(acc[set], _mm512_mul_pd(diff, diff));
+                maxv[set] = _mm512_max_pd(_mm512_abs_pd(diff), maxv[set]);
+            }
+
+            for (int set = 0; set < 3; ++set)
+            {
+                _mm512_storeu_pd(lanes->sum[set], acc[set]);
+                _mm512_storeu_pd(lanes->max[set], maxv[set]);
+            }
+            finishLanes(data1, data2, i, count, sets, lanes);
+        }
+
+        IMAGEUTIL_TARGET("sse2")
+        static size_t nonFiniteSSE2(const float *data, size_t count)
+        {
+            const __m128i exponent = _mm_set1_epi32(static_cast<int>(ExponentMask));
+            size_t found = 0, i = 0;
+            while (i + 4 <= count)
+            {
+                // Matching lanes are -1, so subtracting the compare counts them.
+                __m128i lanes = _mm_setzero_si128();
+                for (size_t block = 0; block < CountBlock && i + 4 <= count; ++block, i += 4)
+                {
+                    __m128i bits = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), exponent);
+                    lanes = _mm_sub_epi32(lanes, _mm_cmpeq_epi32(bits, exponent));
+                }
+                uint32_t counts[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(counts), lanes);
+                found += static_cast<size_t>(counts[0]) + counts[1] + counts[2] + counts[3];
+            }
+            return found + nonFiniteScalar(data + i, count - i);
+        }
+
+        IMAGEUTIL_TARGET("avx2")
+        static size_t nonFiniteAVX2(const float *data, size_t count)
+        {
+            const __m256i exponent = _mm256_set1_epi32(static_cast<int>(ExponentMask));
+            size_t found = 0, i = 0;
+            while (i + 8 <= count)
+            {
+                __m256i lanes = _mm256_setzero_si256();
+                for (size_t block = 0; block < CountBlock && i + 8 <= count; ++block, i += 8)
+                {
+                    __m256i bits = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), exponent);
+                    lanes = _mm256_sub_epi32(lanes, _mm256_cmpeq_epi32(bits, exponent));
+                }
+                uint32_t counts[8];
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(counts), lanes);
+                for (uint32_t lane : counts)
+                    found += lane;
+            }
+            return found + nonFiniteScalar(data + i, count - i);
+        }
+
+        IMAGEUTIL_TARGET("avx2,f16c")
+        static void halfF16C(const uint16_t *src, size_t count, float *dst)
+        {
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+                _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))));
+            halfScalar(src + i, count - i, dst + i);
+        }
+#endif
+
+#if defined(IMAGEUTIL_SIMD_NEON)
+        static void halfNEON(const uint16_t *src, size_t count, float *dst)
+        {
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+                vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+            halfScalar(src + i, count - i, dst + i);
+        }
+
+        static size_t nonFiniteNEON(const float *data, size_t count)
+        {
+            const uint32x4_t exponent = vdupq_n_u32(ExponentMask);
+            size_t found = 0, i = 0;
+            while (i + 4 <= count)
+            {
+                uint32x4_t lanes = vdupq_n_u32(0);
+                for (size_t block = 0; block < CountBlock && i + 4 <= count; ++block, i += 4)
+                {
+                    uint32x4_t bits = vandq_u32(vreinterpretq_u32_f32(vld1q_f32(data + i)), exponent);
+                    lanes = vsubq_u32(lanes, vceqq_u32(bits, exponent));
+                }
+                found += vaddvq_u32(lanes);
+            }
+            return found + nonFiniteScalar(data + i, count - i);
+        }
+
+        static void luminanceNEON(const float *src, int channels, int width, float *dst)
+        {
+            const float32x4_t cr = vdupq_n_f32(0.212671f);
+            const float32x4_t cg = vdupq_n_f32(0.715160f);
+            const float32x4_t cb = vdupq_n_f32(0.072169f);
+
+            int x = 0;
+            if (channels == 3 || channels == 4)
+            {
+                for (; x + 4 <= width; x += 4)
+                {
+                    float32x4_t r, g, b;
+                    if (channels == 4)
+                    {
+                        float32x4x4_t px = vld4q_f32(src + x * 4);
+                        r = px.val[0]; g = px.val[1]; b = px.val[2];
+                    }
+                    else
+                    {
+                        float32x4x3_t px = vld3q_f32(src + x * 3);
+                        r = px.val[0]; g = px.val[1]; b = px.val[2];
+                    }
+
+                    // Separate mul/add (no vmla/vfma) to match the scalar rounding.
+                    float32x4_t lum = vaddq_f32(vaddq_f32(vmulq_f32(cr, r), vmulq_f32(cg, g)), vmulq_f32(cb, b));
+                    vst1q_f32(dst + x, lum);
+                }
+            }
+            finishLuminance(src, channels, x, width, dst);
+        }
+
+        static float64x2_t load2(const double *p)
+        {
+            return vld1q_f64(p);
+        }
+
+        static float64x2_t load2(const float *p)
+        {
+            return vcvt_f64_f32(vld1_f32(p));
+        }
+
+        template<typename T>
+        static void lanesNEON(const T *data1, const T *data2, size_t count, int sets, ErrorLanes *lanes)
+        {
+            float64x2_t acc[3][4], maxv[3][4];
+            for (int set = 0; set < 3; ++set)
+                for (int k = 0; k < 4; ++k)
+                    acc[set][k] = maxv[set][k] = vdupq_n_f64(0.0);
+
+            size_t i = 0;
+            for (int set = 0; i + 8 <= count; i += 8, set = set + 1 == sets ? 0 : set + 1)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    float64x2_t diff = vsubq_f64(load2(data1 + i + 2 * k), load2(data2 + i + 2 * k));
+                    acc[set][k] = vaddq_f64(acc[set][k], vmulq_f64(diff, diff));
+                    maxv[set][k] = vmaxnmq_f64(maxv[set][k], vabsq_f64(diff));
+                }
+            }
+
+            for (int set = 0; set < 3; ++set)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    vst1q_f64(lanes->sum[set] + 2 * k, acc[set][k]);
+                    vst1q_f64(lanes->max[set] + 2 * k, maxv[set][k]);
+                }
+            }
+            finishLanes(data1, data2, i, count, sets, lanes);
+        }
+#endif
+    };
+}
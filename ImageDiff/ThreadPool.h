@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Fixed size worker pool used for concurrent decoding and scanline-parallel loops.
+     */
+    class ThreadPool
+    {
+    public:
+        /**
+         * @param threads Total number of threads doing work, the calling thread included.
+         */
+        explicit ThreadPool(unsigned threads = 1)
+        {
+            for (unsigned i = 1; i < threads; ++i)
+                workers.emplace_back([this] { workerLoop(); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wakeup.notify_all();
+            for (auto & worker : workers)
+                worker.join();
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool & operator=(const ThreadPool &) = delete;
+
+        unsigned threadCount() const
+        {
+            return static_cast<unsigned>(workers.size()) + 1;
+        }
+
+        /**
+         * @brief Whether the calling thread is one of the workers.
+         */
+        bool isWorkerThread() const
+        {
+            for (const auto & worker : workers)
+                if (worker.get_id() == std::this_thread::get_id())
+                    return true;
+            return false;
+        }
+
+        /**
+         * @brief Run task on a worker. Without workers the task runs immediately on the caller.
+         */
+        template<typename F>
+        std::future<typename std::result_of<F()>::type> submit(F task)
+        {
+            typedef typename std::result_of<F()>::type Result;
+            auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+            std::future<Result> result = packaged->get_future();
+
+            if (workers.empty())
+            {
+                (*packaged)();
+                return result;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back([packaged] { (*packaged)(); });
+            }
+            wakeup.notify_one();
+            return result;
+        }
+
+        /**
+         * @brief Run body(begin, end) over [0, count) split into chunks of grain items.
+         *        The caller works on chunks too and only waits for chunks already taken,
+         *        so parallelFor may be nested inside tasks of the same pool.
+         */
+        void parallelFor(int count, int grain, const std::function<void(int, int)> & body)
+        {
+            if (count <= 0)
+                return;
+            grain = std::max(grain, 1);
+            int chunks = (count + grain - 1) / grain;
+            if (workers.empty() || chunks == 1)
+            {
+                body(0, count);
+                return;
+            }
+
+            struct Progress
+            {
+                std::atomic<int> next;
+                std::atomic<int> done;
+                std::mutex mutex;
+                std::condition_variable finished;
+            };
+            auto progress = std::make_shared<Progress>();
+            progress->next = 0;
+            progress->done = 0;
+
+            // Helpers starting after every chunk was taken return without touching body.
+            const std::function<void(int, int)> *bodyPtr = &body;
+            auto work = [progress, chunks, count, grain, bodyPtr]()
+            {
+                int chunk;
+                while ((chunk = progress->next.fetch_add(1)) < chunks)
+                {
+                    (*bodyPtr)(chunk * grain, std::min(count, (chunk + 1) * grain));
+                    if (progress->done.fetch_add(1) + 1 == chunks)
+                    {
+                        std::lock_guard<std::mutex> lock(progress->mutex);
+                        progress->finished.notify_all();
+                    }
+                }
+            };
+
+            size_t helpers = std::min(workers.size(), static_cast<size_t>(chunks - 1));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = 0; i < helpers; ++i)
+                    tasks.push_back(work);
+            }
+            wakeup.notify_all();
+
+            work();
+
+            std::unique_lock<std::mutex> lock(progress->mutex);
+            progress->finished.wait(lock, [&progress, chunks] { return progress->done.load() == chunks; });
+        }
+
+    private:
+        void workerLoop()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool stopping = false;
+    };
+}
@@ -0,0 +1,467 @@
+#include "../ImageDiff/SimdKernels.h"
+#include "../ImageDiff/ContentHash.h"
+#include "../ImageDiff/ErrorHistogram.h"
+#include "../ImageDiff/Manifest.h"
+#include "../ImageDiff/FrameSequence.h"
+#include "../ImageDiff/ImageRMSE.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ImageUtil
+{
+    /**
+     * @brief Checks of the guarantees the ImageDiff headers document. Exits nonzero if
+     *        any check fails.
+     */
+    class Tests
+    {
+    public:
+        /**
+         * @return Number of failed checks.
+         */
+        static int run()
+        {
+            simdKernels();
+            contentHash();
+            errorHistogram();
+            json();
+            manifest();
+            shards();
+            frameSequence();
+            nanMask();
+            pixelFormats();
+            identicalPixels();
+            std::cout << checks() << " checks, " << failures() << " failed" << std::endl;
+            return failures();
+        }
+
+    private:
+        static int & checks()
+        {
+            static int count = 0;
+            return count;
+        }
+
+        static int & failures()
+        {
+            static int count = 0;
+            return count;
+        }
+
+        static void check(bool ok, const std::string & what)
+        {
+            ++checks();
+            if (ok)
+                return;
+            ++failures();
+            std::cerr << "FAILED: " << what << std::endl;
+        }
+
+        template<typename T>
+        static bool sameBits(const T & a, const T & b)
+        {
+            return std::memcmp(&a, &b, sizeof(T)) == 0;
+        }
+
+        template<typename T>
+        static bool sameBits(const std::vector<T> & a, const std::vector<T> & b)
+        {
+            return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+        }
+
+        /**
+         * @brief Deterministic values over several magnitudes and both signs.
+         */
+        static std::vector<float> samples(size_t count, uint32_t seed)
+        {
+            std::vector<float> values(count);
+            uint32_t state = seed;
+            for (float & value : values)
+            {
+                state = state * 1664525u + 1013904223u;
+                float unit = static_cast<float>(state >> 8) / static_cast<float>(1 << 24);
+                value = (unit - 0.25f) * static_cast<float>(1 << (state & 7));
+            }
+            return values;
+        }
+
+        /**
+         * @brief Outputs of every kernel on fixed inputs, compared across targets.
+         */
+        struct KernelOutputs
+        {
+            std::vector<float> luminance3, luminance4;
+            std::vector<SpanError> errorFloat, errorDouble, interleaved;
+            std::vector<float> halves;
+            std::vector<size_t> nonFinite;
+        };
+
+        static KernelOutputs kernelOutputs()
+        {
+            KernelOutputs outputs;
+            const int widths[] = { 1, 3, 7, 8, 15, 16, 17, 31, 33, 63, 65, 1000 };
+            for (int width : widths)
+            {
+                for (int channels = 3; channels <= 4; ++channels)
+                {
+                    std::vector<float> rgb = samples(static_cast<size_t>(width) * channels, 7u * width + channels);
+                    std::vector<float> luminance(width);
+                    SimdKernels::luminanceScanline(rgb.data(), channels, width, luminance.data());
+                    std::vector<float> & all = channels == 3 ? outputs.luminance3 : outputs.luminance4;
+                    all.insert(all.end(), luminance.begin(), luminance.end());
+                }
+            }
+
+            const size_t counts[] = { 0, 1, 5, 8, 9, 31, 64, 100, 4099 };
+            for (size_t count : counts)
+            {
+                std::vector<float> a = samples(count, 11u + static_cast<uint32_t>(count)), b = samples(count, 13u + static_cast<uint32_t>(count));
+                outputs.errorFloat.push_back(SimdKernels::spanError(a.data(), b.data(), count));
+                std::vector<double> da(a.begin(), a.end()), db(b.begin(), b.end());
+                for (size_t i = 0; i < count; ++i)
+                    da[i] += 1e-9 * static_cast<double>(i);
+                outputs.errorDouble.push_back(SimdKernels::spanError(da.data(), db.data(), count));
+                for (int channels = 1; channels <= 4; ++channels)
+                {
+                    std::vector<float> pa = samples(count * channels, 17u + channels), pb = samples(count * channels, 19u + channels);
+                    SpanError perChannel[4];
+                    SimdKernels::interleavedError(pa.data(), pb.data(), count, channels, perChannel);
+                    outputs.interleaved.insert(outputs.interleaved.end(), perChannel, perChannel + channels);
+                }
+            }
+
+            std::vector<uint16_t> halves(1 << 16);
+            for (size_t i = 0; i < halves.size(); ++i)
+                halves[i] = static_cast<uint16_t>(i);
+            outputs.halves.resize(halves.size());
+            SimdKernels::halfToFloat(halves.data(), halves.size(), outputs.halves.data());
+
+            std::vector<float> values = samples(1000, 23u);
+            for (size_t i = 0; i < values.size(); i += 37)
+                values[i] = i % 2 ? std::numeric_limits<float>::infinity() : std::numeric_limits<float>::quiet_NaN();
+            for (size_t count : counts)
+                outputs.nonFinite.push_back(SimdKernels::nonFiniteCount(values.data(), std::min(count, values.size())));
+            return outputs;
+        }
+
+        static bool sameErrors(const std::vector<SpanError> & a, const std::vector<SpanError> & b)
+        {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); ++i)
+                if (!sameBits(a[i].sumSquaredError, b[i].sumSquaredError) || !sameBits(a[i].maxAbsDiff, b[i].maxAbsDiff))
+                    return false;
+            return true;
+        }
+
+        static void simdKernels()
+        {
+            const SimdKernels::Target original = SimdKernels::target();
+            SimdKernels::setTarget(SimdKernels::Scalar);
+            const KernelOutputs reference = kernelOutputs();
+
+            bool exactHalves = true;
+            for (size_t i = 0; i < reference.halves.size(); ++i)
+                exactHalves &= sameBits(reference.halves[i], SimdKernels::halfToFloat(static_cast<uint16_t>(i)));
+            check(exactHalves, "halfToFloat span matches the single value conversion");
+            check(SimdKernels::halfToFloat(SimdKernels::floatToHalf(0.333f)) == SimdKernels::halfToFloat(static_cast<uint16_t>(0x3554)),
+                  "floatToHalf rounds to nearest");
+
+            for (int t = SimdKernels::SSE2; t <= SimdKernels::NEON; ++t)
+            {
+                const SimdKernels::Target target = static_cast<SimdKernels::Target>(t);
+                if (SimdKernels::setTarget(target) != target)
+                    continue;
+                const std::string name = SimdKernels::targetName(target);
+                const KernelOutputs outputs = kernelOutputs();
+                check(sameBits(outputs.luminance3, reference.luminance3), name + " RGB luminance is bit-identical to scalar");
+                check(sameBits(outputs.luminance4, reference.luminance4), name + " RGBA luminance is bit-identical to scalar");
+                check(sameErrors(outputs.errorFloat, reference.errorFloat), name + " float span error is bit-identical to scalar");
+                check(sameErrors(outputs.errorDouble, reference.errorDouble), name + " double span error is bit-identical to scalar");
+                check(sameErrors(outputs.interleaved, reference.interleaved), name + " interleaved error is bit-identical to scalar");
+                check(sameBits(outputs.halves, reference.halves), name + " halfToFloat is bit-identical to scalar");
+                check(outputs.nonFinite == reference.nonFinite, name + " nonFiniteCount matches scalar");
+            }
+            SimdKernels::setTarget(original);
+        }
+
+        static std::string xxh64(const std::string & text, uint64_t seed = 0)
+        {
+            ContentHash hash(seed);
+            hash.update(text.data(), text.size());
+            return ContentHash::hex(hash.digest());
+        }
+
+        static void contentHash()
+        {
+            // Reference XXH64 outputs.
+            check(xxh64("") == "ef46db3751d8e999", "XXH64 of the empty string");
+            check(xxh64("a") == "d24ec4f1a98c6e5b", "XXH64 of \"a\"");
+            check(xxh64("abc") == "44bc2cf5ad770999", "XXH64 of \"abc\"");
+            check(xxh64("Nobody inspects the spammish repetition") == "fbcea83c8a378bf1", "XXH64 of a 39 byte string");
+
+            std::string data;
+            for (int i = 0; i < 1000; ++i)
+                data += static_cast<char>((i * 31 + 7) & 0xff);
+            const size_t chunks[] = { 1, 3, 31, 32, 33, 100 };
+            for (size_t chunk : chunks)
+            {
+                ContentHash hash(42);
+                for (size_t i = 0; i < data.size(); i += chunk)
+                    hash.update(data.data() + i, std::min(chunk, data.size() - i));
+                check(ContentHash::hex(hash.digest()) == xxh64(data, 42), "XXH64 fed in " + std::to_string(chunk) + " byte chunks matches one update");
+            }
+            check(xxh64(data, 0) != xxh64(data, 1), "XXH64 depends on the seed");
+        }
+
+        static void errorHistogram()
+        {
+            ErrorHistogram empty;
+            check(std::isnan(empty.percentile(50.0)), "percentile of an empty histogram is NaN");
+
+            std::vector<float> errors;
+            for (int i = 1; i <= 10000; ++i)
+                errors.push_back(static_cast<float>(i) * 1e-4f);
+            ErrorHistogram all(0.5), first(0.5), second(0.5);
+            for (size_t i = 0; i < errors.size(); ++i)
+            {
+                all.add(errors[i]);
+                (i % 3 ? first : second).add(errors[i]);
+            }
+            ErrorHistogram merged(0.5);
+            merged.merge(second);
+            merged.merge(first);
+            check(merged.count() == all.count() && merged.countAbove() == all.countAbove(), "merged counts match a single histogram");
+
+            bool samePercentiles = true;
+            for (double p : { 0.0, 1.0, 50.0, 99.0, 99.9, 100.0 })
+                samePercentiles &= merged.percentile(p) == all.percentile(p);
+            check(samePercentiles, "merged percentiles match a single histogram");
+
+            for (double p : { 10.0, 50.0, 90.0, 99.0 })
+            {
+                double exact = static_cast<double>(errors[static_cast<size_t>(std::ceil(p / 100.0 * errors.size())) - 1]);
+                check(std::abs(all.percentile(p) - exact) <= exact / 64.0, "p" + std::to_string(static_cast<int>(p)) + " is within 1/64 of the exact percentile");
+            }
+            check(all.countAbove() == 5000, "countAbove counts errors above the threshold exactly");
+
+            ErrorHistogram special;
+            special.add(0.f);
+            special.add(std::numeric_limits<float>::quiet_NaN());
+            special.addZeros(2);
+            check(special.count() == 4 && special.percentile(75.0) == 0.0, "zeros land in the first bin");
+            check(std::isinf(special.percentile(100.0)), "NaN counts as infinite");
+            special.removeZeros(3);
+            check(special.count() == 1, "removeZeros takes back zeros");
+        }
+
+        static void json()
+        {
+            std::map<std::string, std::string> values;
+            check(Json::parseObject("{ \"a\": \"x\\\"y\", \"n\": 1.5, \"b\": true }", &values) &&
+                  values["a"] == "x\"y" && values["n"] == "1.5" && values["b"] == "true", "flat object with string, number and literal");
+
+            const std::string text = std::string("q\"uote \\ back\nline\ttab\x01") + "end";
+            values.clear();
+            check(Json::parseObject("{\"k\":" + Json::quote(text) + "}", &values) && values["k"] == text, "quote() round-trips through parseObject()");
+
+            values.clear();
+            check(Json::parseObject("{\"u\":\"\\u0041\"}", &values) && values["u"] == "A", "\\u escapes");
+            for (const char *malformed : { "", "{", "{\"a\"}", "{\"a\":}", "{\"a\":\"x}", "[1]" })
+            {
+                std::map<std::string, std::string> ignored;
+                check(!Json::parseObject(malformed, &ignored), std::string("rejects malformed JSON ") + malformed);
+            }
+            check(Json::number(std::numeric_limits<double>::quiet_NaN()) == "null" &&
+                  Json::number(std::numeric_limits<double>::infinity()) == "null", "non-finite numbers are written as null");
+            check(std::atof(Json::number(0.1).c_str()) == 0.1, "numbers round-trip");
+        }
+
+        static void manifest()
+        {
+            ManifestEntry entry;
+            bool header = false;
+            std::string error;
+            check(Manifest::parseEntry("{\"candidate\":\"c.exr\",\"reference\":\"r.exr\",\"diff\":\"d.exr\",\"peak\":2}", &entry, &header, &error) &&
+                  !header && entry.candidate == "c.exr" && entry.reference == "r.exr" && entry.options.size() == 2 &&
+                  entry.options["diff"] == "d.exr" && entry.options["peak"] == "2", "JSON entry with options");
+
+            entry = ManifestEntry();
+            check(Manifest::parseEntry("\"a, b.exr\" , \"say \"\"x\"\".exr\",d.exr", &entry, &header, &error) &&
+                  entry.candidate == "a, b.exr" && entry.reference == "say \"x\".exr" && entry.options["diff"] == "d.exr", "CSV entry with quoted fields");
+
+            entry = ManifestEntry();
+            check(Manifest::parseEntry("candidate,reference,diff", &entry, &header, &error) && header, "CSV header line");
+
+            entry = ManifestEntry();
+            check(!Manifest::parseEntry("c.exr", &entry, &header, &error) && !error.empty(), "entry without reference is rejected");
+            entry = ManifestEntry();
+            check(!Manifest::parseEntry("{\"candidate\":", &entry, &header, &error), "malformed JSON entry is rejected");
+            check(Manifest::trim(" \t x y \r\n") == "x y", "trim");
+        }
+
+        static void shards()
+        {
+            std::vector<ManifestEntry> entries;
+            for (int i = 0; i < 100; ++i)
+            {
+                ManifestEntry entry;
+                entry.candidate = "c" + std::to_string(i) + ".exr";
+                entry.reference = "r" + std::to_string(i % (i < 50 ? 3 : 11)) + ".exr";
+                entries.push_back(entry);
+            }
+
+            for (int count : { 1, 2, 3, 7 })
+            {
+                std::vector<int> owner(entries.size(), -1);
+                bool disjoint = true, sameReferenceShard = true, repeatable = true;
+                std::map<std::string, int> referenceShard;
+                for (int shard = 0; shard < count; ++shard)
+                {
+                    std::vector<size_t> indices = Manifest::shard(entries, shard, count);
+                    repeatable &= indices == Manifest::shard(entries, shard, count);
+                    for (size_t i : indices)
+                    {
+                        disjoint &= owner[i] == -1;
+                        owner[i] = shard;
+                        auto known = referenceShard.insert(std::make_pair(entries[i].reference, shard));
+                        sameReferenceShard &= known.first->second == shard;
+                    }
+                }
+                const std::string name = std::to_string(count) + " shards";
+                check(disjoint, name + " are disjoint");
+                check(std::find(owner.begin(), owner.end(), -1) == owner.end(), name + " cover every entry");
+                check(sameReferenceShard, name + " keep each reference on one shard");
+                check(repeatable, name + " are the same on every call");
+            }
+        }
+
+        static void frameSequence()
+        {
+            check(FrameSequence::path("shot.####.exr", 7) == "shot.0007.exr", "# placeholder is zero padded");
+            check(FrameSequence::path("shot.%04d.exr", 42) == "shot.0042.exr", "%04d placeholder");
+            check(FrameSequence::path("shot.%d.exr", 42) == "shot.42.exr", "%d placeholder");
+            check(FrameSequence::path("f.##.exr", 123) == "f.123.exr", "frames wider than the placeholder aren't cut");
+            check(FrameSequence::path("a#b#.exr", 5) == "a5b#.exr", "only the first placeholder is replaced");
+            check(FrameSequence::path("still.exr", 9) == "still.exr" && !FrameSequence::hasPlaceholder("still.exr"), "pattern without placeholder");
+            check(FrameSequence::hasPlaceholder("x.%3d.exr") && !FrameSequence::hasPlaceholder("100%.exr"), "hasPlaceholder");
+
+            int first = -1, last = -1;
+            check(FrameSequence::parseRange("1-240", &first, &last) && first == 1 && last == 240, "frame range");
+            check(FrameSequence::parseRange("5", &first, &last) && first == 5 && last == 5, "single frame");
+            for (const char *invalid : { "", "3-1", "a-b", "-5", "1-", "1-2-3" })
+                check(!FrameSequence::parseRange(invalid, &first, &last), std::string("rejects frame range ") + invalid);
+        }
+
+        static void nanMask()
+        {
+            const float nan = std::numeric_limits<float>::quiet_NaN();
+            std::vector<float> reference(4 * 8 * 4, 0.5f), candidate(reference.size(), nan), partial(reference);
+            for (size_t i = 0; i < partial.size(); i += 12)
+                partial[i] = nan;
+            const ImageBuffer ref(reference.data(), 8, 4, PixelFormat::RGBA32F);
+            CompareOptions options;
+            options.metrics.psnr = options.metrics.ssim = true;
+
+            const NanPolicy original = ImageRMSE::nanPolicy();
+            ImageRMSE::setNanPolicy(NanPolicy::Mask);
+            ComparisonResult result = ImageRMSE::compare(ImageBuffer(candidate.data(), 8, 4, PixelFormat::RGBA32F), ref, options);
+            check(!result.ok && !result.error.empty() && result.metrics.pixelCount == 0 && result.metrics.nonFinite == 32,
+                  "a candidate with every pixel masked is not compared");
+            result = ImageRMSE::compare(ImageBuffer(partial.data(), 8, 4, PixelFormat::RGBA32F), ref, options);
+            check(result.ok && result.metrics.pixelCount == 32 - 11 && result.metrics.rmse() == 0.0 && result.quality.ssim == 1.0,
+                  "masked pixels are left out of the pixel count");
+            ImageRMSE::setNanPolicy(original);
+        }
+
+        static void pixelFormats()
+        {
+            std::vector<uint8_t> unorm8(4 * 16 * 16);
+            std::vector<uint16_t> unorm16(unorm8.size());
+            for (size_t i = 0; i < unorm8.size(); ++i)
+            {
+                unorm8[i] = static_cast<uint8_t>(i * 7);
+                unorm16[i] = static_cast<uint16_t>(unorm8[i] * 257);
+            }
+            ComparisonResult result = ImageRMSE::compare(ImageBuffer(unorm16.data(), 16, 16, PixelFormat::RGBA16), ImageBuffer(unorm8.data(), 16, 16, PixelFormat::RGBA8));
+            check(result.ok && result.metrics.sumSquaredError == 0.0, "16-bit and 8-bit codes of the same value decode alike");
+
+            check(Unorm8Samples::decodeSample(0) == 0.f && Unorm8Samples::decodeSample(255) == 1.f &&
+                  Unorm16Samples::decodeSample(0) == 0.f && Unorm16Samples::decodeSample(65535) == 1.f, "sRGB decode keeps black and white");
+            check(std::abs(Unorm8Samples::decodeSample(188) - 0.5029f) < 1e-4f && std::abs(Unorm16Samples::decodeSample(188 * 257) - 0.5029f) < 1e-4f,
+                  "colour samples are decoded from sRGB");
+            check(Unorm8Samples::decodeAlpha(51) == 0.2f && Unorm16Samples::decodeAlpha(13107) == 0.2f, "alpha stays linear");
+        }
+
+        /**
+         * @return Whether the Profiler::write() output has a record of stage on file with counter.
+         */
+        static bool recorded(const std::string & profile, const std::string & stage, const std::string & file, const std::string & counter)
+        {
+            std::istringstream lines(profile);
+            std::string line;
+            while (std::getline(lines, line))
+                if (line.find("\"stage\":" + Json::quote(stage)) != std::string::npos &&
+                    line.find("\"file\":" + Json::quote(file)) != std::string::npos && line.find(counter) != std::string::npos)
+                    return true;
+            return false;
+        }
+
+        /**
+         * @brief Files with the same pixels and different metadata skip the metric pass.
+         */
+        static void identicalPixels()
+        {
+            const std::string plain = "imagetests_plain.png", tagged = "imagetests_tagged.png", edited = "imagetests_edited.png";
+            FIBITMAP *bitmap = FreeImage_Allocate(32, 16, 32);
+            for (int y = 0; y < 16; ++y)
+            {
+                BYTE *bits = FreeImage_GetScanLine(bitmap, y);
+                for (int x = 0; x < 32 * 4; ++x)
+                    bits[x] = static_cast<BYTE>(x * 3 + y * 5);
+            }
+            bool saved = FreeImage_Save(FIF_PNG, bitmap, plain.c_str()) != 0;
+            FreeImage_SetMetadataKeyValue(FIMD_COMMENTS, bitmap, "Comment", "second export");
+            saved = saved && FreeImage_Save(FIF_PNG, bitmap, tagged.c_str()) != 0;
+            FreeImage_GetScanLine(bitmap, 3)[4] ^= 1;
+            saved = saved && FreeImage_Save(FIF_PNG, bitmap, edited.c_str()) != 0;
+            FreeImage_Unload(bitmap);
+            check(saved, "writes the PNG test files");
+
+            Profiler::reset();
+            Profiler::setEnabled(true);
+            ComparisonResult same = ImageRMSE::compare(tagged, plain);
+            ComparisonResult different = ImageRMSE::compare(edited, plain);
+            Profiler::setEnabled(false);
+            std::ostringstream profile;
+            Profiler::write(profile);
+            Profiler::reset();
+            const std::string stages = profile.str();
+
+            // The metadata makes the files differ, so identicalPixels() only runs if identicalFiles() didn't match.
+            check(same.ok && same.metrics.sumSquaredError == 0.0 && same.metrics.pixelCount == 32 * 16, "equal pixels compare equal");
+            check(recorded(stages, "identicalPixels", tagged, "\"identical\":1"), "equal pixels are found by identicalPixels()");
+            check(different.ok && different.metrics.sumSquaredError > 0.0 && recorded(stages, "identicalPixels", edited, "\"identical\":0"),
+                  "a changed pixel goes through the metric pass");
+            std::remove(plain.c_str());
+            std::remove(tagged.c_str());
+            std::remove(edited.c_str());
+        }
+    };
+}
+
+int main()
+{
+    return ImageUtil::Tests::run() == 0 ? 0 : 1;
+}
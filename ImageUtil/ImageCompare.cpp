@@ -0,0 +1,67 @@
+#include "ImageCompare.h"
+#include "../ImageDiff/ImageRMSE.h"
+
+namespace ImageUtil
+{
+    namespace
+    {
+        CompareOptions compareOptions(const ImageCompare::Options & options)
+        {
+            CompareOptions converted;
+            converted.roi = options.roi;
+            converted.metrics = options.metrics;
+            converted.diffFilename = options.diffFilename;
+            converted.diffFormat = DiffFormat::Float;
+            return converted;
+        }
+
+        ImageCompare::Result result(const ComparisonResult & comparison)
+        {
+            ImageCompare::Result converted;
+            converted.ok = comparison.ok;
+            converted.error = comparison.error;
+            converted.warnings = comparison.warnings;
+            converted.nonFinite = comparison.metrics.nonFinite;
+            if (comparison.metrics.pixelCount)
+            {
+                const ErrorMetrics & metrics = comparison.metrics;
+                converted.rmse = metrics.rmse();
+                converted.mse = metrics.sumSquaredError / metrics.pixelCount;
+                converted.maxDiff = metrics.maxDiff;
+                converted.maxDiffIndex = metrics.maxDiffIndex;
+                converted.pixelCount = metrics.pixelCount;
+            }
+            converted.quality = comparison.quality;
+            return converted;
+        }
+    }
+
+    ImageCompare::Result ImageCompare::compare(const ImageBuffer & candidate, const ImageBuffer & reference, const Options & options)
+    {
+        return result(ImageRMSE::compare(candidate, reference, compareOptions(options)));
+    }
+
+    ImageCompare::Result ImageCompare::compare(FIBITMAP *candidate, FIBITMAP *reference, const Options & options)
+    {
+        return result(ImageRMSE::compare(candidate, reference, compareOptions(options)));
+    }
+
+    ImageCompare::Result ImageCompare::compareFiles(const std::string & candidate, const std::string & reference, const Options & options)
+    {
+        return result(ImageRMSE::compare(candidate, reference, compareOptions(options)));
+    }
+
+    void ImageCompare::setThreadCount(unsigned threads)
+    {
+        ImageRMSE::setThreadCount(threads);
+    }
+
+    bool ImageCompare::setNanPolicy(const std::string & name)
+    {
+        NanPolicy policy;
+        if (!ImageRMSE::parseNanPolicy(name, &policy))
+            return false;
+        ImageRMSE::setNanPolicy(policy);
+        return true;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../ImageDiff/ImageBuffer.h"
+#include "../ImageDiff/ImageMetrics.h"
+
+#include <limits>
+#include <string>
+#include <vector>
+
+/* Define IMAGEUTIL_SHARED when building or using ImageUtil as a DLL, and
+   IMAGEUTIL_EXPORTS when building it. The static library needs neither. */
+#if defined(IMAGEUTIL_SHARED) && defined(_WIN32)
+#if defined(IMAGEUTIL_EXPORTS)
+#define IMAGEUTIL_API __declspec(dllexport)
+#else
+#define IMAGEUTIL_API __declspec(dllimport)
+#endif
+#elif defined(IMAGEUTIL_SHARED) && defined(__GNUC__)
+#define IMAGEUTIL_API __attribute__((visibility("default")))
+#else
+#define IMAGEUTIL_API
+#endif
+
+struct FIBITMAP;
+
+namespace ImageUtil
+{
+    /**
+     * @brief Linkable comparison API of the ImageUtil library. Unlike ImageRMSE.h it
+     *        pulls in neither FreeImage nor the kernels, so renderers can compare a
+     *        frame that is already in memory without writing it to disk first.
+     */
+    class IMAGEUTIL_API ImageCompare
+    {
+    public:
+        struct Options
+        {
+            /* Compared region, empty for the whole image. */
+            Region roi;
+            /* Quality metrics computed next to RMSE. */
+            MetricSelection metrics;
+            /* Output path of a single channel float diff EXR, empty for none. */
+            std::string diffFilename;
+        };
+
+        /**
+         * @brief Outcome of a comparison, error is set when ok is false.
+         */
+        struct Result
+        {
+            bool ok = false;
+            std::string error;
+            /* Messages that don't fit error, e.g. NaN/Inf pixels in the reference or why a
+               file failed to load. The library itself never prints. */
+            std::vector<std::string> warnings;
+            double rmse = std::numeric_limits<double>::quiet_NaN();
+            double mse = std::numeric_limits<double>::quiet_NaN();
+            double maxDiff = std::numeric_limits<double>::quiet_NaN();
+            /* Pixel index of maxDiff, relative to the region. */
+            int maxDiffIndex = -1;
+            size_t pixelCount = 0;
+            /* NaN/Inf luminance pixels of the candidate. */
+            size_t nonFinite = 0;
+            QualityMetrics quality;
+        };
+
+        /**
+         * @brief Compare caller-owned pixels, which are only read during the call.
+         */
+        static Result compare(const ImageBuffer & candidate, const ImageBuffer & reference, const Options & options = Options());
+
+        /**
+         * @brief Compare caller-owned FreeImage bitmaps (float, 16-bit or 8-bit RGB(A) or grey).
+         */
+        static Result compare(FIBITMAP *candidate, FIBITMAP *reference, const Options & options = Options());
+
+        /**
+         * @brief Compare image files, the decoded reference is cached across calls.
+         */
+        static Result compareFiles(const std::string & candidate, const std::string & reference, const Options & options = Options());
+
+        /**
+         * @brief Threads used by the comparisons (1 = serial), results don't depend on it.
+         *        May be called while other threads compare.
+         */
+        static void setThreadCount(unsigned threads);
+
+        /**
+         * @brief Handling of NaN/Inf pixels: count (the default), clamp, mask or fail.
+         *        Comparisons running while it changes may see either policy.
+         * @return False for an unknown name.
+         */
+        static bool setNanPolicy(const std::string & name);
+    };
+}